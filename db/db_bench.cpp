@@ -10,6 +10,8 @@
 #include "softdb/db.h"
 #include "softdb/env.h"
 //#include "filter_policy.h"
+#include "softdb/merge_policy.h"
+#include "softdb/slice_transform.h"
 #include "softdb/write_batch.h"
 #include "port/port.h"
 #include "util/crc32c.h"
@@ -21,14 +23,18 @@
 // Comma-separated list of operations to run in the specified order
 //   Actual benchmarks:
 //      fillseq       -- write N values in sequential key order in async mode
+//      ingestseq     -- load N values in sequential key order by
+//                       DB::IngestSortedRuns() in --ingest_runs runs
 //      fillrandom    -- write N values in random key order in async mode
 //      overwrite     -- overwrite N values in random key order in async mode
 //      fillsync      -- write N/100 values in random key order in sync mode
 //      fill100K      -- write N/1000 100K values in random order in async mode
 //      deleteseq     -- delete N keys in sequential order
 //      deleterandom  -- delete N keys in random order
-//      readseq       -- read N times sequentially
+//      readseq       -- read N times sequentially, by NextBatch() if --scan_batch > 0
 //      readreverse   -- read N times in reverse order
+//      readseqparallel -- scan the DB once by --threads threads, each thread
+//                         scans its own partition from DB::PartitionRange
 //      readrandom    -- read N times in random order
 //      readmissing   -- read N missing keys in random order
 //      readhot       -- read N times in random order from 1% section of DB
@@ -124,17 +130,69 @@ static bool FLAGS_use_existing_db = false;
 // If true, reuse existing log/MANIFEST files when re-opening a database.
 static bool FLAGS_reuse_logs = false;
 
+// If true, write the log through mmap'd preallocated files.
+static bool FLAGS_use_mmap_log = false;
+
+// If true, log a write group while the previous one is inserted.
+static bool FLAGS_pipelined_write = false;
+
+// If true, writes do not go through the log.
+static bool FLAGS_disable_wal = false;
+
+// If true, flushed memtables hand their arenas over to nvm tables.
+static bool FLAGS_zero_copy_flush = false;
+
 // Use the db with the following name.
 static const char* FLAGS_db = nullptr;
 
 // Maximum number of interval overlaps allowed.
 static int FLAGS_max_overlap = 2;
 
+// If true, point queries stab a flat copy of the nvm index.
+static bool FLAGS_flat_index = false;
+
+// Number of key ranges the nvm index is split into.
+static int FLAGS_index_partitions = 1;
+
+// If true, merges cut their output at guard keys.
+static bool FLAGS_merge_guards = false;
+
+// Merge policy of nvm data: "all", "tiered" or "leveled".
+static const char* FLAGS_merge_policy = "all";
+
+// Size ratio of the tiered and leveled merge policies.
+static double FLAGS_merge_size_ratio = 1.0;
+
+// Maximum number of threads a merge is split across.
+static int FLAGS_max_subcompactions = 1;
+
 static uint64_t FLAGS_peak = 100;
 
 // Set true if use cuckoo hash, otherwise use bloom filter default.
 static bool FLAGS_use_cuckoo = true;
 
+// Filter used when use_cuckoo is false: "cuckoo" or "xor".
+static const char* FLAGS_filter_type = "cuckoo";
+
+// Fingerprint width in bits of the filter.
+static int FLAGS_filter_bits = 32;
+
+// If > 0, build prefix filters on the first prefix_size bytes of keys
+// and let seekrandom do prefix seeks.
+static int FLAGS_prefix_size = 0;
+
+// Set true to build range filters for nvm_imm_s.
+static bool FLAGS_use_range_filter = false;
+
+// If > 0, seekrandom scans [k, k + seek_range) with iterate_upper_bound.
+static int FLAGS_seek_range = 0;
+
+// If > 0, readseq reads scan_batch entries per Iterator::NextBatch() call.
+static int FLAGS_scan_batch = 0;
+
+// Number of runs ingestseq splits its keys into.
+static int FLAGS_ingest_runs = 4;
+
 namespace softdb {
 
     namespace {
@@ -268,6 +326,11 @@ namespace softdb {
                 }
             }
 
+            // For benchmarks doing all their ops in one call.
+            void FinishedOps(int n) {
+                done_ += n;
+            }
+
             void AddBytes(int64_t n) {
                 bytes_ += n;
             }
@@ -340,6 +403,8 @@ namespace softdb {
     private:
         //Cache* cache_;
         //const FilterPolicy* filter_policy_;
+        const SliceTransform* prefix_extractor_;
+        const MergePolicy* merge_policy_;
         DB* db_;
         int num_;
         int value_size_;
@@ -348,6 +413,8 @@ namespace softdb {
         ReadOptions read_options_;
         int reads_;
         int heap_counter_;
+        const Snapshot* scan_snapshot_;         // shared by readseqparallel
+        std::vector<std::string> scan_splits_;  // partitions of readseqparallel
 
         void PrintHeader() {
             const int kKeySize = 16;
@@ -429,12 +496,21 @@ namespace softdb {
                   //filter_policy_(FLAGS_bloom_bits >= 0
                   //               ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                   //               : nullptr),
+                  prefix_extractor_(FLAGS_prefix_size > 0
+                                    ? NewFixedPrefixTransform(FLAGS_prefix_size)
+                                    : nullptr),
+                  merge_policy_(strcmp(FLAGS_merge_policy, "tiered") == 0
+                                ? NewTieredMergePolicy(FLAGS_merge_size_ratio)
+                                : strcmp(FLAGS_merge_policy, "leveled") == 0
+                                  ? NewLeveledMergePolicy(FLAGS_merge_size_ratio)
+                                  : nullptr),
                   db_(nullptr),
                   num_(FLAGS_num),
                   value_size_(FLAGS_value_size),
                   entries_per_batch_(1),
                   reads_(FLAGS_reads < 0 ? FLAGS_num : FLAGS_reads),
-                  heap_counter_(0) {
+                  heap_counter_(0),
+                  scan_snapshot_(nullptr) {
             std::vector<std::string> files;
             g_env->GetChildren(FLAGS_db, &files);
             for (size_t i = 0; i < files.size(); i++) {
@@ -459,6 +535,8 @@ namespace softdb {
             delete db_;
             //delete cache_;
             //delete filter_policy_;
+            delete prefix_extractor_;
+            delete merge_policy_;
         }
 
         void Run() {
@@ -483,6 +561,7 @@ namespace softdb {
                 value_size_ = FLAGS_value_size;
                 entries_per_batch_ = 1;
                 write_options_ = WriteOptions();
+                write_options_.disable_wal = FLAGS_disable_wal;
 
                 void (Benchmark::*method)(ThreadState*) = nullptr;
                 bool fresh_db = false;
@@ -495,6 +574,10 @@ namespace softdb {
                 } else if (name == Slice("fillseq")) {
                     fresh_db = true;
                     method = &Benchmark::WriteSeq;
+                } else if (name == Slice("ingestseq")) {
+                    fresh_db = true;
+                    num_threads = 1;
+                    method = &Benchmark::IngestSeq;
                 } else if (name == Slice("fillbatch")) {
                     fresh_db = true;
                     entries_per_batch_ = 1000;
@@ -522,6 +605,10 @@ namespace softdb {
                     method = &Benchmark::ReadSequential;
                 } else if(name == Slice("readseqsnapshot")) {
                     method = &Benchmark::ReadSequentialSnapshot;
+                } else if (name == Slice("readseqparallel")) {
+                    method = &Benchmark::ReadSequentialParallel;
+                    scan_snapshot_ = db_->GetSnapshot();
+                    db_->PartitionRange(Range(), num_threads, &scan_splits_);
                 } else if (name == Slice("readreverse")) {
                     method = &Benchmark::ReadReverse;
                 } else if (name == Slice("readreversesnapshot")) {
@@ -591,6 +678,11 @@ namespace softdb {
                 if (method != nullptr) {
                     RunBenchmark(num_threads, name, method);
                 }
+
+                if (scan_snapshot_ != nullptr) {
+                    db_->ReleaseSnapshot(scan_snapshot_);
+                    scan_snapshot_ = nullptr;
+                }
             }
         }
 
@@ -761,9 +853,22 @@ namespace softdb {
             //options.max_open_files = FLAGS_open_files;
             //options.filter_policy = filter_policy_;
             options.reuse_logs = FLAGS_reuse_logs;
+            options.use_mmap_log = FLAGS_use_mmap_log;
+            options.pipelined_write = FLAGS_pipelined_write;
+            options.zero_copy_flush = FLAGS_zero_copy_flush;
             options.max_overlap = FLAGS_max_overlap;
+            options.flat_index = FLAGS_flat_index;
+            options.index_partitions = FLAGS_index_partitions;
+            options.merge_guards = FLAGS_merge_guards;
+            options.merge_policy = merge_policy_;
+            options.max_subcompactions = FLAGS_max_subcompactions;
             options.peak = FLAGS_peak;
             options.use_cuckoo = FLAGS_use_cuckoo;
+            options.filter_type = (strcmp(FLAGS_filter_type, "xor") == 0) ?
+                                  kXorFilter : kCuckooFilter;
+            options.filter_bits = FLAGS_filter_bits;
+            options.prefix_extractor = prefix_extractor_;
+            options.use_range_filter = FLAGS_use_range_filter;
             Status s = DB::Open(options, FLAGS_db, &db_);
             if (!s.ok()) {
                 fprintf(stderr, "open error: %s\n", s.ToString().c_str());
@@ -818,7 +923,66 @@ namespace softdb {
             thread->stats.AddBytes(bytes);
         }
 
+        // Sequential keys [begin, end) for IngestSeq.
+        class SeqRun : public Iterator {
+        public:
+            SeqRun(int begin, int end, int value_size)
+                    : begin_(begin), end_(end), value_size_(value_size), k_(begin) { }
+
+            virtual bool Valid() const { return k_ < end_; }
+            virtual void SeekToFirst() { k_ = begin_; Fill(); }
+            virtual void SeekToLast() { k_ = end_ - 1; Fill(); }
+            virtual void Seek(const Slice&) { }
+            virtual void Next() { k_++; Fill(); }
+            virtual void Prev() { k_--; Fill(); }
+            virtual Slice key() const { return Slice(key_, 16); }
+            virtual Slice value() const { return value_; }
+            virtual const char* Raw() const { return nullptr; }
+            virtual void Abandon() { }
+            virtual Status status() const { return Status::OK(); }
+
+        private:
+            void Fill() {
+                if (Valid()) {
+                    snprintf(key_, sizeof(key_), "%016d", k_);
+                    value_ = gen_.Generate(value_size_);
+                }
+            }
+
+            const int begin_;
+            const int end_;
+            const int value_size_;
+            int k_;
+            char key_[100];
+            Slice value_;
+            RandomGenerator gen_;
+        };
+
+        void IngestSeq(ThreadState* thread) {
+            const int n = std::max(FLAGS_ingest_runs, 1);
+            std::vector<Iterator*> runs;
+            for (int i = 0; i < n; i++) {
+                runs.push_back(new SeqRun(static_cast<int64_t>(num_) * i / n,
+                                          static_cast<int64_t>(num_) * (i + 1) / n,
+                                          value_size_));
+            }
+            Status s = db_->IngestSortedRuns(runs.data(), n);
+            for (auto &run : runs) {
+                delete run;
+            }
+            if (!s.ok()) {
+                fprintf(stderr, "ingest error: %s\n", s.ToString().c_str());
+                exit(1);
+            }
+            thread->stats.FinishedOps(num_);
+            thread->stats.AddBytes(static_cast<int64_t>(value_size_ + 16) * num_);
+        }
+
         void ReadSequential(ThreadState* thread) {
+            if (FLAGS_scan_batch > 0) {
+                ReadSequentialBatch(thread);
+                return;
+            }
             Iterator* iter = db_->NewIterator(ReadOptions());
             int i = 0;
             int64_t bytes = 0;
@@ -831,6 +995,29 @@ namespace softdb {
             thread->stats.AddBytes(bytes);
         }
 
+        void ReadSequentialBatch(ThreadState* thread) {
+            Iterator* iter = db_->NewIterator(ReadOptions());
+            std::vector<Slice> keys(FLAGS_scan_batch);
+            std::vector<Slice> values(FLAGS_scan_batch);
+            int i = 0;
+            int64_t bytes = 0;
+            iter->SeekToFirst();
+            while (i < reads_) {
+                const int n = iter->NextBatch(keys.data(), values.data(),
+                                              std::min(FLAGS_scan_batch, reads_ - i));
+                if (n == 0) {
+                    break;
+                }
+                for (int j = 0; j < n; j++) {
+                    bytes += keys[j].size() + values[j].size();
+                    thread->stats.FinishedSingleOp();
+                }
+                i += n;
+            }
+            delete iter;
+            thread->stats.AddBytes(bytes);
+        }
+
         void ReadSequentialSnapshot(ThreadState* thread) {
             Iterator* iter = db_->NewIterator(read_options_);
             int i = 0;
@@ -844,6 +1031,34 @@ namespace softdb {
             thread->stats.AddBytes(bytes);
         }
 
+        // Thread tid scans partition tid, all threads share one snapshot.
+        void ReadSequentialParallel(ThreadState* thread) {
+            const int partitions = static_cast<int>(scan_splits_.size()) + 1;
+            if (thread->tid >= partitions) {
+                return;
+            }
+            ReadOptions options;
+            options.snapshot = scan_snapshot_;
+            Slice limit;
+            if (thread->tid + 1 < partitions) {
+                limit = scan_splits_[thread->tid];
+                options.iterate_upper_bound = &limit;
+            }
+            Iterator* iter = db_->NewIterator(options);
+            if (thread->tid == 0) {
+                iter->SeekToFirst();
+            } else {
+                iter->Seek(scan_splits_[thread->tid - 1]);
+            }
+            int64_t bytes = 0;
+            for (; iter->Valid(); iter->Next()) {
+                bytes += iter->key().size() + iter->value().size();
+                thread->stats.FinishedSingleOp();
+            }
+            delete iter;
+            thread->stats.AddBytes(bytes);
+        }
+
         void ReadReverse(ThreadState* thread) {
             Iterator* iter = db_->NewIterator(ReadOptions());
             int i = 0;
@@ -943,14 +1158,27 @@ namespace softdb {
 
         void SeekRandom(ThreadState* thread) {
             ReadOptions options;
+            options.prefix_same_as_start = (prefix_extractor_ != nullptr);
+            char limit[100];
+            Slice upper_bound;
+            if (FLAGS_seek_range > 0) {
+                options.iterate_upper_bound = &upper_bound;
+            }
             int found = 0;
             for (int i = 0; i < reads_; i++) {
                 Iterator* iter = db_->NewIterator(options);
                 char key[100];
                 const int k = thread->rand.Next() % FLAGS_num;
                 snprintf(key, sizeof(key), "%016d", k);
+                snprintf(limit, sizeof(limit), "%016d", k + FLAGS_seek_range);
+                upper_bound = Slice(limit);
                 iter->Seek(key);
                 if (iter->Valid() && iter->key() == key) found++;
+                if (FLAGS_seek_range > 0) {
+                    while (iter->Valid()) {
+                        iter->Next();
+                    }
+                }
                 delete iter;
                 thread->stats.FinishedSingleOp();
             }
@@ -1071,9 +1299,9 @@ namespace softdb {
 
         void PrintStats(const char* key) {
             std::string stats;
-            //if (!db_->GetProperty(key, &stats)) {
-            //    stats = "(failed)";
-            //}
+            if (!db_->GetProperty(key, &stats)) {
+                stats = "(failed)";
+            }
             fprintf(stdout, "\n%s\n", stats.c_str());
         }
 
@@ -1125,6 +1353,35 @@ int main(int argc, char** argv) {
         } else if (sscanf(argv[i], "--reuse_logs=%d%c", &n, &junk) == 1 &&
                    (n == 0 || n == 1)) {
             FLAGS_reuse_logs = n;
+        } else if (sscanf(argv[i], "--use_mmap_log=%d%c", &n, &junk) == 1 &&
+                   (n == 0 || n == 1)) {
+            FLAGS_use_mmap_log = n;
+        } else if (sscanf(argv[i], "--pipelined_write=%d%c", &n, &junk) == 1 &&
+                   (n == 0 || n == 1)) {
+            FLAGS_pipelined_write = n;
+        } else if (sscanf(argv[i], "--disable_wal=%d%c", &n, &junk) == 1 &&
+                   (n == 0 || n == 1)) {
+            FLAGS_disable_wal = n;
+        } else if (sscanf(argv[i], "--zero_copy_flush=%d%c", &n, &junk) == 1 &&
+                   (n == 0 || n == 1)) {
+            FLAGS_zero_copy_flush = n;
+        } else if (sscanf(argv[i], "--flat_index=%d%c", &n, &junk) == 1 &&
+                   (n == 0 || n == 1)) {
+            FLAGS_flat_index = n;
+        } else if (sscanf(argv[i], "--index_partitions=%d%c", &n, &junk) == 1) {
+            FLAGS_index_partitions = n;
+        } else if (sscanf(argv[i], "--merge_guards=%d%c", &n, &junk) == 1 &&
+                   (n == 0 || n == 1)) {
+            FLAGS_merge_guards = n;
+        } else if (strncmp(argv[i], "--merge_policy=", 15) == 0 &&
+                   (strcmp(argv[i] + 15, "all") == 0 ||
+                    strcmp(argv[i] + 15, "tiered") == 0 ||
+                    strcmp(argv[i] + 15, "leveled") == 0)) {
+            FLAGS_merge_policy = argv[i] + 15;
+        } else if (sscanf(argv[i], "--merge_size_ratio=%lf%c", &d, &junk) == 1 && d > 0) {
+            FLAGS_merge_size_ratio = d;
+        } else if (sscanf(argv[i], "--max_subcompactions=%d%c", &n, &junk) == 1) {
+            FLAGS_max_subcompactions = n;
         } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
             FLAGS_num = n;
         } else if (sscanf(argv[i], "--reads=%d%c", &n, &junk) == 1) {
@@ -1152,6 +1409,24 @@ int main(int argc, char** argv) {
         } else if (sscanf(argv[i], "--use_cuckoo=%d%c", &n, &junk) == 1&&
                    (n == 0 || n == 1)) {
             FLAGS_use_cuckoo = n;
+        } else if (strncmp(argv[i], "--filter_type=", 14) == 0 &&
+                   (strcmp(argv[i] + 14, "cuckoo") == 0 ||
+                    strcmp(argv[i] + 14, "xor") == 0)) {
+            FLAGS_filter_type = argv[i] + 14;
+        } else if (sscanf(argv[i], "--filter_bits=%d%c", &n, &junk) == 1 &&
+                   n > 0 && n <= 32) {
+            FLAGS_filter_bits = n;
+        } else if (sscanf(argv[i], "--prefix_size=%d%c", &n, &junk) == 1) {
+            FLAGS_prefix_size = n;
+        } else if (sscanf(argv[i], "--use_range_filter=%d%c", &n, &junk) == 1 &&
+                   (n == 0 || n == 1)) {
+            FLAGS_use_range_filter = n;
+        } else if (sscanf(argv[i], "--seek_range=%d%c", &n, &junk) == 1) {
+            FLAGS_seek_range = n;
+        } else if (sscanf(argv[i], "--scan_batch=%d%c", &n, &junk) == 1) {
+            FLAGS_scan_batch = n;
+        } else if (sscanf(argv[i], "--ingest_runs=%d%c", &n, &junk) == 1) {
+            FLAGS_ingest_runs = n;
         } else if (strncmp(argv[i], "--db=", 5) == 0) {
                 FLAGS_db = argv[i] + 5;
         } else {
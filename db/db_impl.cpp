@@ -8,8 +8,12 @@
 #include <stdio.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 //#include "builder.h"
@@ -24,6 +28,7 @@
 #include "write_batch_internal.h"
 #include "softdb/db.h"
 #include "softdb/env.h"
+#include "softdb/merge_policy.h"
 #include "softdb/status.h"
 //#include "table.h"
 //#include "table_builder.h"
@@ -44,12 +49,66 @@ struct DBImpl::Writer {
     Status status;
     WriteBatch* batch;
     bool sync;
+    bool disable_wal;
     bool done;
+    SequenceNumber last_sequence;  // Of the group led, see PipelinedWrite()
     port::CondVar cv;
 
     explicit Writer(port::Mutex* mu) : cv(mu) { }
 };
 
+// The memtables a read looks into before nvm, with a reference to each.
+// Nvm is left out, its index is updated in place under a lock of its own.
+struct SuperVersion {
+    MemTable* const mem;
+    MemTable* const imm;
+    const uint64_t number;
+    std::atomic<int> refs;
+
+    SuperVersion(MemTable* m, MemTable* i, uint64_t n)
+            : mem(m), imm(i), number(n), refs(1) { }
+
+    void Ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+    // Return true if the last reference is dropped, the caller must
+    // DeleteSuperVersion() then.
+    bool Unref() { return refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+};
+
+namespace {
+
+// Marks the local_sv_ of a thread reading with the SuperVersion it held.
+char sv_in_use;
+void* const kSVInUse = &sv_in_use;
+
+// REQUIRES: mutex_ of the DB is held.
+void DeleteSuperVersion(SuperVersion* sv) {
+    sv->mem->Unref();
+    if (sv->imm != nullptr) sv->imm->Unref();
+    delete sv;
+}
+
+void UnrefSuperVersion(SuperVersion* sv, port::Mutex* mu) {
+    if (sv->Unref()) {
+        MutexLock l(mu);
+        DeleteSuperVersion(sv);
+    }
+}
+
+// Drops the SuperVersion cached by an exiting thread.  It can not lock
+// mutex_ here, with the mutex of ThreadLocalPtr held, and need not:
+// InstallSuperVersion() takes SuperVersions back from the threads before
+// it drops the reference of the DB, so a cached one is never the last.
+void ReleaseCachedSuperVersion(void* ptr) {
+    if (ptr != kSVInUse) {
+        bool last = static_cast<SuperVersion*>(ptr)->Unref();
+        assert(!last);
+        (void)last;
+    }
+}
+
+}  // namespace
+
 
 
 // Fix user-supplied options to be reasonable
@@ -67,6 +126,11 @@ Options SanitizeOptions(const std::string& dbname,
     //result.filter_policy = (src.filter_policy != nullptr) ? ipolicy : nullptr;
     //ClipToRange(&result.max_open_files,    64 + kNumNonTableCacheFiles, 50000);
     ClipToRange(&result.write_buffer_size, 64<<10,                      1<<30);
+    ClipToRange(&result.index_partitions,  1,                           64);
+    ClipToRange(&result.max_subcompactions, 1,                          64);
+    if (!result.run_in_dram) {
+        result.zero_copy_flush = false;
+    }
     //ClipToRange(&result.max_file_size,     1<<20,                       1<<30);
     //ClipToRange(&result.block_size,        1<<10,                       4<<20);
     if (result.info_log == nullptr) {
@@ -94,6 +158,10 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
     options_(SanitizeOptions(dbname, &internal_comparator_,
                              /*&internal_filter_policy_, */ raw_options)),
     owns_info_log_(options_.info_log != raw_options.info_log),
+    // With a single CPU nothing overlaps, handing the log over would only
+    // add context switches.
+    pipelined_write_(options_.pipelined_write &&
+                     std::thread::hardware_concurrency() > 1),
     //owns_cache_(options_.block_cache != raw_options.block_cache),
     dbname_(dbname),
     //table_cache_(new TableCache(dbname_, options_, TableCacheSize(options_))),
@@ -108,14 +176,21 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
     log_(nullptr),
     //seed_(0),
     tmp_batch_(new WriteBatch),
+    super_version_(nullptr),
+    super_version_number_(0),
+    local_sv_(ReleaseCachedSuperVersion),
     background_compaction_scheduled_(false),
     nvm_compaction_scheduled_(false),
     //manual_compaction_(nullptr)l,
     //versions_(new VersionSet(dbname_, &options_, table_cache_, &internal_comparator_))
     versions_(new VersionSet(dbname_, &options_, &internal_comparator_, mutex_,
-            shutting_down_, snapshots_, bg_error_, nvm_compaction_scheduled_, nvm_signal_))
+            shutting_down_, snapshots_, snapshots_mutex_, bg_error_,
+            nvm_compaction_scheduled_, nvm_signal_))
     {
         has_imm_.Release_Store(nullptr);
+        if (options_.pipelined_write && !pipelined_write_) {
+            Log(options_.info_log, "pipelined_write ignored on a single CPU");
+        }
     }
 
 DBImpl::~DBImpl() {
@@ -128,6 +203,15 @@ DBImpl::~DBImpl() {
     while (nvm_compaction_scheduled_) {
         nvm_signal_.Wait();
     }
+    std::vector<void*> cached;
+    local_sv_.Scrape(&cached, nullptr);
+    for (size_t i = 0; i < cached.size(); i++) {
+        SuperVersion* sv = static_cast<SuperVersion*>(cached[i]);
+        if (sv->Unref()) DeleteSuperVersion(sv);
+    }
+    if (super_version_ != nullptr && super_version_->Unref()) {
+        DeleteSuperVersion(super_version_);
+    }
     mutex_.Unlock();
 
     if (db_lock_ != nullptr) {
@@ -189,6 +273,20 @@ void DBImpl::DeleteObsoleteFiles() {
                 case kLogFile:
                     keep = ((number >= versions_->LogNumber()) ||
                             (number == versions_->PrevLogNumber()));
+                    if (!keep && options_.use_mmap_log &&
+                        recycled_logs_.size() < static_cast<size_t>(config::kNumRecycledLogs) &&
+                        env_->RenameFile(dbname_ + "/" + filenames[i],
+                                         RecycledLogFileName(dbname_, number)).ok()) {
+                        Log(options_.info_log, "Recycle log #%lld\n",
+                            static_cast<unsigned long long>(number));
+                        recycled_logs_.push_back(number);
+                        continue;
+                    }
+                    break;
+                case kRecycledLogFile:
+                    // Recycled logs of an earlier incarnation are deleted.
+                    keep = std::find(recycled_logs_.begin(), recycled_logs_.end(),
+                                     number) != recycled_logs_.end();
                     break;
                 /*
                 case kDescriptorFile:
@@ -208,6 +306,7 @@ void DBImpl::DeleteObsoleteFiles() {
                 case kCurrentFile:
                 case kDBLockFile:
                 case kInfoLogFile:
+                case kTempFile:
                     keep = true;
                     break;
             }
@@ -225,9 +324,134 @@ void DBImpl::DeleteObsoleteFiles() {
     }
 }
 
+namespace {
+
+// Log blocks parsed by each recovery thread at a time, 4MB.
+const int kRecoveryBlocks = 128;
+
+// Least bytes of log records to recover into a memtable of their own.
+const size_t kRecoveryGroupBytes = 1 << 20;
+
+// Number of threads to recover a log with.
+int RecoveryThreads() {
+    const unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? static_cast<int>(n) : 1;
+}
+
+}  // namespace
+
+// Threads started once per recovery to run the batches of work of all
+// its logs: blocks to parse and memtables to build.
+class DBImpl::RecoveryPool {
+public:
+    // Start threads-1 workers, the thread calling Run() is the last one.
+    RecoveryPool(Env* env, int threads)
+            : work_cv_(&mu_),
+              done_cv_(&mu_),
+              threads_(threads),
+              work_(nullptr),
+              n_(0),
+              next_(0),
+              generation_(0),
+              pending_(0),
+              workers_(threads - 1),
+              shutting_down_(false) {
+        for (int i = 1; i < threads; i++) {
+            env->StartThread(&RecoveryPool::Worker, this);
+        }
+    }
+
+    ~RecoveryPool() {
+        MutexLock l(&mu_);
+        shutting_down_ = true;
+        work_cv_.SignalAll();
+        while (workers_ > 0) {
+            done_cv_.Wait();
+        }
+    }
+
+    int threads() const { return threads_; }
+
+    // Run work(0), ..., work(n-1) on all threads and return once all of
+    // them are done.
+    void Run(size_t n, const std::function<void(size_t)>& work) {
+        if (threads_ == 1 || n <= 1) {
+            for (size_t i = 0; i < n; i++) {
+                work(i);
+            }
+            return;
+        }
+        mu_.Lock();
+        work_ = &work;
+        n_ = n;
+        next_ = 0;
+        generation_++;
+        pending_ = workers_;
+        work_cv_.SignalAll();
+        mu_.Unlock();
+        RunTasks(&work, n);
+        // Every worker takes part in each generation, so none of them
+        // is left holding work once this returns.
+        MutexLock l(&mu_);
+        while (pending_ > 0) {
+            done_cv_.Wait();
+        }
+        work_ = nullptr;
+    }
+
+private:
+    static void Worker(void* arg) {
+        reinterpret_cast<RecoveryPool*>(arg)->Work();
+    }
+
+    void Work() {
+        uint64_t seen = 0;
+        MutexLock l(&mu_);
+        while (true) {
+            while (!shutting_down_ && generation_ == seen) {
+                work_cv_.Wait();
+            }
+            if (shutting_down_) {
+                break;
+            }
+            seen = generation_;
+            const std::function<void(size_t)>* work = work_;
+            const size_t n = n_;
+            mu_.Unlock();
+            RunTasks(work, n);
+            mu_.Lock();
+            if (--pending_ == 0) {
+                done_cv_.SignalAll();
+            }
+        }
+        if (--workers_ == 0) {
+            done_cv_.SignalAll();
+        }
+    }
+
+    void RunTasks(const std::function<void(size_t)>* work, size_t n) {
+        size_t i;
+        while ((i = next_.fetch_add(1)) < n) {
+            (*work)(i);
+        }
+    }
+
+    port::Mutex mu_;
+    port::CondVar work_cv_;
+    port::CondVar done_cv_;
+    const int threads_;
+    const std::function<void(size_t)>* work_;   // protected by mu_
+    size_t n_;                                  // protected by mu_
+    std::atomic<size_t> next_;
+    uint64_t generation_;                       // protected by mu_
+    int pending_;                               // protected by mu_
+    int workers_;                               // protected by mu_
+    bool shutting_down_;                        // protected by mu_
+};
+
 Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
                               /*bool* save_manifest, VersionEdit* edit,*/
-                              SequenceNumber* max_sequence) {
+                              RecoveryPool* pool, SequenceNumber* max_sequence) {
     struct LogReporter : public log::Reader::Reporter {
         Env* env;
         Logger* info_log;
@@ -243,14 +467,32 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
 
     mutex_.AssertHeld();
 
-    // Open the log file
+    // Map the log file, records are then parsed in place.  Without mmap
+    // the log is read a window of blocks at a time, and records are copied.
     std::string fname = LogFileName(dbname_, log_number);
-    SequentialFile* file;
-    Status status = env_->NewSequentialFile(fname, &file);
+    uint64_t file_size;
+    Status status = env_->GetFileSize(fname, &file_size);
+    RandomAccessFile* file = nullptr;
+    bool mapped = false;
+    if (status.ok() && file_size > 0) {
+        mapped = env_->NewMappedReadableFile(fname, &file).ok();
+        if (!mapped) {
+            status = env_->NewRandomAccessFile(fname, &file);
+        }
+    }
     if (!status.ok()) {
         MaybeIgnoreError(&status);
         return status;
     }
+    Slice contents;
+    if (mapped) {
+        status = file->Read(0, file_size, &contents, nullptr);
+        if (!status.ok()) {
+            delete file;
+            MaybeIgnoreError(&status);
+            return status;
+        }
+    }
 
     // Create the log reader.
     LogReporter reporter;
@@ -258,61 +500,163 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
     reporter.info_log = options_.info_log;
     reporter.fname = fname.c_str();
     reporter.status = (options_.paranoid_checks ? &status : nullptr);
-    // We intentionally make log::Reader do checksumming even if
+    // We intentionally make log::BlockReader do checksumming even if
     // paranoid_checks==false so that corruptions cause entire commits
     // to be skipped instead of propagating bad information (like overly
     // large sequence numbers).
-    log::Reader reader(file, &reporter, true/*checksum*/,
-                       0/*initial_offset*/);
+    //
+    // Blocks are parsed and checksummed in parallel, kRecoveryBlocks
+    // blocks per thread at a time.
+    const int threads = pool->threads();
+    const log::BlockReader::Runner runner =
+            [pool](size_t n, const std::function<void(size_t)>& work) {
+                pool->Run(n, work);
+            };
+    log::BlockReader* reader;
+    if (mapped || file == nullptr) {
+        reader = new log::BlockReader(contents, &reporter, true/*checksum*/,
+                                      threads * kRecoveryBlocks, runner);
+    } else {
+        reader = new log::BlockReader(file, file_size, &reporter, true/*checksum*/,
+                                      threads * kRecoveryBlocks, runner);
+    }
     Log(options_.info_log, "Recovering log #%llu",
         (unsigned long long) log_number);
 
-    // Read all the records and add to a memtable
-    std::string scratch;
-    Slice record;
-    WriteBatch batch;
+    // Records are cut into groups, each group is added to a memtable of its
+    // own.  Groups of write_buffer_size bytes at most spread the log over
+    // all threads, but smaller than kRecoveryGroupBytes make too many tables.
+    // A log to reuse is not spread, so that it still fits in one memtable.
+    size_t group_limit = options_.write_buffer_size;
+    if (!(options_.reuse_logs && last_log)) {
+        group_limit = std::min(group_limit,
+                               std::max(static_cast<size_t>(file_size / threads), kRecoveryGroupBytes));
+    }
+    struct Group {
+        size_t begin;                   // records[begin, end)
+        size_t end;
+        size_t next;                    // records[begin, next) are added to mem
+        MemTable* mem;
+        SequenceNumber max_sequence;
+        Status status;
+    };
+    std::vector<Slice> records;
+    std::deque<std::string> fragmented;     // Backing store of records not in contents
+    std::vector<Group> groups;
+
+    auto build = [&](Group* group) {
+        WriteBatch batch;
+        if (group->mem == nullptr) {
+            group->mem = new MemTable(internal_comparator_, options_.zero_copy_flush);
+            group->mem->Ref();
+        }
+        for (size_t& i = group->next; i < group->end && group->status.ok(); i++) {
+            WriteBatchInternal::SetContents(&batch, records[i]);
+            group->status = WriteBatchInternal::InsertInto(&batch, group->mem);
+            MaybeIgnoreError(&group->status);
+            if (!group->status.ok()) {
+                break;
+            }
+            const SequenceNumber last_seq =
+                    WriteBatchInternal::Sequence(&batch) +
+                    WriteBatchInternal::Count(&batch) - 1;
+            if (last_seq > group->max_sequence) {
+                group->max_sequence = last_seq;
+            }
+        }
+    };
+
+    // Build the memtables of the groups read so far in parallel, then
+    // write them into nvm in sequence order, so a table never holds
+    // entries newer than those of a later table.
+    //
+    // Errors are reflected immediately so that conditions like full
+    // file-systems cause the DB::Open() to fail.
     int compactions = 0;
     MemTable* mem = nullptr;
-    while (reader.ReadRecord(&record, &scratch) &&
+    auto emit = [&](bool last) {
+        pool->Run(groups.size(), [&groups, &build](size_t i) { build(&groups[i]); });
+        // See if we should keep reusing the last log file, then its only
+        // memtable is not written into nvm.
+        const bool reuse = last && options_.reuse_logs && last_log &&
+                           compactions == 0 && groups.size() == 1;
+        for (auto &group : groups) {
+            if (status.ok()) {
+                status = group.status;
+            }
+            if (status.ok()) {
+                if (group.max_sequence > *max_sequence) {
+                    *max_sequence = group.max_sequence;
+                }
+                if (reuse && group.mem->ApproximateMemoryUsage() <= options_.write_buffer_size) {
+                    mem = group.mem;
+                    continue;
+                }
+                compactions++;
+                //*save_manifest = true;
+                status = WriteLevel0Table(group.mem/*, edit, nullptr*/);
+            }
+            group.mem->Unref();
+        }
+        groups.clear();
+        records.clear();
+        fragmented.clear();
+    };
+
+    // Read all the records
+    size_t group_bytes = 0;
+    std::string scratch;
+    Slice record;
+    while (reader->ReadRecord(&record, &scratch) &&
            status.ok()) {
         if (record.size() < 12) {
             reporter.Corruption(
                     record.size(), Status::Corruption("log record too small"));
             continue;
         }
-        WriteBatchInternal::SetContents(&batch, record);
-
-        if (mem == nullptr) {
-            mem = new MemTable(internal_comparator_);
-            mem->Ref();
-        }
-        status = WriteBatchInternal::InsertInto(&batch, mem);
-        MaybeIgnoreError(&status);
-        if (!status.ok()) {
-            break;
-        }
-        const SequenceNumber last_seq =
-                WriteBatchInternal::Sequence(&batch) +
-                WriteBatchInternal::Count(&batch) - 1;
-        if (last_seq > *max_sequence) {
-            *max_sequence = last_seq;
+        if (groups.empty() || group_bytes >= group_limit) {
+            if (groups.size() == static_cast<size_t>(threads)) {
+                emit(false);
+                if (!status.ok()) {
+                    break;
+                }
+            }
+            groups.push_back({records.size(), records.size(), records.size(),
+                              nullptr, 0, Status()});
+            group_bytes = 0;
         }
-
-        if (mem->ApproximateMemoryUsage() > options_.write_buffer_size) {
-            compactions++;
-            //*save_manifest = true;
-            status = WriteLevel0Table(mem/*, edit, nullptr*/);
-
-            mem->Unref();
-            mem = nullptr;
-            if (!status.ok()) {
-                // Reflect errors immediately so that conditions like full
-                // file-systems cause the DB::Open() to fail.
-                break;
+        if (threads == 1) {
+            // Nothing to do in parallel, add the record while it is in cache,
+            // it is never read again so it may stay in scratch.
+            records.push_back(record);
+            groups.back().end = records.size();
+            build(&groups.back());
+        } else {
+            if (!scratch.empty()) {
+                fragmented.push_back(std::move(scratch));
+                scratch.clear();
+                record = Slice(fragmented.back());
+            } else if (!mapped) {
+                // The window of blocks holding it is read over later.
+                fragmented.emplace_back(record.data(), record.size());
+                record = Slice(fragmented.back());
             }
+            records.push_back(record);
+            groups.back().end = records.size();
+        }
+        group_bytes += record.size();
+    }
+    if (status.ok()) {
+        emit(true);
+    }
+    for (auto &group : groups) {
+        // Left behind by an error.
+        if (group.mem != nullptr) {
+            group.mem->Unref();
         }
     }
 
+    delete reader;
     delete file;
 
     // See if we should keep reusing the last log file.
@@ -335,7 +679,7 @@ Status DBImpl::RecoverLogFile(uint64_t log_number, bool last_log,
                 mem = nullptr;
             } else {
                 // mem can be nullptr if lognum exists but was empty.
-                mem_ = new MemTable(internal_comparator_);
+                mem_ = new MemTable(internal_comparator_, options_.zero_copy_flush);
                 mem_->Ref();
             }
         }
@@ -438,9 +782,11 @@ Status DBImpl::Recover(/*VersionEdit* edit, bool *save_manifest*/) {
 
     // Recover in the order in which the logs were generated
     std::sort(logs.begin(), logs.end());
+    // The threads recovering logs are started once for all of them.
+    RecoveryPool pool(env_, logs.empty() ? 1 : RecoveryThreads());
     for (size_t i = 0; i < logs.size(); i++) {
         s = RecoverLogFile(logs[i], (i == logs.size() - 1), /*save_manifest, edit,*/
-                           &max_sequence);
+                           &pool, &max_sequence);
         if (!s.ok()) {
             return s;
         }
@@ -506,7 +852,6 @@ Status DBImpl::Get(const ReadOptions& options,
                    const Slice& key,
                    std::string* value) {
     Status s;
-    MutexLock l(&mutex_);
     SequenceNumber snapshot;
     if (options.snapshot != nullptr) {
         snapshot =
@@ -515,43 +860,32 @@ Status DBImpl::Get(const ReadOptions& options,
         snapshot = versions_->LastSequence();
     }
 
-    MemTable* mem = mem_;
-    MemTable* imm = imm_;
-    //Version* current = versions_->current();
-    mem->Ref();
-    if (imm != nullptr) imm->Ref();
-    //current->Ref();
+    // Taken after the sequence number, so it holds every write up to it.
+    SuperVersion* sv = GetSuperVersion();
 
     //bool have_stat_update = false;
     //Version::GetStats stats;
 
-    // Unlock while reading from files and memtables
-    {
-        mutex_.Unlock();
-        // First look in the memtable, then in the immutable memtable (if any).
-        LookupKey lkey(key, snapshot);
-        if (mem->Get(lkey, value, &s)) {
-            // Done
-        } else if (imm != nullptr && imm->Get(lkey, value, &s)) {
-            // Done
-        } else {
-            //s = current->Get(options, lkey, value, &stats);
+    // First look in the memtable, then in the immutable memtable (if any).
+    LookupKey lkey(key, snapshot);
+    if (sv->mem->Get(lkey, value, &s)) {
+        // Done
+    } else if (sv->imm != nullptr && sv->imm->Get(lkey, value, &s)) {
+        // Done
+    } else {
+        //s = current->Get(options, lkey, value, &stats);
 
-            //uint64_t start_micros = env_->NowMicros();
-            versions_->Get(lkey, value, &s);
-            //std::cout<<"Version Get Cost: "<<env_->NowMicros() - start_micros <<std::endl;
+        //uint64_t start_micros = env_->NowMicros();
+        versions_->Get(lkey, value, &s);
+        //std::cout<<"Version Get Cost: "<<env_->NowMicros() - start_micros <<std::endl;
 
-            //have_stat_update = true;
-        }
-        mutex_.Lock();
+        //have_stat_update = true;
     }
 
     //if (have_stat_update && current->UpdateStats(stats)) {
     //    MaybeScheduleCompaction();
     //}
-    mem->Unref();
-    if (imm != nullptr) imm->Unref();
-    //current->Unref();
+    ReturnSuperVersion(sv);
     return s;
 }
 
@@ -560,12 +894,15 @@ Status DBImpl::Get(const ReadOptions& options,
 Iterator* DBImpl::NewIterator(const ReadOptions& options) {
     SequenceNumber latest_snapshot;
     //uint32_t seed;
-    Iterator* iter = NewInternalIterator(/*options, */&latest_snapshot/*, &seed*/);
+    Iterator* iter = NewInternalIterator(options, &latest_snapshot/*, &seed*/);
     return NewDBIterator(
             this, user_comparator(), iter,
             (options.snapshot != nullptr
              ? static_cast<const SnapshotImpl*>(options.snapshot)->sequence_number()
-             : latest_snapshot)/*,
+             : latest_snapshot),
+            (options.prefix_same_as_start ? options_.prefix_extractor : nullptr),
+            options.iterate_upper_bound,
+            options.iterate_lower_bound/*,
             seed*/);
 }
 
@@ -573,75 +910,253 @@ namespace {
 
     struct IterState {
         port::Mutex* const mu;
+        port::Mutex* const snapshots_mu;
         //Version* const version GUARDED_BY(mu);
-        MemTable* const mem GUARDED_BY(mu);
-        MemTable* const imm GUARDED_BY(mu);
-        SnapshotList* const snapshots_ GUARDED_BY(mu);
+        SuperVersion* const sv;
+        SnapshotList* const snapshots_ GUARDED_BY(snapshots_mu);
         const Snapshot* snapshot_;
 
-        IterState(port::Mutex* mutex, MemTable* mem, MemTable* imm, SnapshotList* snapshots, Snapshot* snapshot/*, Version* version*/)
-                : mu(mutex), /*version(version),*/ mem(mem), imm(imm), snapshots_(snapshots), snapshot_(snapshot) { }
+        IterState(port::Mutex* mutex, port::Mutex* snapshots_mutex, SuperVersion* sv,
+                  SnapshotList* snapshots, Snapshot* snapshot/*, Version* version*/)
+                : mu(mutex), snapshots_mu(snapshots_mutex), /*version(version),*/ sv(sv),
+                  snapshots_(snapshots), snapshot_(snapshot) { }
     };
 
     static void CleanupIteratorState(void* arg1, void* arg2) {
         IterState* state = reinterpret_cast<IterState*>(arg1);
-        state->mu->Lock();
-        state->mem->Unref();
-        if (state->imm != nullptr) state->imm->Unref();
+        UnrefSuperVersion(state->sv, state->mu);
+        state->snapshots_mu->Lock();
         state->snapshots_->Delete(static_cast<const SnapshotImpl*>(state->snapshot_));
         //state->version->Unref();
-        state->mu->Unlock();
+        state->snapshots_mu->Unlock();
         delete state;
     }
 
 }  // anonymous namespace
 
 
-Iterator* DBImpl::NewInternalIterator(/*const ReadOptions& options,*/
+Iterator* DBImpl::NewInternalIterator(const ReadOptions& options,
                                       SequenceNumber* latest_snapshot/*,
                                       uint32_t* seed*/) {
-    mutex_.Lock();
     // create a snapshot for iterator, guarantee data correction,
     // release it at CleanupIteratorState.
-    Snapshot* snapshot = snapshots_.New(versions_->LastSequence());
-    *latest_snapshot = versions_->LastSequence();
+    Snapshot* snapshot;
+    {
+        MutexLock l(&snapshots_mutex_);
+        *latest_snapshot = versions_->LastSequence();
+        snapshot = snapshots_.New(*latest_snapshot);
+    }
+
+    // Taken after the sequence number, so it holds every write up to it,
+    // with a reference of the iterator's own.
+    SuperVersion* sv = GetSuperVersion();
+    sv->Ref();
+    ReturnSuperVersion(sv);
 
     // Collect together all needed child iterators
     std::vector<Iterator*> list;
-    list.push_back(mem_->NewIterator());
-    mem_->Ref();
-    if (imm_ != nullptr) {
-        list.push_back(imm_->NewIterator());
-        imm_->Ref();
+    list.push_back(sv->mem->NewIterator());
+    if (sv->imm != nullptr) {
+        list.push_back(sv->imm->NewIterator());
     }
     //versions_->current()->AddIterators(options, &list);
-    list.push_back(versions_->NewIterator());
+    list.push_back(versions_->NewIterator(options));
     Iterator* internal_iter =
             NewMergingIterator(&internal_comparator_, &list[0], list.size());
     //versions_->current()->Ref();
 
-    IterState* cleanup = new IterState(&mutex_, mem_, imm_, &snapshots_, snapshot/*, versions_->current()*/);
+    IterState* cleanup = new IterState(&mutex_, &snapshots_mutex_, sv, &snapshots_, snapshot/*, versions_->current()*/);
     // tips: register the clean up methods for iterators,
     // call ~ MergingIterator to call them automatically,
     // cleanup is the arg for CleanupIteratorState.
     internal_iter->RegisterCleanup(CleanupIteratorState, cleanup, nullptr);
 
     //*seed = ++seed_;
-    mutex_.Unlock();
     return internal_iter;
 }
 
 
 const Snapshot* DBImpl::GetSnapshot() {
-    MutexLock l(&mutex_);
+    MutexLock l(&snapshots_mutex_);
     return snapshots_.New(versions_->LastSequence());
 }
 
 void DBImpl::ReleaseSnapshot(const Snapshot* snapshot) {
-    MutexLock l(&mutex_);
+    MutexLock l(&snapshots_mutex_);
     snapshots_.Delete(static_cast<const SnapshotImpl*>(snapshot));
 }
 
+void DBImpl::InstallSuperVersion() {
+    mutex_.AssertHeld();
+    SuperVersion* old = super_version_;
+    mem_->Ref();
+    if (imm_ != nullptr) imm_->Ref();
+    super_version_ = new SuperVersion(mem_, imm_, super_version_number_.load(std::memory_order_relaxed) + 1);
+    super_version_number_.store(super_version_->number, std::memory_order_release);
+
+    // Take the old one back from the threads caching it while the DB still
+    // holds a reference, see ReleaseCachedSuperVersion().  A thread reading
+    // with it finds its local_sv_ reset in ReturnSuperVersion().
+    std::vector<void*> cached;
+    local_sv_.Scrape(&cached, nullptr);
+    for (size_t i = 0; i < cached.size(); i++) {
+        if (cached[i] != kSVInUse) {
+            SuperVersion* sv = static_cast<SuperVersion*>(cached[i]);
+            if (sv->Unref()) DeleteSuperVersion(sv);
+        }
+    }
+    if (old != nullptr && old->Unref()) {
+        DeleteSuperVersion(old);
+    }
+}
+
+SuperVersion* DBImpl::GetSuperVersion() {
+    SuperVersion* sv = static_cast<SuperVersion*>(local_sv_.Swap(kSVInUse));
+    assert(sv != kSVInUse);
+    if (sv == nullptr ||
+        sv->number != super_version_number_.load(std::memory_order_acquire)) {
+        MutexLock l(&mutex_);
+        if (sv != nullptr && sv->Unref()) DeleteSuperVersion(sv);
+        sv = super_version_;
+        sv->Ref();
+    }
+    return sv;
+}
+
+void DBImpl::ReturnSuperVersion(SuperVersion* sv) {
+    void* expected = kSVInUse;
+    if (!local_sv_.CompareAndSwap(sv, expected)) {
+        // Scraped by InstallSuperVersion() meanwhile.
+        assert(expected == nullptr);
+        UnrefSuperVersion(sv, &mutex_);
+    }
+}
+
+void DBImpl::PartitionRange(const Range& range, int n,
+                            std::vector<std::string>* splits) {
+    versions_->PartitionRange(range, n, splits);
+}
+
+Status DBImpl::IngestSortedRuns(Iterator** runs, int n) {
+    // Take the turn of a writer, so no sequence number is given out and
+    // no memtable is switched while the runs are built.
+    Writer w(&mutex_);
+    w.batch = nullptr;
+    w.sync = false;
+    w.disable_wal = false;
+    w.done = false;
+
+    MutexLock l(&mutex_);
+    writers_.push_back(&w);
+    while (&w != writers_.front()) {
+        w.cv.Wait();
+    }
+
+    // Get() looks into memtables before nvm, so older values there would
+    // shadow the runs, flush them first.
+    Status status = FlushMemTableLocked();
+    if (status.ok()) {
+        // Snapshots taken before the runs are in nvm can not see them.
+        const SequenceNumber sequence = versions_->LastSequence() + 1;
+        mutex_.Unlock();
+        status = versions_->IngestRuns(runs, n, sequence);
+        mutex_.Lock();
+        if (status.ok()) {
+            versions_->SetLastSequence(sequence);
+        }
+    }
+
+    writers_.pop_front();
+    if (!writers_.empty()) {
+        writers_.front()->cv.Signal();
+    }
+    return status;
+}
+
+Status DBImpl::FlushMemTable() {
+    // Take the turn of a writer, so the memtable is flushed after the
+    // writes made before the call.
+    Writer w(&mutex_);
+    w.batch = nullptr;
+    w.sync = false;
+    w.disable_wal = false;
+    w.done = false;
+
+    MutexLock l(&mutex_);
+    writers_.push_back(&w);
+    while (&w != writers_.front()) {
+        w.cv.Wait();
+    }
+
+    Status status = FlushMemTableLocked();
+
+    writers_.pop_front();
+    if (!writers_.empty()) {
+        writers_.front()->cv.Signal();
+    }
+    return status;
+}
+
+Status DBImpl::FlushMemTableLocked() {
+    mutex_.AssertHeld();
+    WaitForPendingInserts();
+    Status status = bg_error_;
+    if (status.ok() && mem_->GetCount() > 0) {
+        status = MakeRoomForWrite(true);
+    }
+    while (status.ok() && imm_ != nullptr) {
+        background_work_finished_signal_.Wait();
+        status = bg_error_;
+    }
+    return status;
+}
+
+bool DBImpl::GetProperty(const Slice& property, std::string* value) {
+    value->clear();
+
+    Slice in = property;
+    Slice prefix("softdb.");
+    if (!in.starts_with(prefix)) return false;
+    in.remove_prefix(prefix.size());
+
+    if (in == "stats") {
+        char buf[200];
+        size_t mem_usage;
+        {
+            MutexLock l(&mutex_);
+            mem_usage = mem_->ApproximateMemoryUsage();
+            if (imm_ != nullptr) {
+                mem_usage += imm_->ApproximateMemoryUsage();
+            }
+        }
+        snprintf(buf, sizeof(buf), "Memtables: %.1f MB\n", mem_usage / 1048576.0);
+        value->append(buf);
+        // Slabs are counted for the whole process.
+        Arena::SharedStats slabs;
+        Arena::GetSharedStats(&slabs);
+        const uint64_t dead = slabs.records - slabs.live_records;
+        snprintf(buf, sizeof(buf),
+                 "Record slabs: %llu, %.1f MB\n"
+                 "Slab records: %llu live, %llu dead (%.1f%% fragmentation)\n",
+                 (unsigned long long) slabs.arenas, slabs.bytes / 1048576.0,
+                 (unsigned long long) slabs.live_records, (unsigned long long) dead,
+                 slabs.records == 0 ? 0.0 : 100.0 * dead / slabs.records);
+        value->append(buf);
+        VersionSet::MergeStats merges;
+        versions_->GetMergeStats(&merges);
+        snprintf(buf, sizeof(buf),
+                 "Nvm merges (%s): %llu, write amp %.2f, read amp %.2f intervals/get\n",
+                 options_.merge_policy != nullptr ? options_.merge_policy->Name() : "all",
+                 (unsigned long long) merges.merges,
+                 merges.flushed == 0 ? 0.0 : 1.0 + static_cast<double>(merges.merged) / merges.flushed,
+                 merges.gets == 0 ? 0.0 : static_cast<double>(merges.probes) / merges.gets);
+        value->append(buf);
+        return true;
+    }
+
+    return false;
+}
+
 // Convenience methods
 Status DBImpl::Put(const WriteOptions& o, const Slice& key, const Slice& val) {
     return DB::Put(o, key, val);
@@ -662,9 +1177,14 @@ void DBImpl::RecordBackgroundError(const Status& s) {
 
 // my_batch is different from batchGroup which contains sequence
 Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
+    if (pipelined_write_) {
+        return PipelinedWrite(options, my_batch);
+    }
+
     Writer w(&mutex_);
     w.batch = my_batch;
     w.sync = options.sync;
+    w.disable_wal = options.disable_wal;
     w.done = false;
 
     MutexLock l(&mutex_);
@@ -687,7 +1207,7 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
     // last_writer to be dealt in batchGroup
     Writer* last_writer = &w;
     if (status.ok() && my_batch != nullptr) {  // nullptr batch is for compactions
-        WriteBatch* updates = BuildBatchGroup(&last_writer);
+        WriteBatch* updates = BuildBatchGroup(&last_writer, tmp_batch_);
         WriteBatchInternal::SetSequence(updates, last_sequence + 1);
         last_sequence += WriteBatchInternal::Count(updates);
 
@@ -700,9 +1220,10 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
             //record the whole content of writeBatch, see write_batch.cc's information about writeBatch's _rep,
             //log is divided in writeBatch logically and block physically,
             //therefore in skiplsit there maybe exists the same key on different insert time.
-            status = log_->AddRecord(WriteBatchInternal::Contents(updates));
+            // A group is either all logged or all not, see BuildBatchGroup().
+            status = AddToLog(updates, options.disable_wal);
             bool sync_error = false;
-            if (status.ok() && options.sync) {
+            if (status.ok() && options.sync && !options.disable_wal) {
                 status = logfile_->Sync();
                 if (!status.ok()) {
                     sync_error = true;
@@ -748,9 +1269,134 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* my_batch) {
     return status;
 }
 
+// The log and mem_ are two stages of a pipeline: the leader at the front of
+// writers_ appends its group to the log, then leaves writers_ for the back
+// of inserters_, so the next leader logs its group while this one waits for
+// the groups logged before and inserts into mem_.
+Status DBImpl::PipelinedWrite(const WriteOptions& options, WriteBatch* my_batch) {
+    Writer w(&mutex_);
+    w.batch = my_batch;
+    w.sync = options.sync;
+    w.disable_wal = options.disable_wal;
+    w.done = false;
+
+    MutexLock l(&mutex_);
+    writers_.push_back(&w);
+    // Writers of a group being inserted are out of writers_ already.
+    while (!w.done && (writers_.empty() || &w != writers_.front())) {
+        w.cv.Wait();
+    }
+    if (w.done) {
+        return w.status;
+    }
+
+    // May temporarily unlock and wait, switching mem_ waits for inserters_.
+    Status status = MakeRoomForWrite(my_batch == nullptr);
+    if (!status.ok() || my_batch == nullptr) {
+        writers_.pop_front();
+        if (!writers_.empty()) {
+            writers_.front()->cv.Signal();
+        }
+        return status;
+    }
+
+    // Sequence numbers are given out in log order, continuing those of the
+    // groups not inserted yet.
+    SequenceNumber last_sequence = inserters_.empty() ?
+            versions_->LastSequence() : inserters_.back()->last_sequence;
+    Writer* last_writer = &w;
+    WriteBatch group_batch;
+    WriteBatch* updates = BuildBatchGroup(&last_writer, &group_batch);
+    WriteBatchInternal::SetSequence(updates, last_sequence + 1);
+    w.last_sequence = last_sequence + WriteBatchInternal::Count(updates);
+
+    // Sync writers are let into groups of non-sync ones, one sync covers all.
+    bool sync = false;
+    for (std::deque<Writer*>::iterator iter = writers_.begin(); ; ++iter) {
+        sync = sync || (*iter)->sync;
+        if (*iter == last_writer) break;
+    }
+
+    {
+        mutex_.Unlock();
+        status = AddToLog(updates, options.disable_wal);
+        bool sync_error = false;
+        if (status.ok() && sync && !options.disable_wal) {
+            status = logfile_->Sync();
+            if (!status.ok()) {
+                sync_error = true;
+            }
+        }
+        mutex_.Lock();
+        if (sync_error) {
+            RecordBackgroundError(status);
+        }
+    }
+
+    // Hand the log over to the next group, keeping track of the writers
+    // to notify once the group is inserted.
+    std::vector<Writer*> members;
+    while (true) {
+        Writer* ready = writers_.front();
+        writers_.pop_front();
+        if (ready != &w) {
+            members.push_back(ready);
+        }
+        if (ready == last_writer) break;
+    }
+    if (!writers_.empty()) {
+        writers_.front()->cv.Signal();
+    }
+
+    inserters_.push_back(&w);
+    while (&w != inserters_.front()) {
+        w.cv.Wait();
+    }
+    // mem_ is not switched while inserters_ is not empty.
+    if (status.ok()) {
+        mutex_.Unlock();
+        status = WriteBatchInternal::InsertInto(updates, mem_);
+        mutex_.Lock();
+    }
+    versions_->SetLastSequence(w.last_sequence);
+    inserters_.pop_front();
+    if (!inserters_.empty()) {
+        inserters_.front()->cv.Signal();
+    } else if (!writers_.empty()) {
+        // The leader may be waiting in WaitForPendingInserts().
+        writers_.front()->cv.Signal();
+    }
+
+    for (size_t i = 0; i < members.size(); i++) {
+        members[i]->status = status;
+        members[i]->done = true;
+        members[i]->cv.Signal();
+    }
+    return status;
+}
+
+// The keys of an unlogged group still go to the log, so recovery replays a
+// lost write as a deletion instead of the older logged value of its key.
+Status DBImpl::AddToLog(const WriteBatch* updates, bool disable_wal) {
+    if (!disable_wal) {
+        return log_->AddRecord(WriteBatchInternal::Contents(updates));
+    }
+    WriteBatch keys;
+    WriteBatchInternal::KeysAsDeletions(updates, &keys);
+    return log_->AddRecord(WriteBatchInternal::Contents(&keys));
+}
+
+void DBImpl::WaitForPendingInserts() {
+    mutex_.AssertHeld();
+    assert(!writers_.empty());
+    while (!inserters_.empty()) {
+        writers_.front()->cv.Wait();
+    }
+}
+
 // REQUIRES: Writer list must be non-empty
 // REQUIRES: First writer must have a non-null batch
-WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
+WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer, WriteBatch* tmp_batch) {
     mutex_.AssertHeld();
     assert(!writers_.empty());
     Writer* first = writers_.front();
@@ -772,27 +1418,36 @@ WriteBatch* DBImpl::BuildBatchGroup(Writer** last_writer) {
     ++iter;  // Advance past "first"
     for (; iter != writers_.end(); ++iter) {
         Writer* w = *iter;
-        if (w->sync && !first->sync) {
+        if (w->sync && !first->sync && !pipelined_write_) {
             // Do not include a sync write into a batch handled by a non-sync write.
             break;
         }
 
-        if (w->batch != nullptr) {
-            size += WriteBatchInternal::ByteSize(w->batch);
-            if (size > max_size) {
-                // Do not make batch too big
-                break;
-            }
+        if (w->batch == nullptr) {
+            // IngestSortedRuns() and FlushMemTable() wait for their own turn.
+            break;
+        }
 
-            // Append to *result
-            if (result == first->batch) {
-                // Switch to temporary batch instead of disturbing caller's batch
-                result = tmp_batch_;
-                assert(WriteBatchInternal::Count(result) == 0);
-                WriteBatchInternal::Append(result, first->batch);
-            }
-            WriteBatchInternal::Append(result, w->batch);
+        if (w->disable_wal != first->disable_wal) {
+            // Do not log writes of a writer that disables the log, nor leave
+            // out those of one that does not.
+            break;
+        }
+
+        size += WriteBatchInternal::ByteSize(w->batch);
+        if (size > max_size) {
+            // Do not make batch too big
+            break;
+        }
+
+        // Append to *result
+        if (result == first->batch) {
+            // Switch to temporary batch instead of disturbing caller's batch
+            result = tmp_batch;
+            assert(WriteBatchInternal::Count(result) == 0);
+            WriteBatchInternal::Append(result, first->batch);
         }
+        WriteBatchInternal::Append(result, w->batch);
         // record the last batch in writers_ to be built into a batch group,
         // the consumer thread in the front of writers_ will consume them and
         // notify the corresponding producer thread.
@@ -858,12 +1513,16 @@ Status DBImpl::MakeRoomForWrite(bool force) {
             // There are too many level-0 files.
             Log(options_.info_log, "Too many L0 files; waiting...\n");
             background_work_finished_signal_.Wait();
-        } */else {
+        } */else if (!inserters_.empty()) {
+            // Groups logged into the current log are still being inserted
+            // into mem_, let them finish before switching.
+            WaitForPendingInserts();
+        } else {
             // Attempt to switch to a new memtable and trigger compaction of old
             assert(versions_->PrevLogNumber() == 0);
             uint64_t new_log_number = versions_->NewFileNumber();
             WritableFile* lfile = nullptr;
-            s = env_->NewWritableFile(LogFileName(dbname_, new_log_number), &lfile);
+            s = NewLogFile(new_log_number, &lfile);
             if (!s.ok()) {
                 // Avoid chewing through file number space in a tight loop.
                 versions_->ReuseFileNumber(new_log_number);
@@ -876,8 +1535,9 @@ Status DBImpl::MakeRoomForWrite(bool force) {
             log_ = new log::Writer(lfile);
             imm_ = mem_;
             has_imm_.Release_Store(imm_);
-            mem_ = new MemTable(internal_comparator_);
+            mem_ = new MemTable(internal_comparator_, options_.zero_copy_flush);
             mem_->Ref();
+            InstallSuperVersion();
             force = false;   // Do not force another compaction if have room
             MaybeScheduleCompaction();
         }
@@ -885,6 +1545,28 @@ Status DBImpl::MakeRoomForWrite(bool force) {
     return s;
 }
 
+Status DBImpl::NewLogFile(uint64_t number, WritableFile** file) {
+    mutex_.AssertHeld();
+    const std::string fname = LogFileName(dbname_, number);
+    if (!options_.use_mmap_log) {
+        return env_->NewWritableFile(fname, file);
+    }
+    if (!recycled_logs_.empty()) {
+        // Ignoring errors, a new file is created then.
+        env_->RenameFile(RecycledLogFileName(dbname_, recycled_logs_.back()), fname);
+        recycled_logs_.pop_back();
+    }
+    // Records of a memtable a bit larger than write_buffer_size usually fit.
+    Status s = env_->NewMappedWritableFile(fname,
+                                           options_.write_buffer_size + options_.write_buffer_size / 4,
+                                           file);
+    if (s.IsNotSupportedError()) {
+        // An Env without mapped files writes the log as usual.
+        s = env_->NewWritableFile(fname, file);
+    }
+    return s;
+}
+
 void DBImpl::MaybeScheduleCompaction() {
     mutex_.AssertHeld();
     if (background_compaction_scheduled_) {
@@ -1054,6 +1736,7 @@ void DBImpl::CompactMemTable() {
         imm_->Unref();
         imm_ = nullptr;
         has_imm_.Release_Store(nullptr);
+        InstallSuperVersion();
         DeleteObsoleteFiles();
     } else {
         RecordBackgroundError(s);
@@ -1085,7 +1768,7 @@ Status DBImpl::WriteLevel0Table(MemTable* mem/*, VersionEdit* edit,
         // TODO: convert imm_ to nvm_imm_ and make it accessible, now done.
 
         //s = BuildTable(dbname_, env_, options_, table_cache_, iter, &meta);
-        s = versions_->BuildTable(iter, meta.count);
+        s = versions_->BuildTable(iter, meta.count, mem->SharedArena());
         assert(s.ok());
         mutex_.Lock();
     }
@@ -1158,14 +1841,13 @@ Status DB::Open(const Options& options, const std::string& dbname,
         // Create new log and a corresponding memtable.
         uint64_t new_log_number = impl->versions_->NewFileNumber();
         WritableFile* lfile;
-        s = options.env->NewWritableFile(LogFileName(dbname, new_log_number),
-                                         &lfile);
+        s = impl->NewLogFile(new_log_number, &lfile);
         if (s.ok()) {
             //edit.SetLogNumber(new_log_number);
             impl->logfile_ = lfile;
             impl->logfile_number_ = new_log_number;
             impl->log_ = new log::Writer(lfile);
-            impl->mem_ = new MemTable(impl->internal_comparator_);
+            impl->mem_ = new MemTable(impl->internal_comparator_, impl->options_.zero_copy_flush);
             impl->mem_->Ref();
         }
     }
@@ -1179,6 +1861,7 @@ Status DB::Open(const Options& options, const std::string& dbname,
     }
 
     if (s.ok()) {
+        impl->InstallSuperVersion();
         impl->DeleteObsoleteFiles();
         impl->MaybeScheduleCompaction();
     }
@@ -6,8 +6,10 @@
 #define SOFTDB_DB_IMPL_H
 
 
+#include <atomic>
 #include <deque>
 #include <set>
+#include <vector>
 #include "dbformat.h"
 #include "log_writer.h"
 #include "snapshot.h"
@@ -15,10 +17,12 @@
 #include "softdb/env.h"
 #include "port/port.h"
 #include "port/thread_annotations.h"
+#include "util/thread_local.h"
 
 namespace softdb {
 
     class MemTable;
+    struct SuperVersion;
     //class TableCache;
     class Version;
     class VersionEdit;
@@ -41,7 +45,11 @@ namespace softdb {
         virtual Iterator* NewIterator(const ReadOptions&);
         virtual const Snapshot* GetSnapshot();
         virtual void ReleaseSnapshot(const Snapshot* snapshot);
-        //virtual bool GetProperty(const Slice& property, std::string* value);
+        virtual void PartitionRange(const Range& range, int n,
+                                    std::vector<std::string>* splits);
+        virtual Status IngestSortedRuns(Iterator** runs, int n);
+        virtual Status FlushMemTable();
+        virtual bool GetProperty(const Slice& property, std::string* value);
         //virtual void GetApproximateSizes(const Range* range, int n, uint64_t* sizes);
         //virtual void CompactRange(const Slice* begin, const Slice* end);
 
@@ -73,7 +81,7 @@ namespace softdb {
         struct Writer;
 
 
-        Iterator* NewInternalIterator(/*const ReadOptions&,*/
+        Iterator* NewInternalIterator(const ReadOptions&,
                               SequenceNumber* latest_snapshot/*,
                               uint32_t* seed*/);
 
@@ -98,20 +106,53 @@ namespace softdb {
         // Errors are recorded in bg_error_.
         void CompactMemTable() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+        class RecoveryPool;
+
         Status RecoverLogFile(uint64_t log_number, bool last_log, /*bool* save_manifest,
-                              VersionEdit* edit,*/ SequenceNumber* max_sequence)
+                              VersionEdit* edit,*/ RecoveryPool* pool, SequenceNumber* max_sequence)
         EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
         Status WriteLevel0Table(MemTable* mem/*, VersionEdit* edit, Version* base*/)
         EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+        // Create the log file with the specified number, recycling a retired
+        // one with options_.use_mmap_log.
+        Status NewLogFile(uint64_t number, WritableFile** file)
+        EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
         Status MakeRoomForWrite(bool force /* compact even if there is room? */)
         EXCLUSIVE_LOCKS_REQUIRED(mutex_);
-        WriteBatch* BuildBatchGroup(Writer** last_writer)
+        WriteBatch* BuildBatchGroup(Writer** last_writer, WriteBatch* tmp_batch)
         EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+        // Append a write group to the log.  A group written with
+        // disable_wal logs its keys alone, as deletions.
+        // REQUIRES: this thread is logging, without holding mutex_
+        Status AddToLog(const WriteBatch* updates, bool disable_wal);
+
+        // Write() with options_.pipelined_write.
+        Status PipelinedWrite(const WriteOptions& options, WriteBatch* my_batch);
+
+        // Write mem_ into nvm if it is not empty and wait until it is done.
+        // REQUIRES: this thread is currently at the front of the writer queue
+        Status FlushMemTableLocked() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+        // Wait until no write group is being inserted into mem_.
+        // REQUIRES: this thread is currently at the front of the writer queue
+        void WaitForPendingInserts() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
         void RecordBackgroundError(const Status& s);
 
+        // Make a SuperVersion of mem_ and imm_ the current one, call it
+        // whenever either changes.
+        void InstallSuperVersion() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+        // Return the current SuperVersion, from the cache of the calling
+        // thread unless it is stale.  Locks mutex_ only to refresh the cache.
+        // The caller must pass the result to ReturnSuperVersion().
+        SuperVersion* GetSuperVersion() LOCKS_EXCLUDED(mutex_);
+        void ReturnSuperVersion(SuperVersion* sv) LOCKS_EXCLUDED(mutex_);
+
         void MaybeScheduleCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
         static void BGWork(void* db);
         void BackgroundCall();
@@ -132,6 +173,7 @@ namespace softdb {
         //const InternalFilterPolicy internal_filter_policy_;
         const Options options_;  // options_.comparator == &internal_comparator_
         const bool owns_info_log_;
+        const bool pipelined_write_;   // options_.pipelined_write on a multicore
         //const bool owns_cache_;
         const std::string dbname_;
 
@@ -154,11 +196,29 @@ namespace softdb {
         log::Writer* log_;
         //uint32_t seed_ GUARDED_BY(mutex_);  // For sampling.
 
+        // Numbers of the retired log files kept for recycling, renamed to
+        // temp files so that recovery skips them.
+        std::vector<uint64_t> recycled_logs_ GUARDED_BY(mutex_);
+
         // Queue of writers.
         std::deque<Writer*> writers_ GUARDED_BY(mutex_);
         WriteBatch* tmp_batch_ GUARDED_BY(mutex_);
 
-        SnapshotList snapshots_ GUARDED_BY(mutex_);
+        // Leaders of the logged write groups waiting to insert them into
+        // mem_ in log order, with options_.pipelined_write.
+        std::deque<Writer*> inserters_ GUARDED_BY(mutex_);
+
+        // Readers take snapshots without mutex_.
+        port::Mutex snapshots_mutex_ ACQUIRED_AFTER(mutex_);
+        SnapshotList snapshots_ GUARDED_BY(snapshots_mutex_);
+
+        // What reads look into besides nvm, cached by every reading thread in
+        // local_sv_ and checked against super_version_number_, so reads do not
+        // lock mutex_ unless mem_ or imm_ changed since the last read of the
+        // thread.
+        SuperVersion* super_version_ GUARDED_BY(mutex_);
+        std::atomic<uint64_t> super_version_number_;
+        ThreadLocalPtr local_sv_;
 
         // Set of table files to protect from deletion because they are
         // part of ongoing compactions.
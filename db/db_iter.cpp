@@ -41,7 +41,8 @@ class DBIter: public Iterator {
 public:
     // Which direction is the iterator currently moving?
     // (1) When moving forward, the internal iterator is positioned at
-    //     the exact entry that yields this->key(), this->value()
+    //     the exact entry that yields this->key(), this->value(), which
+    //     may be an entry read ahead, see IterNext()
     // (2) When moving backwards, the internal iterator is positioned
     //     just before all entries whose user key == this->key().
     enum Direction {
@@ -49,14 +50,23 @@ public:
         kReverse
     };
 
-    DBIter(DBImpl* db, const Comparator* cmp, Iterator* iter, SequenceNumber s/*,
-           uint32_t seed*/)
+    DBIter(DBImpl* db, const Comparator* cmp, Iterator* iter, SequenceNumber s,
+           const SliceTransform* prefix_extractor, const Slice* upper_bound,
+           const Slice* lower_bound/*, uint32_t seed*/)
             : db_(db),
               user_comparator_(cmp),
               iter_(iter),
               sequence_(s),
+              prefix_extractor_(prefix_extractor),
+              prefix_seek_(false),
+              upper_bound_(upper_bound),
+              lower_bound_(lower_bound),
               direction_(kForward),
-              valid_(false)/*,
+              valid_(false),
+              ahead_pos_(0),
+              ahead_count_(0),
+              ahead_size_(1),
+              batch_refills_(-1)/*,
               rnd_(seed),
               bytes_until_read_sampling_(RandomCompactionPeriod())*/ {
     }
@@ -69,11 +79,11 @@ public:
     // iter_->key() and iter_->value() which is currently pointed.(convenient for user_comparator_)
     virtual Slice key() const {
         assert(valid_);
-        return (direction_ == kForward) ? ExtractUserKey(iter_->key()) : saved_key_;
+        return (direction_ == kForward) ? ExtractUserKey(IterKey()) : saved_key_;
     }
     virtual Slice value() const {
         assert(valid_);
-        return (direction_ == kForward) ? iter_->value() : saved_value_;
+        return (direction_ == kForward) ? IterValue() : saved_value_;
     }
     virtual Status status() const {
         if (status_.ok()) {
@@ -84,6 +94,7 @@ public:
     }
 
     virtual void Next();
+    virtual int NextBatch(Slice* keys, Slice* values, int n);
     virtual void Prev();
     virtual void Seek(const Slice& target);
     virtual void SeekToFirst();
@@ -93,10 +104,48 @@ public:
     virtual void Abandon() {}
 
 private:
-    void FindNextUserEntry(bool skipping, std::string* skip);
+    void FindNextUserEntry(bool skipping, Slice* skip);
     void FindPrevUserEntry();
     bool ParseKey(ParsedInternalKey* key);
 
+    // Return true iff no prefix seek or ukey has the prefix of Seek target.
+    inline bool PrefixMatch(const Slice& ukey) const {
+        return !prefix_seek_ ||
+               (prefix_extractor_->InDomain(ukey) &&
+                prefix_extractor_->Transform(ukey) == Slice(prefix_start_));
+    }
+
+    // Moving forward, iter_ is read ahead by NextBatch() in batches of
+    // growing size, so a long scan costs one virtual call per batch
+    // instead of several per entry. Entries read ahead point into
+    // memtables and intervals pinned by iter_ until IterNext() has read
+    // ahead twice more, see Iterator::Unpin(), or NextBatch() returns.
+    inline bool IterValid() const {
+        return ahead_pos_ < ahead_count_ || iter_->Valid();
+    }
+    inline Slice IterKey() const {
+        return ahead_pos_ < ahead_count_ ? ahead_keys_[ahead_pos_] : iter_->key();
+    }
+    inline Slice IterValue() const {
+        return ahead_pos_ < ahead_count_ ? ahead_values_[ahead_pos_] : iter_->value();
+    }
+    void IterNext();
+
+    // Drop the entries read ahead, before iter_ is repositioned.
+    inline void ResetReadAhead() {
+        ahead_pos_ = 0;
+        ahead_count_ = 0;
+        ahead_size_ = 1;
+    }
+
+    // Put iter_ back at the entry it is logically at, before moving backward.
+    void SyncReadAhead();
+
+    inline bool PastUpperBound(const Slice& ukey) const {
+        return upper_bound_ != nullptr &&
+               user_comparator_->Compare(ukey, *upper_bound_) >= 0;
+    }
+
     inline void SaveKey(const Slice& k, std::string* dst) {
         dst->assign(k.data(), k.size());
     }
@@ -119,6 +168,11 @@ private:
     const Comparator* const user_comparator_;
     Iterator* const iter_;
     SequenceNumber const sequence_;
+    const SliceTransform* const prefix_extractor_;
+    bool prefix_seek_;          // whether last Seek() bounds keys by prefix_start_
+    std::string prefix_start_;
+    const Slice* const upper_bound_;
+    const Slice* const lower_bound_;
 
     Status status_;
     std::string saved_key_;     // == current key when direction_==kReverse
@@ -126,6 +180,16 @@ private:
     Direction direction_;
     bool valid_;
 
+    enum { kMaxReadAhead = 64 };
+    Slice ahead_keys_[kMaxReadAhead];
+    Slice ahead_values_[kMaxReadAhead];
+    int ahead_pos_;             // entry iter_ is logically at, if < ahead_count_
+    int ahead_count_;
+    int ahead_size_;            // number of entries to read ahead next time
+
+    std::string batch_key_;     // first key of NextBatch() moving backward
+    int batch_refills_;         // times iter_ was read ahead in NextBatch(), or -1
+
     //Random rnd_;
     //size_t bytes_until_read_sampling_;
 
@@ -135,7 +199,7 @@ private:
 };
 
 inline bool DBIter::ParseKey(ParsedInternalKey* ikey) {
-    Slice k = iter_->key();
+    Slice k = IterKey();
 
     //size_t bytes_read = k.size() + iter_->value().size();
     //while (bytes_until_read_sampling_ < bytes_read) {
@@ -172,28 +236,99 @@ void DBIter::Next() {
             return;
         }
         // saved_key_ already contains the key to skip past.
+        Slice skip = saved_key_;
+        FindNextUserEntry(true, &skip);
     } else {
-        // Store in saved_key_ the current key so we skip it below.
-        SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
+        // The current entry outlives the skipping, no need to copy its key.
+        Slice skip = ExtractUserKey(IterKey());
+        // tips: true means skip the current key to the next acceptable key.
+        FindNextUserEntry(true, &skip);
     }
+}
 
-    // tips: true means skip saved_key_ to the next acceptable key.
-    FindNextUserEntry(true, &saved_key_);
+int DBIter::NextBatch(Slice* keys, Slice* values, int n) {
+    batch_refills_ = 0;
+    int i = 0;
+    if (i < n && valid_ && direction_ == kReverse) {
+        // Next() reuses saved_key_ but leaves saved_value_ alone.
+        batch_key_.assign(saved_key_.data(), saved_key_.size());
+        keys[i] = batch_key_;
+        values[i] = saved_value_;
+        i++;
+        Next();
+    }
+    while (i < n && valid_) {
+        Slice skip = ExtractUserKey(IterKey());
+        keys[i] = skip;
+        values[i] = IterValue();
+        i++;
+        FindNextUserEntry(true, &skip);
+    }
+    batch_refills_ = -1;
+    return i;
 }
 
-void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
+void DBIter::IterNext() {
+    if (ahead_pos_ < ahead_count_) {
+        if (++ahead_pos_ < ahead_count_) {
+            return;
+        }
+    } else {
+        iter_->Next();
+    }
+    ahead_pos_ = 0;
+    ahead_count_ = 0;
+    // Entries read ahead before the last time are no longer used, unless
+    // NextBatch() gathered some of them.
+    if (batch_refills_ <= 0) {
+        iter_->Unpin();
+    }
+    if (batch_refills_ >= 0) {
+        batch_refills_++;
+    }
+    if (iter_->Valid()) {
+        ahead_count_ = iter_->NextBatch(ahead_keys_, ahead_values_, ahead_size_);
+        // Short scans read little ahead, long ones grow to kMaxReadAhead.
+        if (ahead_size_ < kMaxReadAhead) {
+            ahead_size_ *= 2;
+        }
+    }
+}
+
+void DBIter::SyncReadAhead() {
+    if (ahead_pos_ < ahead_count_) {
+        // internal keys are unique, Seek lands on the very entry.  The
+        // copy outlives the entries Seek() unpins.
+        const std::string target = ahead_keys_[ahead_pos_].ToString();
+        ResetReadAhead();
+        iter_->Seek(target);
+        assert(iter_->Valid() && iter_->key() == Slice(target));
+    }
+    ResetReadAhead();
+}
+
+void DBIter::FindNextUserEntry(bool skipping, Slice* skip) {
     // Loop until we hit an acceptable entry to yield
-    assert(iter_->Valid());
+    assert(IterValid());
     assert(direction_ == kForward);
     do {
         ParsedInternalKey ikey;
         if (ParseKey(&ikey) && ikey.sequence <= sequence_) {
+            if (!PrefixMatch(ikey.user_key) || PastUpperBound(ikey.user_key)) {
+                // left the prefix of Seek target or reached the upper bound,
+                // no more keys to yield.
+                break;
+            }
             switch (ikey.type) {
                 case kTypeDeletion:
                     // Arrange to skip all upcoming entries for this key since
-                    // they are hidden by this deletion.
-                    SaveKey(ikey.user_key, skip);
-                    skipping = true;
+                    // they are hidden by this deletion. Keep skip at the
+                    // newest entry of a key, older ones may be obsolete.
+                    if (!skipping ||
+                        user_comparator_->Compare(ikey.user_key, *skip) > 0) {
+                        *skip = ikey.user_key;
+                        skipping = true;
+                    }
                     break;
                 case kTypeValue:
                     if (skipping &&
@@ -207,8 +342,8 @@ void DBIter::FindNextUserEntry(bool skipping, std::string* skip) {
                     break;
             }
         }
-        iter_->Next();
-    } while (iter_->Valid());
+        IterNext();
+    } while (IterValid());
     saved_key_.clear();
     valid_ = false;
 }
@@ -219,6 +354,7 @@ void DBIter::Prev() {
     if (direction_ == kForward) {  // Switch directions?
         // iter_ is pointing at the current entry.  Scan backwards until
         // the key changes so we can use the normal reverse scanning code.
+        SyncReadAhead();
         assert(iter_->Valid());  // Otherwise valid_ would have been false
         SaveKey(ExtractUserKey(iter_->key()), &saved_key_);
         while (true) {
@@ -237,6 +373,8 @@ void DBIter::Prev() {
         direction_ = kReverse;
     }
 
+    // Moving backward, only saved_key_ and saved_value_ are kept.
+    iter_->Unpin();
     FindPrevUserEntry();
 }
 
@@ -247,7 +385,14 @@ void DBIter::FindPrevUserEntry() {
     if (iter_->Valid()) {
         do {
             ParsedInternalKey ikey;
-            if (ParseKey(&ikey) && ikey.sequence <= sequence_) {
+            if (ParseKey(&ikey) && ikey.sequence <= sequence_ &&
+                !PastUpperBound(ikey.user_key)) {
+                if (lower_bound_ != nullptr &&
+                    user_comparator_->Compare(ikey.user_key, *lower_bound_) < 0) {
+                    // reached the lower bound, no more keys to yield,
+                    // nor tombstones to skip.
+                    break;
+                }
                 if ((value_type != kTypeDeletion) &&
                     user_comparator_->Compare(ikey.user_key, saved_key_) < 0) {
                     // tips: make sure iter_->key's user_key < saved_key_, so saved_key_ and
@@ -273,7 +418,7 @@ void DBIter::FindPrevUserEntry() {
         } while (iter_->Valid());
     }
 
-    if (value_type == kTypeDeletion) {
+    if (value_type == kTypeDeletion || !PrefixMatch(saved_key_)) {
         // End
         valid_ = false;
         saved_key_.clear();
@@ -284,15 +429,26 @@ void DBIter::FindPrevUserEntry() {
     }
 }
 
-void DBIter::Seek(const Slice& target) {
+void DBIter::Seek(const Slice& user_target) {
+    Slice target = user_target;
+    if (lower_bound_ != nullptr && user_comparator_->Compare(target, *lower_bound_) < 0) {
+        target = *lower_bound_;
+    }
     direction_ = kForward;
+    prefix_seek_ = prefix_extractor_ != nullptr && prefix_extractor_->InDomain(target);
+    if (prefix_seek_) {
+        Slice prefix = prefix_extractor_->Transform(target);
+        prefix_start_.assign(prefix.data(), prefix.size());
+    }
     ClearSavedValue();
+    ResetReadAhead();
     saved_key_.clear();
     AppendInternalKey(
             &saved_key_, ParsedInternalKey(target, sequence_, kValueTypeForSeek));
     iter_->Seek(saved_key_);
     if (iter_->Valid()) {
-        FindNextUserEntry(false, &saved_key_ /* temporary storage */);
+        Slice skip;
+        FindNextUserEntry(false, &skip);
     } else {
         valid_ = false;
     }
@@ -300,10 +456,20 @@ void DBIter::Seek(const Slice& target) {
 
 void DBIter::SeekToFirst() {
     direction_ = kForward;
+    prefix_seek_ = false;
     ClearSavedValue();
-    iter_->SeekToFirst();
+    ResetReadAhead();
+    if (lower_bound_ != nullptr) {
+        saved_key_.clear();
+        AppendInternalKey(&saved_key_,
+                          ParsedInternalKey(*lower_bound_, sequence_, kValueTypeForSeek));
+        iter_->Seek(saved_key_);
+    } else {
+        iter_->SeekToFirst();
+    }
     if (iter_->Valid()) {
-        FindNextUserEntry(false, &saved_key_ /* temporary storage */);
+        Slice skip;
+        FindNextUserEntry(false, &skip);
     } else {
         valid_ = false;
     }
@@ -311,8 +477,23 @@ void DBIter::SeekToFirst() {
 
 void DBIter::SeekToLast() {
     direction_ = kReverse;
+    prefix_seek_ = false;
     ClearSavedValue();
-    iter_->SeekToLast();
+    ResetReadAhead();
+    if (upper_bound_ != nullptr) {
+        // step back from the first entry at or past the bound.
+        saved_key_.clear();
+        AppendInternalKey(&saved_key_,
+                          ParsedInternalKey(*upper_bound_, kMaxSequenceNumber, kValueTypeForSeek));
+        iter_->Seek(saved_key_);
+        if (iter_->Valid()) {
+            iter_->Prev();
+        } else {
+            iter_->SeekToLast();
+        }
+    } else {
+        iter_->SeekToLast();
+    }
     FindPrevUserEntry();
 }
 
@@ -322,9 +503,13 @@ Iterator* NewDBIterator(
         DBImpl* db,
         const Comparator* user_key_comparator,
         Iterator* internal_iter,
-        SequenceNumber sequence/*,
+        SequenceNumber sequence,
+        const SliceTransform* prefix_extractor,
+        const Slice* upper_bound,
+        const Slice* lower_bound/*,
         uint32_t seed*/) {
-    return new DBIter(db, user_key_comparator, internal_iter, sequence/*, seed*/);
+    return new DBIter(db, user_key_comparator, internal_iter, sequence,
+                      prefix_extractor, upper_bound, lower_bound/*, seed*/);
 }
 
 }  // namespace softdb
\ No newline at end of file
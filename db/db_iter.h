@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include "softdb/db.h"
+#include "softdb/slice_transform.h"
 #include "dbformat.h"
 
 namespace softdb {
@@ -16,10 +17,19 @@ class DBImpl;
 // Return a new iterator that converts internal keys (yielded by
 // "*internal_iter") that were live at the specified "sequence" number
 // into appropriate user keys.
+// If prefix_extractor is non-null, the iterator becomes invalid once it
+// leaves the prefix of the target of Seek().
+// If upper_bound is non-null, the iterator becomes invalid once it moves
+// forward to a user key >= *upper_bound.
+// If lower_bound is non-null, the iterator becomes invalid once it moves
+// backward to a user key < *lower_bound.
 Iterator* NewDBIterator(DBImpl* db,
                         const Comparator* user_key_comparator,
                         Iterator* internal_iter,
-                        SequenceNumber sequence/*,
+                        SequenceNumber sequence,
+                        const SliceTransform* prefix_extractor = nullptr,
+                        const Slice* upper_bound = nullptr,
+                        const Slice* lower_bound = nullptr/*,
                         uint32_t seed*/);
 }   // namespace softdb
 
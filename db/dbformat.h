@@ -42,6 +42,25 @@ namespace config {
 // Approximate gap in bytes between samples of data read during iteration.
     static const int kReadBytesPeriod = 1048576;
 
+// Maximum number of log files kept for recycling with Options::use_mmap_log.
+    static const int kNumRecycledLogs = 2;
+
+// Merges move the records of a slab out once less than 1/kSlabDeadRatio
+// of them are live, so the slab can be freed.
+    static const int kSlabDeadRatio = 2;
+
+// Without Options::merge_policy a merge rewrites about all the intervals
+// a flush of random keys overlaps.  The next one waits till 1/kMergeRewriteRatio of what the last
+// one rewrote was flushed since it started, or the intervals at a key
+// reach kMergeDeferredOverlaps times Options::max_overlap, so merges that
+// finish sooner, split across threads, do not run more often.
+    static const int kMergeRewriteRatio = 3;
+    static const int kMergeDeferredOverlaps = 4;
+
+// The nvm index is split into no more partitions than keep the tables a
+// flush is cut into at this many entries, were its keys random.
+    static const int kMinPartitionEntries = 4096;
+
 }  // namespace config
 
 class InternalKey;
@@ -235,6 +254,28 @@ static const char* EncodeKey(std::string* scratch, const Slice& target) {
     return scratch->data();
 }
 
+// Iterator::NextBatchUntil() over a table iterator whose entries are
+// length-prefixed internal keys, each followed by its length-prefixed
+// value, as in MemTable and NvmMemTable.  A null limit makes it
+// NextBatch().
+template <typename TableIterator>
+static int NextEncodedBatch(TableIterator* iter, Slice* keys, Slice* values, int n,
+                            const Comparator* cmp, const Slice* limit, bool inclusive) {
+    int i = 0;
+    for (; i < n && iter->Valid(); i++) {
+        keys[i] = GetLengthPrefixedSlice(iter->key());
+        if (limit != nullptr) {
+            const int r = cmp->Compare(keys[i], *limit);
+            if (r > 0 || (r == 0 && !inclusive)) {
+                break;
+            }
+        }
+        values[i] = GetLengthPrefixedSlice(keys[i].data() + keys[i].size());
+        iter->Next();
+    }
+    return i;
+}
+
 // Used for version_set iterator.
 enum {
     IterPrev = 1,
@@ -60,6 +60,11 @@ namespace softdb {
         return MakeFileName(dbname, number, "dbtmp");
     }
 
+    std::string RecycledLogFileName(const std::string& dbname, uint64_t number) {
+        assert(number > 0);
+        return MakeFileName(dbname, number, "logtmp");
+    }
+
     std::string InfoLogFileName(const std::string& dbname) {
         return dbname + "/LOG";
     }
@@ -76,7 +81,7 @@ namespace softdb {
 //    dbname/LOG
 //    dbname/LOG.old
 //    dbname/MANIFEST-[0-9]+
-//    dbname/[0-9]+.(log|sst|ldb)
+//    dbname/[0-9]+.(log|sst|ldb|dbtmp|logtmp)
     bool ParseFileName(const std::string& filename,
                        uint64_t* number,
                        FileType* type) {
@@ -115,6 +120,8 @@ namespace softdb {
                 *type = kTableFile;
             } else if (suffix == Slice(".dbtmp")) {
                 *type = kTempFile;
+            } else if (suffix == Slice(".logtmp")) {
+                *type = kRecycledLogFile;
             } else {
                 return false;
             }
@@ -23,7 +23,8 @@ namespace softdb {
         kDescriptorFile,
         kCurrentFile,
         kTempFile,
-        kInfoLogFile  // Either the current one, or an old one
+        kInfoLogFile,  // Either the current one, or an old one
+        kRecycledLogFile
     };
 
 // Return the name of the log file with the specified number
@@ -59,6 +60,10 @@ namespace softdb {
 // The result will be prefixed with "dbname".
     std::string TempFileName(const std::string& dbname, uint64_t number);
 
+// Return the name a log file is kept under for reuse, see
+// Options::use_mmap_log.  The result will be prefixed with "dbname".
+    std::string RecycledLogFileName(const std::string& dbname, uint64_t number);
+
 // Return the name of the info log file for "dbname".
     std::string InfoLogFileName(const std::string& dbname);
 
@@ -5,6 +5,9 @@
 #include "log_reader.h"
 
 #include <stdio.h>
+
+#include <algorithm>
+
 #include "softdb/env.h"
 #include "util/coding.h"
 #include "util/crc32c.h"
@@ -275,5 +278,246 @@ namespace softdb {
             }
         }
 
+        BlockReader::BlockReader(const Slice& contents, Reader::Reporter* reporter,
+                                 bool checksum, size_t window, const Runner& runner)
+                : file_(nullptr),
+                  size_(contents.size()),
+                  contents_(contents),
+                  base_(0),
+                  buffer_(nullptr),
+                  reporter_(reporter),
+                  checksum_(checksum),
+                  window_size_(window),
+                  runner_(runner),
+                  next_block_(0),
+                  block_(0),
+                  fragment_(0) {
+        }
+
+        BlockReader::BlockReader(RandomAccessFile* file, uint64_t size,
+                                 Reader::Reporter* reporter, bool checksum,
+                                 size_t window, const Runner& runner)
+                : file_(file),
+                  size_(size),
+                  base_(0),
+                  buffer_(nullptr),
+                  reporter_(reporter),
+                  checksum_(checksum),
+                  window_size_(window),
+                  runner_(runner),
+                  next_block_(0),
+                  block_(0),
+                  fragment_(0) {
+        }
+
+        BlockReader::~BlockReader() {
+            delete[] buffer_;
+        }
+
+        bool BlockReader::ReadBlocks(size_t first, size_t n) {
+            if (file_ == nullptr) {
+                return true;
+            }
+            if (buffer_ == nullptr) {
+                buffer_ = new char[window_size_ * kBlockSize];
+            }
+            base_ = static_cast<uint64_t>(first) * kBlockSize;
+            const size_t bytes = static_cast<size_t>(
+                    std::min(size_ - base_, static_cast<uint64_t>(n) * kBlockSize));
+            Status status = file_->Read(base_, bytes, &contents_, buffer_);
+            if (!status.ok()) {
+                contents_.clear();
+                if (reporter_ != nullptr) {
+                    reporter_->Corruption(static_cast<size_t>(size_ - base_), status);
+                }
+                return false;
+            }
+            return true;
+        }
+
+        void BlockReader::ParseBlock(uint64_t offset, std::vector<Fragment>* fragments) const {
+            // A short read ends the log like the end of the file does.
+            const size_t start = static_cast<size_t>(std::min(offset - base_,
+                                                              static_cast<uint64_t>(contents_.size())));
+            Slice buffer(contents_.data() + start,
+                         std::min(contents_.size() - start, static_cast<size_t>(kBlockSize)));
+            // Reader reaches EOF once it reads less than kBlockSize bytes.
+            const bool eof = buffer.size() < kBlockSize;
+            fragments->clear();
+            while (true) {
+                if (buffer.size() < kHeaderSize) {
+                    // Either a trailer to skip or a truncated header at the end
+                    // of the file, see Reader::ReadPhysicalRecord().
+                    if (eof) {
+                        fragments->push_back({kEof, Slice(), 0, nullptr});
+                    }
+                    return;
+                }
+
+                // Parse the header
+                const char* header = buffer.data();
+                const uint32_t a = static_cast<uint32_t>(header[4]) & 0xff;
+                const uint32_t b = static_cast<uint32_t>(header[5]) & 0xff;
+                const unsigned int type = header[6];
+                const uint32_t length = a | (b << 8);
+                if (kHeaderSize + length > buffer.size()) {
+                    if (!eof) {
+                        fragments->push_back({kBadRecord, Slice(), buffer.size(), "bad record length"});
+                    } else {
+                        fragments->push_back({kEof, Slice(), 0, nullptr});
+                    }
+                    return;
+                }
+
+                if (type == kZeroType && length == 0) {
+                    fragments->push_back({kBadRecord, Slice(), 0, nullptr});
+                    return;
+                }
+
+                // Check crc
+                if (checksum_) {
+                    uint32_t expected_crc = crc32c::Unmask(DecodeFixed32(header));
+                    uint32_t actual_crc = crc32c::Value(header + 6, 1 + length);
+                    if (actual_crc != expected_crc) {
+                        // Drop the rest of the block, see Reader::ReadPhysicalRecord().
+                        fragments->push_back({kBadRecord, Slice(), buffer.size(), "checksum mismatch"});
+                        return;
+                    }
+                }
+
+                buffer.remove_prefix(kHeaderSize + length);
+                fragments->push_back({type, Slice(header + kHeaderSize, length), 0, nullptr});
+            }
+        }
+
+        unsigned int BlockReader::ReadPhysicalRecord(Slice* result) {
+            while (true) {
+                if (block_ == window_.size()) {
+                    const size_t blocks = static_cast<size_t>((size_ + kBlockSize - 1) / kBlockSize);
+                    if (next_block_ == blocks) {
+                        break;
+                    }
+                    // Parse the next window of blocks
+                    const size_t first = next_block_;
+                    window_.resize(std::min(window_size_, blocks - first));
+                    if (!ReadBlocks(first, window_.size())) {
+                        // Stay at EOF, as Reader does on a read error.
+                        window_.clear();
+                        next_block_ = blocks;
+                        block_ = 0;
+                        fragment_ = 0;
+                        break;
+                    }
+                    runner_(window_.size(), [this, first](size_t i) {
+                        ParseBlock(static_cast<uint64_t>(first + i) * kBlockSize, &window_[i]);
+                    });
+                    next_block_ += window_.size();
+                    block_ = 0;
+                    fragment_ = 0;
+                }
+                const std::vector<Fragment>& fragments = window_[block_];
+                if (fragment_ == fragments.size()) {
+                    block_++;
+                    fragment_ = 0;
+                    continue;
+                }
+                const Fragment& fragment = fragments[fragment_++];
+                if (fragment.reason != nullptr) {
+                    ReportCorruption(fragment.dropped, fragment.reason);
+                }
+                if (fragment.type == kEof) {
+                    // Stay at EOF.
+                    fragment_--;
+                }
+                *result = fragment.data;
+                return fragment.type;
+            }
+            return kEof;
+        }
+
+        bool BlockReader::ReadRecord(Slice* record, std::string* scratch) {
+            scratch->clear();
+            record->clear();
+            bool in_fragmented_record = false;
+
+            Slice fragment;
+            while (true) {
+                const unsigned int record_type = ReadPhysicalRecord(&fragment);
+                switch (record_type) {
+                    case kFullType:
+                        if (in_fragmented_record) {
+                            if (!scratch->empty()) {
+                                ReportCorruption(scratch->size(), "partial record without end(1)");
+                            }
+                        }
+                        scratch->clear();
+                        *record = fragment;
+                        return true;
+
+                    case kFirstType:
+                        if (in_fragmented_record) {
+                            if (!scratch->empty()) {
+                                ReportCorruption(scratch->size(), "partial record without end(2)");
+                            }
+                        }
+                        scratch->assign(fragment.data(), fragment.size());
+                        in_fragmented_record = true;
+                        break;
+
+                    case kMiddleType:
+                        if (!in_fragmented_record) {
+                            ReportCorruption(fragment.size(),
+                                             "missing start of fragmented record(1)");
+                        } else {
+                            scratch->append(fragment.data(), fragment.size());
+                        }
+                        break;
+
+                    case kLastType:
+                        if (!in_fragmented_record) {
+                            ReportCorruption(fragment.size(),
+                                             "missing start of fragmented record(2)");
+                        } else {
+                            scratch->append(fragment.data(), fragment.size());
+                            *record = Slice(*scratch);
+                            return true;
+                        }
+                        break;
+
+                    case kEof:
+                        if (in_fragmented_record) {
+                            scratch->clear();
+                        }
+                        return false;
+
+                    case kBadRecord:
+                        if (in_fragmented_record) {
+                            ReportCorruption(scratch->size(), "error in middle of record");
+                            in_fragmented_record = false;
+                            scratch->clear();
+                        }
+                        break;
+
+                    default: {
+                        char buf[40];
+                        snprintf(buf, sizeof(buf), "unknown record type %u", record_type);
+                        ReportCorruption(
+                                (fragment.size() + (in_fragmented_record ? scratch->size() : 0)),
+                                buf);
+                        in_fragmented_record = false;
+                        scratch->clear();
+                        break;
+                    }
+                }
+            }
+            return false;
+        }
+
+        void BlockReader::ReportCorruption(uint64_t bytes, const char* reason) {
+            if (reporter_ != nullptr) {
+                reporter_->Corruption(static_cast<size_t>(bytes), Status::Corruption(reason));
+            }
+        }
+
     }  // namespace log
 }  // namespace softdb
\ No newline at end of file
@@ -8,12 +8,17 @@
 
 #include <stdint.h>
 
+#include <functional>
+#include <string>
+#include <vector>
+
 #include "log_format.h"
 #include "softdb/slice.h"
 #include "softdb/status.h"
 
 namespace softdb {
 
+    class RandomAccessFile;
     class SequentialFile;
 
     namespace log {
@@ -108,6 +113,83 @@ namespace softdb {
             void operator=(const Reader&);
         };
 
+        // Reads log records out of the contents of a whole log file held in
+        // memory, e.g. mapped by mmap, or out of a file read a window of
+        // blocks at a time.  A physical record never spans blocks,
+        // so unlike Reader, different threads can parse and checksum the
+        // physical records of different blocks, then ReadRecord() puts them
+        // together on one thread following the same rules as Reader does.
+        class BlockReader {
+        public:
+            // Runs work(0), ..., work(n-1), possibly concurrently, and returns
+            // once all of them are done.
+            typedef std::function<void(size_t n, const std::function<void(size_t)>& work)> Runner;
+
+            // Blocks are parsed "window" blocks at a time through "runner".
+            // "contents" and "*reporter" must remain live while this
+            // BlockReader is in use.
+            BlockReader(const Slice& contents, Reader::Reporter* reporter,
+                        bool checksum, size_t window, const Runner& runner);
+
+            // Read the first "size" bytes of "*file" into a buffer of
+            // "window" blocks, one window after another.  "*file" must
+            // remain live while this BlockReader is in use.
+            BlockReader(RandomAccessFile* file, uint64_t size, Reader::Reporter* reporter,
+                        bool checksum, size_t window, const Runner& runner);
+
+            ~BlockReader();
+
+            // Same as Reader::ReadRecord(), except that *record points into
+            // contents unless the record was fragmented.  Reading from a file,
+            // *record is only valid until the next call.
+            bool ReadRecord(Slice* record, std::string* scratch);
+
+        private:
+            // A physical record, or a drop to report when it is read.
+            struct Fragment {
+                unsigned int type;
+                Slice data;
+                size_t dropped;         // bytes to report if reason != nullptr
+                const char* reason;
+            };
+
+            // Same values as those of Reader.
+            enum {
+                kEof = kMaxRecordType + 1,
+                kBadRecord = kMaxRecordType + 2
+            };
+
+            RandomAccessFile* const file_;  // nullptr if contents_ is the whole log
+            const uint64_t size_;
+            Slice contents_;                // window_ read from file_, at offset base_
+            uint64_t base_;
+            char* buffer_;                  // backing store of contents_ read from file_
+            Reader::Reporter* const reporter_;
+            bool const checksum_;
+            const size_t window_size_;
+            const Runner runner_;
+            size_t next_block_;         // First block after window_
+            std::vector<std::vector<Fragment> > window_;
+            size_t block_;              // Position of the next fragment in window_
+            size_t fragment_;
+
+            // Parse the physical records of the block at "offset".
+            void ParseBlock(uint64_t offset, std::vector<Fragment>* fragments) const;
+
+            // Make contents_ hold "n" blocks from "first" on, return false
+            // on a read error, which is reported.
+            bool ReadBlocks(size_t first, size_t n);
+
+            // Return type, or one of the preceding special values
+            unsigned int ReadPhysicalRecord(Slice* result);
+
+            void ReportCorruption(uint64_t bytes, const char* reason);
+
+            // No copying allowed
+            BlockReader(const BlockReader&);
+            void operator=(const BlockReader&);
+        };
+
     }  // namespace log
 }  // namespace softdb
 
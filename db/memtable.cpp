@@ -11,18 +11,20 @@
 
 namespace softdb {
 
-MemTable::MemTable(const InternalKeyComparator& cmp)
+MemTable::MemTable(const InternalKeyComparator& cmp, bool shared_arena)
         : comparator_(cmp),
           refs_(0),
           num_(0),
-          table_(comparator_, &arena_) {
+          arena_(new Arena(shared_arena)),
+          table_(comparator_, arena_) {
 }
 
 MemTable::~MemTable() {
     assert(refs_ == 0);
+    arena_->Unref();
 }
 
-size_t MemTable::ApproximateMemoryUsage() { return arena_.MemoryUsage(); }
+size_t MemTable::ApproximateMemoryUsage() { return arena_->MemoryUsage(); }
 
 //  GetLengthPrefixedSlice gets the Internal keys from char*
 int MemTable::KeyComparator::operator()(const char* aptr, const char* bptr)
@@ -43,6 +45,14 @@ public:
     virtual void SeekToLast() { iter_.SeekToLast(); }
     virtual void Next() { iter_.Next(); }
     virtual void Prev() { iter_.Prev(); }
+    virtual int NextBatch(Slice* keys, Slice* values, int n) {
+        return NextEncodedBatch(&iter_, keys, values, n, nullptr, nullptr, false);
+    }
+    virtual int NextBatchUntil(Slice* keys, Slice* values, int n,
+                               const Comparator* cmp, const Slice& limit,
+                               bool inclusive) {
+        return NextEncodedBatch(&iter_, keys, values, n, cmp, &limit, inclusive);
+    }
     virtual Slice key() const { return GetLengthPrefixedSlice(iter_.key()); }
     virtual Slice value() const {
         Slice key_slice = GetLengthPrefixedSlice(iter_.key());
@@ -69,7 +79,7 @@ Iterator* MemTable::NewIterator() {
 }
 
 //char* buf is inserted into skiplist, but automatically converted to slice
-void MemTable::Add(SequenceNumber s, ValueType type,
+bool MemTable::Add(SequenceNumber s, ValueType type,
                    const Slice& key,
                    const Slice& value) {
     // Format of an entry is concatenation of:
@@ -83,7 +93,10 @@ void MemTable::Add(SequenceNumber s, ValueType type,
     const size_t encoded_len =
             VarintLength(internal_key_size) + internal_key_size +
             VarintLength(val_size) + val_size;
-    char* buf = arena_.Allocate(encoded_len);
+    char* buf = arena_->Allocate(encoded_len);
+    if (buf == nullptr) {
+        return false;
+    }
     char* p = EncodeVarint32(buf, internal_key_size);
     memcpy(p, key.data(), key_size);
     p += key_size;
@@ -92,7 +105,7 @@ void MemTable::Add(SequenceNumber s, ValueType type,
     p = EncodeVarint32(p, val_size);
     memcpy(p, value.data(), val_size);
     assert(p + val_size == buf + encoded_len);
-    table_.Insert(buf);
+    return table_.Insert(buf);
 }
 
 bool MemTable::Get(const LookupKey& key, std::string* value, Status* s) {
@@ -23,7 +23,10 @@ class MemTable {
 public:
     // MemTables are reference counted.  The initial reference count
     // is zero and the caller must call Ref() at least once.
-    explicit MemTable(const InternalKeyComparator& comparator);
+    //
+    // With shared_arena, the records are allocated from a shared Arena
+    // that nvm tables can take over, see SharedArena().
+    explicit MemTable(const InternalKeyComparator& comparator, bool shared_arena = false);
 
     // Increase reference count.
     inline void Ref() { ++refs_; }
@@ -56,7 +59,8 @@ public:
     // Add an entry into memtable that maps key to value at the
     // specified sequence number and with the specified type.
     // Typically value will be empty if type==kTypeDeletion.
-    void Add(SequenceNumber seq, ValueType type,
+    // Return false if the arena is out of memory.
+    bool Add(SequenceNumber seq, ValueType type,
              const Slice& key,
              const Slice& value);
 
@@ -66,6 +70,11 @@ public:
     // Else, return false.
     bool Get(const LookupKey& key, std::string* value, Status* s);
 
+    // Return the arena the records yielded by NewIterator()->Raw() are
+    // allocated from if it is shared, otherwise nullptr.  A taker keeps
+    // the records alive past this memtable by referencing the arena.
+    Arena* SharedArena() const { return arena_->shared() ? arena_ : nullptr; }
+
 private:
     ~MemTable();  // Private since only Unref() should be used to delete it
 
@@ -86,7 +95,7 @@ private:
     int refs_;
 
     int num_; // count of keys
-    Arena arena_;
+    Arena* const arena_;
     Table table_;
 
     // No copying allowed
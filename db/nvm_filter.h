@@ -0,0 +1,188 @@
+//
+// Created by lingo on 19-5-20.
+//
+
+#ifndef SOFTDB_NVM_FILTER_H
+#define SOFTDB_NVM_FILTER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "softdb/options.h"
+#include "softdb/slice.h"
+#include "util/cuckoofilter.h"
+#include "util/xorfilter.h"
+
+namespace softdb {
+
+// Approximate membership test of user keys stored in a nvm_imm_.
+// All user keys are added in Transport, then Finish() is called once,
+// after that the filter is read only and shared by readers.
+class NvmFilter {
+public:
+    NvmFilter() { }
+
+    virtual ~NvmFilter() { }
+
+    // REQUIRES: Finish() not called yet.
+    virtual void Add(const Slice& ukey) = 0;
+
+    // Seal the filter after the last Add().
+    virtual void Finish() { }
+
+    // Return false iff ukey is definitely not added.
+    virtual bool Contain(const Slice& ukey) const = 0;
+
+    virtual size_t SizeInBytes() const = 0;
+
+private:
+    // No copying allowed
+    NvmFilter(const NvmFilter&);
+    void operator=(const NvmFilter&);
+};
+
+template <size_t bits_per_item>
+class NvmCuckooFilter : public NvmFilter {
+public:
+    explicit NvmCuckooFilter(int num) : filter_(num) { }
+    virtual void Add(const Slice& ukey) { filter_.Add(ukey); }
+    virtual bool Contain(const Slice& ukey) const { return filter_.Contain(ukey); }
+    virtual size_t SizeInBytes() const { return filter_.SizeInBytes(); }
+
+private:
+    CuckooHash::CuckooFilter<bits_per_item> filter_;
+};
+
+template <typename FingerprintType>
+class NvmXorFilter : public NvmFilter {
+public:
+    explicit NvmXorFilter(int num) : filter_(num) { }
+    virtual void Add(const Slice& ukey) { filter_.Add(ukey); }
+    virtual void Finish() { filter_.Build(); }
+    virtual bool Contain(const Slice& ukey) const { return filter_.Contain(ukey); }
+    virtual size_t SizeInBytes() const { return filter_.SizeInBytes(); }
+
+private:
+    CuckooHash::XorFilter<FingerprintType> filter_;
+};
+
+// Return a filter for at most num user keys, bits is rounded up to
+// the nearest fingerprint width supported by type:
+// kCuckooFilter: 8/12/16/32, kXorFilter: 8/16/32.
+inline NvmFilter* NewNvmFilter(NvmFilterType type, int bits, int num) {
+    switch (type) {
+        case kXorFilter:
+            if (bits <= 8) return new NvmXorFilter<uint8_t>(num);
+            if (bits <= 16) return new NvmXorFilter<uint16_t>(num);
+            return new NvmXorFilter<uint32_t>(num);
+        case kCuckooFilter:
+        default:
+            if (bits <= 8) return new NvmCuckooFilter<8>(num);
+            if (bits <= 12) return new NvmCuckooFilter<12>(num);
+            if (bits <= 16) return new NvmCuckooFilter<16>(num);
+            return new NvmCuckooFilter<32>(num);
+    }
+}
+
+// Range filter answering "any user key in [start, limit)?" with false
+// positive but never false negative, similar to SuRF-Base which stores
+// truncated keys.
+//
+// User keys of a nvm_imm_ share the common prefix of its smallest and
+// largest user key, the filter stores the common prefix once plus the
+// sorted distinct 8 bytes code following it of each user key.
+// Codes keep the order of keys, so a range maps to a range of codes.
+//
+// REQUIRES: user keys are ordered bytewise.
+class NvmRangeFilter {
+public:
+    NvmRangeFilter() { }
+
+    // REQUIRES: ukey >= any user key added before, Finish() not called yet,
+    // ukey stays alive until Finish().
+    void Add(const Slice& ukey) {
+        keys_.push_back(ukey);
+    }
+
+    void Finish() {
+        if (!keys_.empty()) {
+            const Slice& first = keys_.front();
+            const Slice& last = keys_.back();
+            size_t len = 0;
+            const size_t min_len = std::min(first.size(), last.size());
+            while (len < min_len && first[len] == last[len]) {
+                len++;
+            }
+            prefix_.assign(first.data(), len);
+            codes_.reserve(keys_.size());
+            for (auto &key : keys_) {
+                const uint64_t code = Code(key);
+                if (codes_.empty() || codes_.back() != code) {
+                    codes_.push_back(code);
+                }
+            }
+            codes_.shrink_to_fit();
+        }
+        std::vector<Slice>().swap(keys_);
+    }
+
+    // Return false iff no user key k added with start <= k < limit,
+    // limit == nullptr means no upper limit.
+    bool RangeMayMatch(const Slice& start, const Slice* limit) const {
+        if (codes_.empty()) {
+            return false;
+        }
+        const Slice prefix(prefix_);
+        uint64_t lower = 0;
+        uint64_t upper = UINT64_MAX;
+        int r = Slice(start.data(), std::min(start.size(), prefix.size())).compare(prefix);
+        if (r > 0) {
+            return false;
+        } else if (r == 0 && start.size() >= prefix.size()) {
+            lower = Code(start);
+        }
+        if (limit != nullptr) {
+            r = Slice(limit->data(), std::min(limit->size(), prefix.size())).compare(prefix);
+            if (r < 0 || (r == 0 && limit->size() < prefix.size())) {
+                return false;
+            } else if (r == 0) {
+                upper = Code(*limit);
+            }
+        }
+        // a key k < limit maps to a code <= Code(limit)
+        auto it = std::lower_bound(codes_.begin(), codes_.end(), lower);
+        return it != codes_.end() && *it <= upper;
+    }
+
+    size_t SizeInBytes() const {
+        return prefix_.size() + codes_.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    // big endian 8 bytes following prefix_, padded with 0.
+    // REQUIRES: key starts with prefix_.
+    uint64_t Code(const Slice& key) const {
+        uint64_t code = 0;
+        for (size_t i = prefix_.size(); i < prefix_.size() + 8; i++) {
+            code <<= 8;
+            if (i < key.size()) {
+                code |= static_cast<uint8_t>(key[i]);
+            }
+        }
+        return code;
+    }
+
+    std::vector<Slice> keys_;       // user keys added but not encoded
+    std::string prefix_;
+    std::vector<uint64_t> codes_;
+
+    // No copying allowed
+    NvmRangeFilter(const NvmRangeFilter&);
+    void operator=(const NvmRangeFilter&);
+};
+
+}   // namespace softdb
+
+#endif //SOFTDB_NVM_FILTER_H
@@ -9,6 +9,9 @@
 #include "util/random.h"
 #include "nvm_memtable.h"
 #include "table/merger.h"
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
 #include <vector>
 
 namespace softdb {
@@ -28,6 +31,8 @@ public:
 
     class Interval;
 
+    class Stab;
+
 private:
 
     class IntervalSLNode;
@@ -52,8 +57,17 @@ public:
         pthread_rwlock_wrlock(&rwlock);
     }
 
+    // Releasing the write lock after changing the index gets its flat copy
+    // rebuilt, see EnableFlatIndex().
     inline void WriteUnlock() {
         pthread_rwlock_unlock(&rwlock);
+        if (flat_enabled_) {
+            if (retire_handler_ != nullptr) {
+                (*retire_handler_)(retire_arg_);
+            } else {
+                RefreshFlatIndex();
+            }
+        }
     }
 
 private:
@@ -75,6 +89,30 @@ private:
     // interval count, automatically changed inside insert(Interval) and delete(Interval) only.
     uint64_t iCount_;
 
+    // Intervals whose last reference is gone, linked by next_retired_.
+    std::atomic<Interval*> retired_;
+    void (*retire_handler_)(void* arg);
+    void* retire_arg_;
+
+    class FlatIndex;
+
+    bool flat_enabled_;
+    uint64_t version_;  // bumped by every change of intervals
+    // Intervals inserted (true) or removed (false) since flat_ was made,
+    // added to under the write lock and taken under the read lock by
+    // RefreshFlatIndex().  Each insertion holds a reference.
+    std::vector<std::pair<Interval*, bool>> flat_changes_;
+    // A copy is installed without the lock, readers take flat_ only once
+    // flat_version_, stored after it, is version_.
+    pthread_mutex_t flat_mutex_;            // held while a copy is made
+    std::atomic<FlatIndex*> flat_;
+    std::atomic<uint64_t> flat_version_;    // version_ of flat_, or kNoFlatVersion
+    static const uint64_t kNoFlatVersion = ~uint64_t(0);
+
+    // Record a change of I for the next flat copy.
+    // REQUIRES: write lock held.
+    void AddFlatChange(const Interval* I, bool inserted);
+
     typedef IntervalListElt* ILE_handle;
 
     int randomLevel();  // choose a new node level at random
@@ -103,6 +141,11 @@ private:
     // into list, returning a pointer to its location.
     IntervalSLNode* insert(const Key& searchKey);
 
+    // Link a new node for searchKey after the last node, update holds
+    // the last node of each level and is moved onto the new node.
+    // REQUIRES: searchKey is greater than every key in list.
+    IntervalSLNode* append(const Key& searchKey, IntervalSLNode** update);
+
     // adjust markers after insertion of x with update vector "update"
     void adjustMarkersOnInsert(IntervalSLNode* x,
                                IntervalSLNode** update);
@@ -134,6 +177,9 @@ private:
     void remove(IntervalSLNode* x,
                 IntervalSLNode** update);
 
+    // Push I onto retired_ without locking.
+    void Retire(Interval* I);
+
     inline static bool timeCmp(Interval* l, Interval* r) {
         return l->stamp_ > r->stamp_;
     }
@@ -147,7 +193,15 @@ private:
                           head_(new IntervalSLNode(MAX_FORWARD)),
                           comparator_(cmp),
                           timestamp_(1),
-                          iCount_(0) {
+                          iCount_(0),
+                          retired_(nullptr),
+                          retire_handler_(nullptr),
+                          retire_arg_(nullptr),
+                          flat_enabled_(false),
+                          version_(0),
+                          flat_(nullptr),
+                          flat_version_(kNoFlatVersion) {
+        pthread_mutex_init(&flat_mutex_, nullptr);
         for (int i = 0; i < MAX_FORWARD; i++) {
             head_->forward[i] = nullptr;
         }
@@ -334,7 +388,7 @@ private:
     void
     find_intervals(const Key &searchKey, OutputIterator out,
                    Key& right,  const Key& right_border,
-                   const uint64_t time_up) const {
+                   const uint64_t time_low, const uint64_t time_up) const {
         IntervalSLNode *x = head_;
         for (int i = maxLevel;
              i >= 0 && (x->isHeader() || KeyCompare(x->key, searchKey) != 0); i--) {
@@ -359,9 +413,10 @@ private:
 
         assert(after != nullptr);
 
-        // fetch first interval that starts at (x->key, right_border) under time_border.
+        // fetch first interval that starts at (x->key, right_border) stamped in [time_low, time_up].
         while (after->key != right_border) {
             if (after->startMarker->count != 0 &&
+                after->startMarker->get_first()->getInterval()->stamp_ >= time_low &&
                 after->startMarker->get_first()->getInterval()->stamp_ <= time_up) {
                 assert(after->startMarker->count == 1);
                 assert(after->endMarker->count == 0);
@@ -414,6 +469,14 @@ public:
 
     void PlotMountains(std::ostream& os);
 
+    // Visit every node in order by visit(key, kvs, height) under read lock.
+    // kvs estimates the number of KVs before key, half KVs of an interval
+    // are counted at each of its end points, height is the number of
+    // intervals running across the gap right before key.
+    // Return the number of KVs of all intervals.
+    template<class Visitor>
+    uint64_t Sweep(Visitor visit);
+
     inline uint64_t size() const { return iCount_; }   //number of intervals
 
     // print every nodes' information
@@ -425,25 +488,154 @@ public:
 
     inline void IncTimestamp() { timestamp_++; }
 
+    // Stamp the intervals generated from now on after timestamp at least,
+    // for intervals moved in from another list.
+    inline void AdvanceTimestamp(uint64_t timestamp) {
+        if (timestamp_ < timestamp) {
+            timestamp_ = timestamp;
+        }
+    }
+
     // Generate an interval in charge of nvm_imm_
     Interval* generate(const Key& l, const Key& r, NvmMemTable* table, uint64_t timestamp);
 
     // insert an interval into list
     void insert(const Interval* I);
 
-    // Return the tables contain this searchKey(user key). Called by point query.
+    // Insert I and return true iff I lies after every interval in list,
+    // which needs no marker of other intervals moved. Otherwise return
+    // false and leave the list untouched.
+    bool append(const Interval* I);
+
+    // Return the tables contain this searchKey(user key), newest first.
+    // Called by point query, which holds the read lock while probing them.
     // And stab the intervals include searchKey(internal key).
-    void search(const Key& searchKey, std::vector<Interval*>& intervals, int& overlaps);
+    void search(const Key& searchKey, Stab* stab) const;
 
     //Return the tables contain this searchKey(internal key). Called by DoCompactionWork.
     void search(const Key& searchKey, std::vector<Interval*>& intervals, const bool sort = false);
 
+    // Return the key of the last node before searchKey, or 0 if there is none.
+    // Called by DoCompactionWork to split a merge.
+    Key before(const Key& searchKey) const;
+
+    // Return every interval in list in order of inf.
+    // Called to move intervals over to another list.
+    void collect(std::vector<Interval*>& intervals) const;
+
     // remove an interval from list
     bool remove(const Interval* I);
 
     // stab the intervals include searchKey(internal key)
     int stab(const Key& searchKey);
 
+    // An interval dropping its last reference is retired, not destroyed
+    // by whichever thread drops it, often a reader.  handler(arg) is called
+    // when retired intervals start piling up, and whoever it wakes calls
+    // ReclaimRetired() to destroy them.  Without a handler intervals are
+    // destroyed on retirement.  With EnableFlatIndex(), handler(arg) is
+    // also called once the flat copy is stale, and whoever it wakes calls
+    // RefreshFlatIndex() as well.
+    // REQUIRES: no interval has been generated yet.
+    void SetRetireHandler(void (*handler)(void* arg), void* arg) {
+        retire_handler_ = handler;
+        retire_arg_ = arg;
+    }
+
+    // Destroy the intervals retired so far.
+    void ReclaimRetired();
+
+    // Serve point queries from a flat copy of the index: the sorted
+    // endpoints, and an implicit interval tree over their ranks laid out in
+    // a few arrays.  A stab is a binary search and a walk down the tree
+    // instead of a walk down the marker lists.  Writers record the
+    // intervals they insert and remove, and the copy is rebuilt from the
+    // last one and those changes, taking the read lock only to take the
+    // changes.  A walk down a large skip list would hold it long, and
+    // with writers preferred, stall the readers behind a waiting writer.
+    // Readers walk the skip list while the copy is stale.
+    // REQUIRES: no interval has been inserted yet.
+    void EnableFlatIndex() {
+        flat_enabled_ = true;
+    }
+
+    // Rebuild the flat copy of the index unless it is up to date.
+    // REQUIRES: lock not held.
+    void RefreshFlatIndex();
+
+    // Drop the flat copy, and the references of intervals it holds, which
+    // may retire intervals to the index they were generated by.
+    // REQUIRES: no other thread uses the index.
+    void DropFlatIndex();
+
+    // Intervals stabbed by a point query, newest first so the caller can
+    // stop at the first one answering the query.  A handful of intervals
+    // overlap any key, so they normally live inline.
+    class Stab {
+    public:
+        Stab() : data_(inline_), size_(0), capacity_(kInline), overlaps_(0) { }
+
+        ~Stab() {
+            if (data_ != inline_) {
+                delete[] data_;
+            }
+        }
+
+        inline int size() const { return size_; }
+
+        inline Interval* operator[](int i) const {
+            assert(i >= 0 && i < size_);
+            return data_[i];
+        }
+
+        // Number of intervals including the key itself, see find_intervals.
+        inline int overlaps() const { return overlaps_; }
+
+    private:
+        friend class IntervalSkipList;
+
+        enum { kInline = 16 };
+
+        // Output iterator handed to find_intervals.
+        class Inserter {
+        public:
+            explicit Inserter(Stab* stab) : stab_(stab) { }
+            Inserter& operator=(Interval* I) {
+                stab_->Add(I);
+                return *this;
+            }
+        private:
+            Stab* stab_;
+        };
+
+        void Add(Interval* I) {
+            if (size_ == capacity_) {
+                Interval** data = new Interval*[capacity_ * 2];
+                std::copy(data_, data_ + size_, data);
+                if (data_ != inline_) {
+                    delete[] data_;
+                }
+                data_ = data;
+                capacity_ *= 2;
+            }
+            data_[size_++] = I;
+        }
+
+        void Sort() {
+            std::sort(data_, data_ + size_, timeCmp);
+        }
+
+        Interval* inline_[kInline];
+        Interval** data_;
+        int size_;
+        int capacity_;
+        int overlaps_;
+
+        // No copying allowed
+        Stab(const Stab&);
+        void operator=(const Stab&);
+    };
+
     class IteratorHelper {
     public:
         explicit IteratorHelper(IntervalSkipList* const list)
@@ -486,8 +678,9 @@ public:
 
         // Used in compact iterator.
         inline void Seek(const Key& target, std::vector<Interval*>& intervals,
-                         Key& right, const Key& right_border, const uint64_t time_up) {
-            list_->find_intervals(target, std::back_inserter(intervals), right, right_border, time_up);
+                         Key& right, const Key& right_border,
+                         const uint64_t time_low, const uint64_t time_up) {
+            list_->find_intervals(target, std::back_inserter(intervals), right, right_border, time_low, time_up);
         }
 
         void ShowIndex() const {
@@ -509,12 +702,20 @@ IntervalSkipList<Key, Comparator>::IntervalSkipList(Comparator cmp)
                                   head_(new IntervalSLNode(MAX_FORWARD)),
                                   comparator_(cmp),
                                   timestamp_(1),
-                                  iCount_(0) {
+                                  iCount_(0),
+                                  retired_(nullptr),
+                                  retire_handler_(nullptr),
+                                  retire_arg_(nullptr),
+                                  flat_enabled_(false),
+                                  version_(0),
+                                  flat_(nullptr),
+                                  flat_version_(kNoFlatVersion) {
     pthread_rwlockattr_t attr;
     // write thread has priority over read thread.
     pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
     pthread_rwlock_init(&rwlock, &attr);
     pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&flat_mutex_, nullptr);
     for (int i = 0; i < MAX_FORWARD; i++) {
         head_->forward[i] = nullptr;
     }
@@ -522,6 +723,8 @@ IntervalSkipList<Key, Comparator>::IntervalSkipList(Comparator cmp)
 
 template<typename Key, class Comparator>
 IntervalSkipList<Key, Comparator>::~IntervalSkipList() {
+    DropFlatIndex();
+    ReclaimRetired();
     std::vector<Interval*> intervals;
     WriteLock();
     IntervalSLNode* cursor = head_;
@@ -542,8 +745,9 @@ IntervalSkipList<Key, Comparator>::~IntervalSkipList() {
     for (auto i : intervals) {
         i->Destroy();
     }
-    WriteUnlock();
+    pthread_rwlock_unlock(&rwlock);
     pthread_rwlock_destroy(&rwlock);
+    pthread_mutex_destroy(&flat_mutex_);
 }
 
 template<typename Key, class Comparator>
@@ -598,20 +802,134 @@ void IntervalSkipList<Key, Comparator>::PlotMountains(std::ostream& os) {
     ReadUnlock();
 }
 
+template<typename Key, class Comparator>
+template<class Visitor>
+uint64_t IntervalSkipList<Key, Comparator>::Sweep(Visitor visit) {
+    uint64_t halves = 0;    // twice the KVs before cursor
+    int height = 0;
+    ReadLock();
+    IntervalSLNode* cursor = head_->forward[0];
+    while (cursor) {
+        visit(cursor->key, halves / 2, height);
+        height += cursor->startMarker->count;
+        for (auto e = cursor->startMarker->get_first(); e != nullptr; e = e->get_next()) {
+            halves += e->getInterval()->table_->GetCount();
+        }
+        for (auto e = cursor->endMarker->get_first(); e != nullptr; e = e->get_next()) {
+            halves += e->getInterval()->table_->GetCount();
+        }
+        height -= cursor->endMarker->count;
+        cursor = cursor->forward[0];
+    }
+    ReadUnlock();
+    return halves / 2;
+}
+
 template<typename Key, class Comparator>
 typename IntervalSkipList<Key, Comparator>::
 Interval* IntervalSkipList<Key, Comparator>::generate(const Key &l, const Key &r,
                                             NvmMemTable *table, uint64_t timestamp) {
     uint64_t mark = (timestamp == 0) ? timestamp_++ : timestamp;
     // init refs_(1)
-    return new Interval(l, r, mark, table);
+    return new Interval(l, r, mark, table, this);
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::Retire(Interval* I) {
+    if (retire_handler_ == nullptr) {
+        I->table_->Destroy(false);
+        delete I;
+        return;
+    }
+    Interval* head = retired_.load(std::memory_order_relaxed);
+    do {
+        I->next_retired_ = head;
+    } while (!retired_.compare_exchange_weak(head, I, std::memory_order_release,
+                                             std::memory_order_relaxed));
+    // Only the first one wakes the reclaimer, which takes all at once.
+    if (head == nullptr) {
+        (*retire_handler_)(retire_arg_);
+    }
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::ReclaimRetired() {
+    Interval* I = retired_.exchange(nullptr, std::memory_order_acquire);
+    while (I != nullptr) {
+        Interval* next = I->next_retired_;
+        I->table_->Destroy(false);
+        delete I;
+        I = next;
+    }
 }
 
 template<typename Key, class Comparator>
 inline void IntervalSkipList<Key, Comparator>::search(const Key& searchKey,
-                                               std::vector<Interval*>& intervals, int& overlaps) {
-    find_intervals(searchKey, std::back_inserter(intervals), overlaps);
-    std::sort(intervals.begin(), intervals.end(), timeCmp);
+                                                      Stab* stab) const {
+    if (flat_version_.load(std::memory_order_acquire) == version_) {
+        flat_.load(std::memory_order_relaxed)->Search(searchKey, stab);
+    } else {
+        find_intervals(searchKey, typename Stab::Inserter(stab), stab->overlaps_);
+    }
+    stab->Sort();
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::AddFlatChange(const Interval* I, bool inserted) {
+    if (flat_enabled_) {
+        Interval* interval = const_cast<Interval*>(I);
+        if (inserted) {
+            interval->Ref();
+        }
+        flat_changes_.push_back(std::make_pair(interval, inserted));
+    }
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::RefreshFlatIndex() {
+    pthread_mutex_lock(&flat_mutex_);
+    // Only writers, held off by the read lock, touch the changes.
+    std::vector<std::pair<Interval*, bool>> changes;
+    ReadLock();
+    const uint64_t version = version_;
+    changes.swap(flat_changes_);
+    ReadUnlock();
+    if (changes.empty()) {
+        pthread_mutex_unlock(&flat_mutex_);
+        return;
+    }
+
+    // The copy replaced is no longer read: the index changed since it
+    // was made, and a reader takes a copy only while the index stays as
+    // the copy was made.
+    FlatIndex* old = flat_.load(std::memory_order_relaxed);
+    std::vector<Interval*> dropped;
+    FlatIndex* flat = new FlatIndex(this, old, changes, version, &dropped);
+    flat_.store(flat, std::memory_order_relaxed);
+    flat_version_.store(version, std::memory_order_release);
+    pthread_mutex_unlock(&flat_mutex_);
+    delete old;
+    for (auto &I : dropped) {
+        I->Unref();
+    }
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::DropFlatIndex() {
+    FlatIndex* flat = flat_.exchange(nullptr, std::memory_order_relaxed);
+    flat_version_.store(kNoFlatVersion, std::memory_order_relaxed);
+    if (flat != nullptr) {
+        for (auto &I : flat->starting_) {
+            I->Unref();
+        }
+        delete flat;
+    }
+    for (auto &change : flat_changes_) {
+        if (change.second) {
+            change.first->Unref();
+        }
+    }
+    flat_changes_.clear();
 }
 
 template<typename Key, class Comparator>
@@ -628,6 +946,26 @@ inline int IntervalSkipList<Key, Comparator>::stab(const Key &searchKey) {
     return stab_intervals(searchKey);
 }
 
+template<typename Key, class Comparator>
+Key IntervalSkipList<Key, Comparator>::before(const Key& searchKey) const {
+    IntervalSLNode* x = head_;
+    for(int i = maxLevel; i >= 0; i--) {
+        while (x->forward[i] != nullptr && KeyCompare(x->forward[i]->key, searchKey) < 0) {
+            x = x->forward[i];
+        }
+    }
+    return x->isHeader() ? 0 : x->key;
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::collect(std::vector<Interval*>& intervals) const {
+    for (IntervalSLNode* x = head_->forward[0]; x != nullptr; x = x->forward[0]) {
+        for (auto e = x->startMarker->get_first(); e != nullptr; e = e->get_next()) {
+            intervals.push_back(const_cast<Interval*>(e->getInterval()));
+        }
+    }
+}
+
 // Not used
 template<typename Key, class Comparator>
 typename IntervalSkipList<Key, Comparator>::
@@ -707,6 +1045,65 @@ void IntervalSkipList<Key, Comparator>::insert(const Interval* I) {
     // place markers on interval
     placeMarkers(left, right, I);
     iCount_++;
+    version_++;
+    AddFlatChange(I, true);
+}
+
+template<typename Key, class Comparator>
+bool IntervalSkipList<Key, Comparator>::append(const Interval* I) {
+    // update vector of the end of list.
+    IntervalSLNode* update[MAX_FORWARD];
+    IntervalSLNode* x = head_;
+    for (int i = maxLevel; i >= 0; i--) {
+        while (x->forward[i] != nullptr) {
+            x = x->forward[i];
+        }
+        update[i] = x;
+    }
+    if (x != head_ && KeyCompare(x->key, I->inf_) >= 0) {
+        return false;
+    }
+
+    // No interval runs past the last node, end points linked after it
+    // leave every marker where it is, see adjustMarkersOnInsert().
+    IntervalSLNode* left = append(I->inf_, update);
+    IntervalSLNode* right = (KeyCompare(I->inf_, I->sup_) == 0) ? left : append(I->sup_, update);
+    left->ownerCount++;
+    left->startMarker->insert(I);
+    right->ownerCount++;
+    right->endMarker->insert(I);
+
+    // place markers on interval
+    placeMarkers(left, right, I);
+    iCount_++;
+    version_++;
+    AddFlatChange(I, true);
+    return true;
+}
+
+template<typename Key, class Comparator>
+typename IntervalSkipList<Key, Comparator>::
+IntervalSLNode* IntervalSkipList<Key, Comparator>::append(const Key& searchKey,
+                                                         IntervalSLNode** update) {
+    int i;
+    int newLevel = randomLevel();
+    if (newLevel > maxLevel) {
+        for (i = maxLevel + 1; i <= newLevel; i++) {
+            update[i] = head_;
+        }
+        maxLevel = newLevel;
+    }
+    IntervalSLNode* x = new IntervalSLNode(searchKey, newLevel);
+    for (i = 0; i <= newLevel; i++) {
+        assert(update[i]->forward[i] == nullptr);
+        x->forward[i] = nullptr;
+        update[i]->forward[i] = x;
+    }
+    x->prev = update[0];
+    for (i = 0; i <= newLevel; i++) {
+        update[i] = x;
+    }
+    return x;
 }
 
 template<typename Key, class Comparator>
@@ -985,6 +1382,8 @@ bool IntervalSkipList<Key, Comparator>::remove(const Interval* I) {
         return false;
     }
     assert(left->key == I->inf_);
+    version_++;
+    AddFlatChange(I, false);
 
     deleteMarkers(left, I);
 
@@ -1191,6 +1590,268 @@ int IntervalSkipList<Key, Comparator>::randomLevel() {
 
 
 
+// class FlatIndex
+template<typename Key, class Comparator>
+class IntervalSkipList<Key, Comparator>::FlatIndex {
+public:
+    // Copy old, or an empty index if null, as changed by changes, which
+    // make list of version.  The copy takes over the references of old and
+    // those of the insertions, and stores in *dropped those it no longer
+    // holds.  The endpoints compared are those of intervals referenced,
+    // so list need not be locked.
+    FlatIndex(const IntervalSkipList* list, const FlatIndex* old,
+              const std::vector<std::pair<Interval*, bool>>& changes, uint64_t version,
+              std::vector<Interval*>* dropped);
+
+    // Same as find_intervals(searchKey, out, overlaps), but unordered.
+    void Search(const Key& searchKey, Stab* stab) const;
+
+    const uint64_t version_;  // version_ of the list copied
+
+private:
+    friend class IntervalSkipList;
+
+    const IntervalSkipList* const list_;
+
+    // Endpoints of intervals in ascending order.  A key is placed at
+    // position 2i+2 if it equals keys_[i], at 2i+1 if it falls in the gap
+    // before keys_[i], so an interval is a range of positions.
+    std::vector<Key> keys_;
+
+    // Implicit interval tree over positions 1..2^height_-1 in in-order
+    // layout: position c is a node of depth height_-1-ctz(c), whose subtree
+    // spans c-2^ctz(c)+1..c+2^ctz(c)-1.  An interval is kept by the highest
+    // node within its range, the ancestors of a position keep every
+    // interval covering it.  by_lo_[nodes_[c], nodes_[c+1]) are those kept
+    // by c sorted by ascending low end, by_hi_ the same by descending high end.
+    int height_;
+    std::vector<uint32_t> nodes_;
+    std::vector<std::pair<uint32_t, Interval*>> by_lo_;
+    std::vector<std::pair<uint32_t, Interval*>> by_hi_;
+
+    // starting_[starts_[i], starts_[i+1]) are the intervals starting at keys_[i].
+    std::vector<uint32_t> starts_;
+    std::vector<Interval*> starting_;
+
+    // ending_[ends_[i], ends_[i+1]) are those ending at keys_[i].
+    std::vector<uint32_t> ends_;
+    std::vector<Interval*> ending_;
+
+    // Lay out the tree over the endpoints.
+    void Build();
+
+    // Node keeping the intervals over positions [lo, hi].
+    static inline uint32_t Owner(uint32_t lo, uint32_t hi) {
+        if (lo == hi) {
+            return lo;
+        }
+        // highest bit lo and hi differ in
+        const int b = 31 - __builtin_clz(lo ^ hi);
+        return (lo & ((2u << b) - 1)) == 0 ? lo : (hi >> b) << b;
+    }
+
+    // No copying allowed
+    FlatIndex(const FlatIndex&);
+    void operator=(const FlatIndex&);
+};
+
+template<typename Key, class Comparator>
+IntervalSkipList<Key, Comparator>::
+FlatIndex::FlatIndex(const IntervalSkipList* list, const FlatIndex* old,
+                     const std::vector<std::pair<Interval*, bool>>& changes, uint64_t version,
+                     std::vector<Interval*>* dropped)
+        : version_(version), list_(list), height_(1) {
+    // An interval removed drops the reference of the copy or of its
+    // insertion, and is gone if it was removed more often than inserted.
+    std::unordered_map<const Interval*, int> net;
+    for (auto &change : changes) {
+        if (change.second) {
+            net[change.first]++;
+        } else {
+            net[change.first]--;
+            dropped->push_back(change.first);
+        }
+    }
+    struct Endpoint {
+        Key key;
+        Interval* I;
+        bool start;
+    };
+    std::vector<Endpoint> added;
+    bool removed = false;
+    for (auto &interval : net) {
+        Interval* I = const_cast<Interval*>(interval.first);
+        if (interval.second > 0) {
+            added.push_back(Endpoint{I->inf(), I, true});
+            added.push_back(Endpoint{I->sup(), I, false});
+        } else if (interval.second < 0) {
+            removed = true;
+        }
+    }
+    std::sort(added.begin(), added.end(), [list](const Endpoint& a, const Endpoint& b) {
+        return list->KeyCompare(a.key, b.key) < 0;
+    });
+    auto kept = [&net, removed](Interval* I) {
+        if (!removed) {
+            return true;
+        }
+        auto it = net.find(I);
+        return it == net.end() || it->second >= 0;
+    };
+
+    // Merge the endpoints of old still in the index with those added,
+    // endpoints with the same key share a position.  Where an endpoint
+    // added goes is found by a binary search, the keys of old are not
+    // compared one by one.
+    const size_t n = (old != nullptr) ? old->keys_.size() : 0;
+    std::vector<size_t> at(added.size());   // first position of old not below
+    std::vector<bool> same(added.size());   // if the key there is the same
+    for (size_t j = 0; j < added.size(); j++) {
+        at[j] = (old == nullptr) ? 0 :
+                std::lower_bound(old->keys_.begin(), old->keys_.end(), added[j].key,
+                                 [list](const Key& k, const Key& key) {
+                                     return list->KeyCompare(k, key) < 0;
+                                 }) - old->keys_.begin();
+        same[j] = at[j] < n && list->KeyCompare(old->keys_[at[j]], added[j].key) == 0;
+    }
+    keys_.reserve(n + added.size());
+    starts_.reserve(n + added.size() + 1);
+    ends_.reserve(n + added.size() + 1);
+    starts_.push_back(0);
+    ends_.push_back(0);
+    auto place = [this](const Key& key) {
+        if (starting_.size() > starts_.back() || ending_.size() > ends_.back()) {
+            keys_.push_back(key);
+            starts_.push_back(static_cast<uint32_t>(starting_.size()));
+            ends_.push_back(static_cast<uint32_t>(ending_.size()));
+        }
+    };
+    size_t j = 0;
+    for (size_t i = 0; i <= n; i++) {
+        // those added below the endpoint i of old
+        while (j < added.size() && at[j] == i && !same[j]) {
+            const Key key = added[j].key;
+            for (; j < added.size() && at[j] == i && !same[j] && list->KeyCompare(added[j].key, key) == 0; j++) {
+                (added[j].start ? starting_ : ending_).push_back(added[j].I);
+            }
+            place(key);
+        }
+        if (i == n) {
+            break;
+        }
+        for (uint32_t k = old->starts_[i]; k < old->starts_[i + 1]; k++) {
+            if (kept(old->starting_[k])) starting_.push_back(old->starting_[k]);
+        }
+        for (uint32_t k = old->ends_[i]; k < old->ends_[i + 1]; k++) {
+            if (kept(old->ending_[k])) ending_.push_back(old->ending_[k]);
+        }
+        for (; j < added.size() && at[j] == i && same[j]; j++) {
+            (added[j].start ? starting_ : ending_).push_back(added[j].I);
+        }
+        place(old->keys_[i]);
+    }
+    assert(j == added.size());
+    Build();
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::
+FlatIndex::Build() {
+    // Rank the endpoints, and the intervals by them.
+    struct Span {
+        Interval* I;
+        uint32_t lo, hi;
+    };
+    std::vector<Span> spans;
+    spans.reserve(starting_.size());
+    std::unordered_map<const Interval*, size_t> open;
+    for (size_t i = 0; i < keys_.size(); i++) {
+        const uint32_t pos = 2 * static_cast<uint32_t>(i) + 2;
+        for (uint32_t k = starts_[i]; k < starts_[i + 1]; k++) {
+            open[starting_[k]] = spans.size();
+            spans.push_back(Span{starting_[k], pos, pos});
+        }
+        for (uint32_t k = ends_[i]; k < ends_[i + 1]; k++) {
+            auto it = open.find(ending_[k]);
+            assert(it != open.end());
+            spans[it->second].hi = pos;
+            open.erase(it);
+        }
+    }
+    assert(open.empty());
+
+    // Positions run up to 2*keys_.size()+1.
+    while ((1u << height_) - 1 < 2 * keys_.size() + 1) {
+        height_++;
+    }
+    nodes_.assign((1u << height_) + 1, 0);
+    for (auto& span : spans) {
+        nodes_[Owner(span.lo, span.hi) + 1]++;
+    }
+    for (size_t c = 1; c < nodes_.size(); c++) {
+        nodes_[c] += nodes_[c - 1];
+    }
+    by_lo_.resize(spans.size());
+    by_hi_.resize(spans.size());
+    std::vector<uint32_t> fill(nodes_.begin(), nodes_.end() - 1);
+    for (auto& span : spans) {
+        const uint32_t k = fill[Owner(span.lo, span.hi)]++;
+        by_lo_[k] = std::make_pair(span.lo, span.I);
+        by_hi_[k] = std::make_pair(span.hi, span.I);
+    }
+    for (size_t c = 1; c + 1 < nodes_.size(); c++) {
+        if (nodes_[c + 1] - nodes_[c] > 1) {
+            std::sort(by_lo_.begin() + nodes_[c], by_lo_.begin() + nodes_[c + 1],
+                      [](const std::pair<uint32_t, Interval*>& a, const std::pair<uint32_t, Interval*>& b) {
+                          return a.first < b.first;
+                      });
+            std::sort(by_hi_.begin() + nodes_[c], by_hi_.begin() + nodes_[c + 1],
+                      [](const std::pair<uint32_t, Interval*>& a, const std::pair<uint32_t, Interval*>& b) {
+                          return a.first > b.first;
+                      });
+        }
+    }
+}
+
+template<typename Key, class Comparator>
+void IntervalSkipList<Key, Comparator>::
+FlatIndex::Search(const Key& searchKey, Stab* stab) const {
+    // first endpoint after searchKey
+    const size_t i = std::upper_bound(keys_.begin(), keys_.end(), searchKey,
+                                      [this](const Key& a, const Key& b) {
+                                          return list_->KeyCompare(a, b) < 0;
+                                      }) - keys_.begin();
+    const uint32_t pos = (i > 0 && list_->KeyCompare(keys_[i - 1], searchKey) == 0) ?
+                         2 * static_cast<uint32_t>(i) : 2 * static_cast<uint32_t>(i) + 1;
+    const int low = __builtin_ctz(pos);
+    for (int t = height_ - 1; t >= low; t--) {
+        const uint32_t c = ((pos >> t >> 1) << t << 1) | (1u << t);
+        uint32_t k = nodes_[c];
+        const uint32_t end = nodes_[c + 1];
+        if (pos < c) {
+            for (; k < end && by_lo_[k].first <= pos; k++) {
+                stab->Add(by_lo_[k].second);
+            }
+        } else if (pos > c) {
+            for (; k < end && by_hi_[k].first >= pos; k++) {
+                stab->Add(by_hi_[k].second);
+            }
+        } else {
+            for (; k < end; k++) {
+                stab->Add(by_lo_[k].second);
+            }
+        }
+    }
+    stab->overlaps_ = stab->size();
+    // Do not miss any intervals that has the same user key as searchKey
+    if (i < keys_.size() && list_->KeyCompare(keys_[i], searchKey, true) == 0) {
+        for (uint32_t k = starts_[i]; k < starts_[i + 1]; k++) {
+            stab->Add(starting_[k]);
+        }
+    }
+}
+
+
 // class IntervalSLNode
 template<typename Key, class Comparator>
 class IntervalSkipList<Key, Comparator>::IntervalSLNode {
@@ -1344,6 +2005,8 @@ private:
     const uint64_t stamp_;  // fresh intervals have greater timestamp
     NvmMemTable* const table_;
     std::atomic<int> refs_;
+    IntervalSkipList* const list_;
+    Interval* next_retired_;
 
     Interval(const Interval&);
     Interval operator=(const Interval);
@@ -1352,7 +2015,8 @@ private:
 
     // Only index can generate Interval.
     explicit Interval(const Key& inf, const Key& sup,
-                      uint64_t stamp, NvmMemTable* const table);
+                      uint64_t stamp, NvmMemTable* const table,
+                      IntervalSkipList* list);
 
 public:
 
@@ -1370,11 +2034,11 @@ public:
     void Ref() { refs_++; }
 
     void Unref() {
-        refs_--;
-        assert(refs_ >= 0);
-        if (refs_ == 0) {
-            table_->Destroy(false);
-            delete this;
+        // decrement and test at once, or two threads may both see 0.
+        const int refs = --refs_;
+        assert(refs >= 0);
+        if (refs == 0) {
+            list_->Retire(this);
         }
     }
 
@@ -1392,8 +2056,10 @@ IntervalSkipList<Key, Comparator>::
 Interval::Interval(const Key& inf,
                    const Key& sup,
                    const uint64_t stamp,
-                   NvmMemTable* const table)
-                  : inf_(inf), sup_(sup), stamp_(stamp), table_(table), refs_(1) {
+                   NvmMemTable* const table,
+                   IntervalSkipList* list)
+                  : inf_(inf), sup_(sup), stamp_(stamp), table_(table), refs_(1),
+                    list_(list), next_retired_(nullptr) {
     assert(table_ != nullptr);
 }
 
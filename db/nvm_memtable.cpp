@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include "nvm_memtable.h"
+#include "softdb/comparator.h"
 //#include <vector>
 
 
@@ -20,17 +21,32 @@ static uint32_t GetRawLength(const char* data) {
 }
 
 // If num = 0, it's caller's duty to delete it.
-NvmMemTable::NvmMemTable(const InternalKeyComparator& cmp, const int cap, const bool assist)
+NvmMemTable::NvmMemTable(const InternalKeyComparator& cmp, const int cap, const Options& options)
            : comparator_(cmp),
              capacity_(cap),
+             slab_records_(options.run_in_dram),
              table_(comparator_, capacity_),
-             hash_((assist) ? new Hash(capacity_) : nullptr),
-             filter_((assist) ? nullptr : new Filter(capacity_)) {
+             hash_((options.use_cuckoo) ? new Hash(capacity_) : nullptr),
+             filter_((options.use_cuckoo) ? nullptr :
+                     NewNvmFilter(options.filter_type, options.filter_bits, capacity_)),
+             prefix_extractor_(options.prefix_extractor),
+             // the number of prefixes is unknown until Transport, xor filter fits best.
+             prefix_filter_((options.prefix_extractor) ?
+                            NewNvmFilter(kXorFilter, options.filter_bits, capacity_) : nullptr),
+             range_filter_((options.use_range_filter &&
+                            cmp.user_comparator() == BytewiseComparator()) ?
+                           new NvmRangeFilter() : nullptr) {
 
 }
 
 const uint64_t NvmMemTable::SizeInBytes() const {
     uint64_t assist_size = (hash_) ? hash_->SizeInBytes() : filter_->SizeInBytes();
+    if (prefix_filter_ != nullptr) {
+        assist_size += prefix_filter_->SizeInBytes();
+    }
+    if (range_filter_ != nullptr) {
+        assist_size += range_filter_->SizeInBytes();
+    }
     uint64_t table_size = table_.SizeInBytes();
     return assist_size + table_size;
 }
@@ -38,14 +54,36 @@ const uint64_t NvmMemTable::SizeInBytes() const {
 void NvmMemTable::Destroy(const bool DataDelete) {
     delete hash_;
     delete filter_;
+    delete prefix_filter_;
+    delete range_filter_;
     NvmMemTable::Table::Iterator iter_ = NvmMemTable::Table::Iterator(&table_);
     iter_.SeekToFirst();
+    // Records of a table mostly come from a few arenas in runs,
+    // drop the references of a run at once.
+    Arena* owner = nullptr;
+    int refs = 0;
     while (iter_.Valid()) {
         if (DataDelete || iter_.KeyIsObsolete()) {
-            delete[] iter_.key();
+            if (!slab_records_) {
+                delete[] iter_.key();
+            } else {
+                Arena* arena = Arena::Owner(iter_.key());
+                if (arena != owner) {
+                    if (owner != nullptr) {
+                        owner->ReleaseRecords(refs);
+                    }
+                    owner = arena;
+                    refs = 0;
+                }
+                Arena::ReleaseBlock(iter_.key());
+                refs++;
+            }
         }
         iter_.Next();
     }
+    if (owner != nullptr) {
+        owner->ReleaseRecords(refs);
+    }
     delete this;
 }
 
@@ -81,6 +119,14 @@ public:
     virtual void SeekToLast() { iter_.SeekToLast(); }
     virtual void Next() { iter_.Next(); }
     virtual void Prev() { iter_.Prev(); }
+    virtual int NextBatch(Slice* keys, Slice* values, int n) {
+        return NextEncodedBatch(&iter_, keys, values, n, nullptr, nullptr, false);
+    }
+    virtual int NextBatchUntil(Slice* keys, Slice* values, int n,
+                               const Comparator* cmp, const Slice& limit,
+                               bool inclusive) {
+        return NextEncodedBatch(&iter_, keys, values, n, cmp, &limit, inclusive);
+    }
     virtual Slice key() const { return GetLengthPrefixedSlice(iter_.key()); }
     virtual Slice value() const {
         Slice key_slice = GetLengthPrefixedSlice(iter_.key());
@@ -109,8 +155,13 @@ Iterator* NvmMemTable::NewIterator() {
 
 // REQUIRES: iter is valid.
 // Once called, never again.
-void NvmMemTable::Transport(Iterator* iter, bool compact) {
+Status NvmMemTable::Transport(Iterator* iter, bool compact, Arena* arena) {
     assert(iter->Valid());
+    assert(arena == nullptr || slab_records_);
+    // Copies go to a slab of this table's own, made on the first copy.
+    Arena* slab = nullptr;
+    int copied = 0;
+    Status s;
     // pos from 1 to num_
     uint32_t pos = 0;
     Table::Worker ins = Table::Worker(&table_);
@@ -118,6 +169,8 @@ void NvmMemTable::Transport(Iterator* iter, bool compact) {
     //get the first user key
     Slice last_user_key = ExtractUserKey(iter->key());
     Slice tmp;
+    Slice last_prefix;
+    bool has_prefix = false;
     const char* raw;
     char* buf;
     //const char* b1 = nullptr;
@@ -128,19 +181,27 @@ void NvmMemTable::Transport(Iterator* iter, bool compact) {
         //if (b1 != nullptr) {
         //    assert(comparator_(b2, b1) > 0);
         //}
-        if (hash_ != nullptr) {
-            pos++;
-            tmp = ExtractUserKey(iter->key());
-            if (pos == 1 || comparator_.comparator.user_comparator()->Compare(tmp, last_user_key) != 0) {
+        pos++;
+        tmp = ExtractUserKey(iter->key());
+        if (pos == 1 || comparator_.comparator.user_comparator()->Compare(tmp, last_user_key) != 0) {
+            if (hash_ != nullptr) {
                 hash_->Add(tmp, pos);
-                last_user_key = tmp;
-            }
-        } else {
-            tmp = ExtractUserKey(iter->key());
-            if (pos == 1 || comparator_.comparator.user_comparator()->Compare(tmp, last_user_key) != 0) {
+            } else {
                 filter_->Add(tmp);
-                last_user_key = tmp;
             }
+            // keys sharing a prefix are adjacent, add each prefix once.
+            if (prefix_filter_ != nullptr && prefix_extractor_->InDomain(tmp)) {
+                Slice prefix = prefix_extractor_->Transform(tmp);
+                if (!has_prefix || prefix != last_prefix) {
+                    prefix_filter_->Add(prefix);
+                    last_prefix = prefix;
+                    has_prefix = true;
+                }
+            }
+            if (range_filter_ != nullptr) {
+                range_filter_->Add(tmp);
+            }
+            last_user_key = tmp;
         }
 
         // Raw data from imm_ or nvm_imm_
@@ -150,16 +211,63 @@ void NvmMemTable::Transport(Iterator* iter, bool compact) {
         // Delete obsolete data and rebuild nvm_imm_ index frequently
         // will reduce space amplification at the negligible cost of write wearing.
         // Read amplification normally doesn't reach the max_overlaps set.
-        if (compact) {
+        // Moving the live records out of a mostly dead slab frees it,
+        // the originals are released with the tables compacted.
+        if ((compact && !(slab_records_ &&
+                          Arena::Owner(raw)->MostlyDead(config::kSlabDeadRatio) &&
+                          iter->Movable())) ||
+            arena != nullptr) {
             buf = const_cast<char*>(raw);
+            if (arena != nullptr) {
+                Arena::HoldBlock(buf);
+            }
         } else {
             uint32_t len = GetRawLength(raw);
-            buf = new char[len];
-            memcpy(buf, raw, len);
+            if (slab_records_) {
+                if (slab == nullptr) {
+                    slab = new Arena(true);
+                }
+                buf = slab->Allocate(len);
+            } else {
+                buf = new char[len];
+            }
+            if (buf != nullptr) {
+                memcpy(buf, raw, len);
+                if (slab_records_) {
+                    Arena::HoldBlock(buf);
+                    copied++;
+                }
+                if (compact) {
+                    iter->Abandon();
+                }
+            } else if (compact) {
+                buf = const_cast<char*>(raw);
+            } else {
+                s = Status::IOError("out of memory for nvm records");
+                break;
+            }
         }
         not_full = ins.Insert(buf);
         iter->Next();
     }
+    // Every record taken holds a reference to its arena.
+    if (arena != nullptr) {
+        arena->TakeRecords(static_cast<int>(pos));
+    }
+    if (slab != nullptr) {
+        slab->TakeRecords(copied);
+        slab->Unref();
+    }
+    if (filter_ != nullptr) {
+        filter_->Finish();
+    }
+    if (prefix_filter_ != nullptr) {
+        prefix_filter_->Finish();
+    }
+    if (range_filter_ != nullptr) {
+        range_filter_->Finish();
+    }
+    return s;
 }
 
 // REQUIRES: Use cuckoo hash to assist search.
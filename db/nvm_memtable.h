@@ -9,8 +9,10 @@
 #include "nvm_skiplist.h"
 #include "nvm_array.h"
 #include "softdb/iterator.h"
+#include "softdb/slice_transform.h"
+#include "nvm_filter.h"
+#include "util/arena.h"
 #include "util/hashtable.h"
-#include "util/cuckoofilter.h"
 
 namespace softdb {
 
@@ -20,8 +22,8 @@ class NvmMemTableIterator;
 class NvmMemTable {
 public:
 
-    // Whether use cuckoo hash to assist, it's an option.
-    explicit NvmMemTable(const InternalKeyComparator& comparator, int num, bool assist);
+    // Whether use cuckoo hash to assist or which filter to use, it's an option.
+    explicit NvmMemTable(const InternalKeyComparator& comparator, int num, const Options& options);
 
     // Return an iterator that yields the contents of the nvm_imm_.
     //
@@ -31,8 +33,15 @@ public:
     // db/format.{h,cc} module.
     Iterator* NewIterator();
 
-    // iter is constructed from imm_ or some nvm_imm_s
-    void Transport(Iterator* iter, bool compact);
+    // iter is constructed from imm_ or some nvm_imm_s.
+    // Records are copied unless compact (taken from other nvm tables) or
+    // arena is non-null (allocated from arena, which gets a reference per
+    // record taken).  With Options::run_in_dram records are kept in slabs,
+    // shared Arenas released record by record through Arena::Owner(): copies
+    // go to a slab of this table, and so do the records taken from slabs
+    // that are mostly dead, abandoning the originals.  If a slab is out of
+    // memory, records taken stay where they are, and a copy fails the rest.
+    Status Transport(Iterator* iter, bool compact, Arena* arena = nullptr);
 
     inline int GetCount() const { return table_.GetCount(); }
 
@@ -44,6 +53,18 @@ public:
     // Else, return false.
     bool Get(const LookupKey& key, std::string* value, Status* s, const char*& HotKey);
 
+    // Return false iff no user key in nvm_imm_ has the prefix,
+    // prefix is extracted by Options::prefix_extractor.
+    bool PrefixMayMatch(const Slice& prefix) const {
+        return prefix_filter_ == nullptr || prefix_filter_->Contain(prefix);
+    }
+
+    // Return false iff no user key k in nvm_imm_ with start <= k < *limit,
+    // limit == nullptr means no upper limit.
+    bool RangeMayMatch(const Slice& start, const Slice* limit) const {
+        return range_filter_ == nullptr || range_filter_->RangeMayMatch(start, limit);
+    }
+
     //  set true when run in dram to release memory allocated for key-value pairs.
     void Destroy(const bool DataDelete = false);
 
@@ -70,15 +91,19 @@ private:
     // Maybe a better hash function matters.
     typedef CuckooHash::HashTable<32, 64> Hash;
 
-    typedef CuckooHash::CuckooFilter<32> Filter;
-
     KeyComparator comparator_;
 
     const int capacity_;
+    const bool slab_records_;   // records are allocated from shared arenas
     Table table_;
     Hash* hash_;
 
-    Filter* filter_;
+    NvmFilter* filter_;
+
+    const SliceTransform* const prefix_extractor_;
+    NvmFilter* prefix_filter_;  // nullptr if no prefix_extractor_
+
+    NvmRangeFilter* range_filter_;
 
     // No copying allowed
     NvmMemTable(const NvmMemTable&);
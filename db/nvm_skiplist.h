@@ -7,6 +7,7 @@
 #define SOFTDB_NVM_SKIPLIST_H
 
 #include <assert.h>
+#include "port/port.h"
 #include "softdb/iterator.h"
 #include "util/random.h"
 
@@ -110,6 +111,10 @@ public:
 private:
     enum { kMaxHeight = 12 };
 
+    // Nodes are adjacent in nodes_ but the keys they point to are not,
+    // a sequential scan asks for the key this many nodes ahead.
+    enum { kPrefetchDistance = 8 };
+
     // Immutable after construction
     Comparator const compare_;
 
@@ -217,12 +222,18 @@ template<typename Key, class Comparator>
 inline void NvmSkipList<Key,Comparator>::Iterator::Next() {
     assert(Valid());
     node_++;
+    if (list_->tail_ - node_ > kPrefetchDistance) {
+        port::Prefetch(node_[kPrefetchDistance].key);
+    }
 }
 
 template<typename Key, class Comparator>
 inline void NvmSkipList<Key,Comparator>::Iterator::Prev() {
     assert(Valid());
     node_--;
+    if (node_ - list_->head_ > kPrefetchDistance) {
+        port::Prefetch(node_[-kPrefetchDistance].key);
+    }
 }
 
 template<typename Key, class Comparator>
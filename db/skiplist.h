@@ -49,9 +49,10 @@ public:
     // must remain allocated for the lifetime of the skiplist object.
     explicit SkipList(Comparator cmp, Arena* arena);
 
-    // Insert key into the list.
+    // Insert key into the list.  Return false, leaving the list as it was,
+    // if the arena is out of memory.
     // REQUIRES: nothing that compares equal to key is currently in the list.
-    void Insert(const Key& key);
+    bool Insert(const Key& key);
 
     // Returns true iff an entry that compares equal to key is in the list.
     bool Contains(const Key& key) const;
@@ -184,6 +185,9 @@ typename SkipList<Key,Comparator>::Node*
 SkipList<Key,Comparator>::NewNode(const Key& key, int height) {
     char* mem = arena_->AllocateAligned(
             sizeof(Node) + sizeof(port::AtomicPointer) * (height - 1));
+    if (mem == nullptr) {
+        return nullptr;
+    }
     return new (mem) Node(key);
 }
 
@@ -340,7 +344,7 @@ SkipList<Key,Comparator>::SkipList(Comparator cmp, Arena* arena)
 }
 
 template<typename Key, class Comparator>
-void SkipList<Key,Comparator>::Insert(const Key& key) {
+bool SkipList<Key,Comparator>::Insert(const Key& key) {
     // TODO(opt): We can use a barrier-free variant of FindGreaterOrEqual()
     // here since Insert() is externally synchronized.
     Node* prev[kMaxHeight];
@@ -350,6 +354,10 @@ void SkipList<Key,Comparator>::Insert(const Key& key) {
     assert(x == nullptr || !Equal(key, x->key));
 
     int height = RandomHeight();
+    x = NewNode(key, height);
+    if (x == nullptr) {
+        return false;
+    }
     if (height > GetMaxHeight()) {
         for (int i = GetMaxHeight(); i < height; i++) {
             prev[i] = head_;
@@ -366,13 +374,13 @@ void SkipList<Key,Comparator>::Insert(const Key& key) {
         max_height_.NoBarrier_Store(reinterpret_cast<void*>(height));
     }
 
-    x = NewNode(key, height);
     for (int i = 0; i < height; i++) {
         // NoBarrier_SetNext() suffices since we will add a barrier when
         // we publish a pointer to "x" in prev[i].
         x->NoBarrier_SetNext(i, prev[i]->NoBarrier_Next(i));
         prev[i]->SetNext(i, x);
     }
+    return true;
 }
 
 template<typename Key, class Comparator>
@@ -2,10 +2,14 @@
 // Created by lingo on 19-1-17.
 //
 
+#include <algorithm>
 #include <iostream>
 #include "version_set.h"
+#include "softdb/merge_policy.h"
+#include <thread>
 #include <unordered_set>
 #include <util/mutexlock.h>
+#include "util/hashutil.h"
 
 //#define compact_debug
 //#define mem_dump_debug
@@ -26,8 +30,73 @@ void VersionSet::MarkFileNumberUsed(uint64_t number) {
     }
 }
 
+namespace {
+
+// Marks the local_map_ of a thread reading with the map it held.
+char map_in_use;
+void* const kMapInUse = &map_in_use;
+
+}  // namespace
+
+// Repartition() takes maps back from the threads before it drops the
+// reference of map_, so a cached one is never the last.
+void VersionSet::ReleaseCachedMap(void* ptr) {
+    if (ptr != kMapInUse) {
+        const int refs = static_cast<const PartitionMap*>(ptr)->refs.fetch_sub(
+                1, std::memory_order_acq_rel);
+        assert(refs > 1);
+        (void)refs;
+    }
+}
+
+// A merge is split across no more threads than there are CPUs, with a
+// single CPU the threads would only take it from the writers.
+static int SubCompactions(const Options* options) {
+    const int cpus = static_cast<int>(std::thread::hardware_concurrency());
+    const int n = std::max(options->max_subcompactions, 1);
+    return cpus > 0 ? std::min(n, cpus) : n;
+}
+
 VersionSet::~VersionSet(){
-    assert(writes_ - drops_ == index_.CountKVs());
+    sub_mutex_.Lock();
+    sub_shutdown_ = true;
+    sub_cv_.SignalAll();
+    while (sub_workers_ > 0) {
+        sub_cv_.Wait();
+    }
+    sub_mutex_.Unlock();
+    reclaim_mutex_.Lock();
+    reclaim_shutdown_ = true;
+    reclaim_cv_.SignalAll();
+    while (reclaimer_running_) {
+        reclaim_cv_.Wait();
+    }
+    reclaim_mutex_.Unlock();
+    // An interval moved by Repartition() retires to the index it was
+    // generated by, all of them are left once the flat copies are dropped.
+    for (auto &index : parts_) {
+        index->DropFlatIndex();
+    }
+    // parts_ destroy the intervals the reclaimer has left.
+    uint64_t kvs = 0;
+    for (auto &index : parts_) {
+        kvs += index->CountKVs();
+    }
+    assert(writes_ - drops_ == kvs);
+    (void)kvs;
+    for (auto &index : parts_) {
+        delete index;
+    }
+    // No thread reads any more, nor is a map held by an iterator.
+    std::vector<void*> cached;
+    local_map_.Scrape(&cached, nullptr);
+    for (auto &map : cached) {
+        UnrefMap(static_cast<const PartitionMap*>(map));
+    }
+    UnrefMap(map_.load(std::memory_order_relaxed));
+    for (auto &map : retired_maps_) {
+        delete map;
+    }
     //std::cout << "Intervals(/KVs): "<< index_.SizeInBytes() << " Bytes" << std::endl;
 }
 
@@ -38,6 +107,7 @@ VersionSet::VersionSet(const std::string& dbname,
                        port::Mutex& mu,
                        port::AtomicPointer& shutdown,
                        SnapshotList& snapshots,
+                       port::Mutex& snapshots_mu,
                        Status& bg_error,
                        bool& nvm_compaction_scheduled,
                        port::CondVar& nvm_signal)
@@ -45,6 +115,7 @@ VersionSet::VersionSet(const std::string& dbname,
           mutex_(mu),
           shutting_down_(shutdown),
           snapshots_(snapshots),
+          snapshots_mutex_(snapshots_mu),
           bg_error_(bg_error),
           dbname_(dbname),
           options_(options),
@@ -59,18 +130,93 @@ VersionSet::VersionSet(const std::string& dbname,
           peak_height_(0),
           merges_(0),
           merge_latency_(0),
+          merged_(0),
+          merge_runs_(0),
+          gets_(0),
+          probes_(0),
           log_number_(0),
           prev_log_number_(0),
           nvm_compaction_scheduled_(nvm_compaction_scheduled),
+          hot_overlaps_(0),
+          rejected_overlaps_(0),
+          merge_writes_(0),
+          merge_entries_(0),
           nvm_signal(nvm_signal),
+          reclaim_cv_(&reclaim_mutex_),
+          reclaim_pending_(false),
+          reclaim_shutdown_(false),
+          reclaimer_running_(true),
+          subcompactions_(SubCompactions(options)),
+          sub_cv_(&sub_mutex_),
+          sub_workers_(subcompactions_ - 1),
+          sub_shutdown_(false),
           index_cmp_(*cmp),
-          index_(index_cmp_)
+          map_(nullptr),
+          local_map_(ReleaseCachedMap),
+          repartition_entries_(0),
+          repartition_pending_(false)
           //descriptor_file_(nullptr),
           //descriptor_log_(nullptr),
           //dummy_versions_(this),
           //current_(nullptr) {
     //AppendVersion(new Version(this));
-{   }
+{
+    for (int i = 0; i < std::max(options_->index_partitions, 1); i++) {
+        Index* index = new Index(index_cmp_);
+        index->SetRetireHandler(&VersionSet::WakeReclaimer, this);
+        if (options_->flat_index) {
+            index->EnableFlatIndex();
+        }
+        parts_.push_back(index);
+    }
+    PartitionMap* map = new PartitionMap;
+    map->parts.push_back(parts_[0]);
+    map_.store(map, std::memory_order_release);
+    part_entries_.push_back(0);
+    env_->StartThread(&VersionSet::ReclaimWork, this);
+    for (int i = 0; i < sub_workers_; i++) {
+        env_->StartThread(&VersionSet::SubCompactionWork, this);
+    }
+}
+
+void VersionSet::WakeReclaimer(void* vs) {
+    VersionSet* v = reinterpret_cast<VersionSet*>(vs);
+    MutexLock l(&v->reclaim_mutex_);
+    v->reclaim_pending_ = true;
+    v->reclaim_cv_.SignalAll();
+}
+
+void VersionSet::ReclaimWork(void* vs) {
+    reinterpret_cast<VersionSet*>(vs)->ReclaimLoop();
+}
+
+void VersionSet::ReclaimLoop() {
+    MutexLock l(&reclaim_mutex_);
+    while (true) {
+        while (!reclaim_pending_ && !reclaim_shutdown_) {
+            reclaim_cv_.Wait();
+        }
+        if (!reclaim_pending_) {
+            break;
+        }
+        reclaim_pending_ = false;
+        std::vector<const PartitionMap*> maps;
+        maps.swap(retired_maps_);
+        reclaim_mutex_.Unlock();
+        for (auto &map : maps) {
+            delete map;
+        }
+        for (auto &index : parts_) {
+            index->ReclaimRetired();
+            if (options_->flat_index) {
+                index->RefreshFlatIndex();
+            }
+        }
+        reclaim_mutex_.Lock();
+    }
+    reclaimer_running_ = false;
+    reclaim_cv_.SignalAll();
+}
 
 
 // Compare internal key or user key.
@@ -83,38 +229,449 @@ inline int VersionSet::KeyComparator::operator()(const char *aptr, const char *b
             comparator.Compare(akey, bkey);
 }
 
-Status VersionSet::BuildTable(Iterator *iter, const int count) {
+uint64_t VersionSet::NextTimestamp() const {
+    uint64_t timestamp = 0;
+    for (auto &index : parts_) {
+        timestamp = std::max(timestamp, index->NextTimestamp());
+    }
+    return timestamp;
+}
+
+int VersionSet::PartitionOf(const PartitionMap* map, const Slice& user_key) const {
+    if (map->splits.empty()) {
+        return 0;
+    }
+    const Comparator* ucmp = icmp_.user_comparator();
+    return static_cast<int>(std::upper_bound(map->splits.begin(), map->splits.end(), user_key,
+                                             [ucmp](const Slice& a, const std::string& b) {
+                                                 return ucmp->Compare(a, Slice(b)) < 0;
+                                             }) - map->splits.begin());
+}
+
+const VersionSet::PartitionMap* VersionSet::GetMap() {
+    const PartitionMap* map = static_cast<const PartitionMap*>(local_map_.Swap(kMapInUse));
+    assert(map != kMapInUse);
+    // A map cached is referenced, no other map has its address.
+    if (map == nullptr || map != map_.load(std::memory_order_acquire)) {
+        if (map != nullptr) UnrefMap(map);
+        map = RefMap();
+    }
+    return map;
+}
 
-    Status s = Status::OK();
+void VersionSet::ReturnMap(const PartitionMap* map) {
+    void* expected = kMapInUse;
+    if (!local_map_.CompareAndSwap(const_cast<PartitionMap*>(map), expected)) {
+        // Scraped by Repartition() meanwhile.
+        assert(expected == nullptr);
+        UnrefMap(map);
+    }
+}
+
+const VersionSet::PartitionMap* VersionSet::RefMap() {
+    MutexLock l(&map_mutex_);
+    const PartitionMap* map = map_.load(std::memory_order_relaxed);
+    map->refs.fetch_add(1, std::memory_order_relaxed);
+    return map;
+}
+
+void VersionSet::UnrefMap(const PartitionMap* map) {
+    if (map->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        MutexLock l(&reclaim_mutex_);
+        retired_maps_.push_back(map);
+        reclaim_pending_ = true;
+        reclaim_cv_.SignalAll();
+    }
+}
+
+VersionSet::Index* VersionSet::LockPartition(const Slice& user_key) {
+    while (true) {
+        const PartitionMap* map = GetMap();
+        Index* index = map->parts[PartitionOf(map, user_key)];
+        index->ReadLock();
+        // Repartition() publishes a map under the write locks of all
+        // partitions, once locked a map still current stays so.
+        const bool current = map == map_.load(std::memory_order_acquire);
+        ReturnMap(map);
+        if (current) {
+            return index;
+        }
+        index->ReadUnlock();
+    }
+}
+
+// Yields the entries of *iter below user key *limit, or all of them if
+// limit is null, and leaves *iter at the first entry not yielded.
+class BoundedIterator : public Iterator {
+public:
+    BoundedIterator(const Comparator* ucmp, Iterator* iter, const std::string* limit)
+            : ucmp_(ucmp), iter_(iter), limit_(limit) { }
+
+    virtual bool Valid() const {
+        return iter_->Valid() &&
+               (limit_ == nullptr || ucmp_->Compare(ExtractUserKey(iter_->key()), Slice(*limit_)) < 0);
+    }
+    virtual void SeekToFirst() { assert(false); }
+    virtual void SeekToLast() { assert(false); }
+    virtual void Seek(const Slice&) { assert(false); }
+    virtual void Next() { iter_->Next(); }
+    virtual void Prev() { assert(false); }
+    virtual Slice key() const { return iter_->key(); }
+    virtual Slice value() const { return iter_->value(); }
+    virtual const char* Raw() const { return iter_->Raw(); }
+    virtual void Abandon() { iter_->Abandon(); }
+    virtual bool Movable() const { return iter_->Movable(); }
+    virtual Status status() const { return iter_->status(); }
 
-    interval* new_interval = BuildInterval(iter, count, &s);
+private:
+    const Comparator* const ucmp_;
+    Iterator* const iter_;
+    const std::string* const limit_;
+};
+
+// A flush of random keys is cut into a table per partition, no more
+// partitions are wanted than keep those tables at
+// config::kMinPartitionEntries entries.
+int VersionSet::PartitionsWanted() const {
+    if (build_tables_ == 0) {
+        return 1;
+    }
+    const uint64_t flushed = writes_ / build_tables_;
+    return static_cast<int>(std::max<uint64_t>(1, std::min<uint64_t>(parts_.size(),
+                                                                     flushed / config::kMinPartitionEntries)));
+}
 
-    if (new_interval == nullptr) { return s; }
+void VersionSet::AddPartitionEntries(const std::vector<uint64_t>& entries) {
+    split_mutex_.AssertHeld();
+    assert(entries.size() == part_entries_.size());
+    uint64_t total = 0;
+    uint64_t largest = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        part_entries_[i] += entries[i];
+        total += part_entries_[i];
+        largest = std::max(largest, part_entries_[i]);
+    }
+    // Look again once the entries grew by a quarter since the last
+    // repartition, keys which can't be split any better are not swept
+    // after every flush.
+    if (parts_.size() == 1 || 4 * total < 5 * repartition_entries_) {
+        return;
+    }
+    // More partitions are wanted, or one holds half again its share,
+    // say all keys written lately are past the last split.
+    const uint64_t n = part_entries_.size();
+    if (static_cast<uint64_t>(PartitionsWanted()) > n || 2 * largest * n > 3 * total) {
+        MutexLock l(&mutex_);
+        MaybeScheduleRepartition();
+    }
+}
 
-    // Get table indexed in nvm.
-    index_.WriteLock();
-    index_.insert(new_interval);   // log^2(n)
-    index_.WriteUnlock();
+// Build the entries of I in [*lower, *upper) of user keys into an
+// interval of index stamped as I, which takes over the records of I.
+// A null bound is open.  Return null if there are no such entries.
+VersionSet::interval* VersionSet::CutInterval(Index* index, interval* I,
+                                              const std::string* lower, const std::string* upper) {
+    const Comparator* ucmp = icmp_.user_comparator();
+    Iterator* iter = I->get_table()->NewIterator();
+    std::string start;
+    if (lower != nullptr) {
+        start = InternalKey(*lower, kMaxSequenceNumber, kValueTypeForSeek).Encode().ToString();
+    }
+    int count = 0;
+    for (lower == nullptr ? iter->SeekToFirst() : iter->Seek(start);
+         iter->Valid() && (upper == nullptr || ucmp->Compare(ExtractUserKey(iter->key()), *upper) < 0);
+         iter->Next()) {
+        count++;
+    }
+    if (count == 0) {
+        delete iter;
+        return nullptr;
+    }
+    lower == nullptr ? iter->SeekToFirst() : iter->Seek(start);
+    BoundedIterator piece(ucmp, iter, upper);
+    NvmMemTable* table = new NvmMemTable(icmp_, count, *options_);
+    table->Transport(&piece, true);     // compact copies never fail
+    delete iter;
 
-    Iterator* table_iter = new_interval->get_table()->NewIterator();
+    Iterator* table_iter = table->NewIterator();
     table_iter->SeekToFirst();  // O(1)
     const char* lRaw = table_iter->Raw();
     table_iter->SeekToLast();   // O(1)
     const char* rRaw = table_iter->Raw();
     delete table_iter;
+    return index->generate(lRaw, rRaw, table, I->stamp());
+}
 
-    // convert imm to nvm imm might trigger a compaction
-    // by stabbing the intervals overlap its end points.
-    //ShowIndex();
-    index_.ReadLock();
-    int lCount = index_.stab(lRaw);
-    int rCount = index_.stab(rRaw);
-    index_.ReadUnlock();
-    //std::cout<<"lCount: "<<lCount<<" rCount: "<<rCount<<std::endl;
-    if (lCount >= rCount) {
-        MaybeScheduleCompaction(lRaw, lCount);
+// Split at about equal numbers of entries, as PartitionRange() does, then
+// move the intervals to the index of their new partition, cutting those
+// running across a new split.  Stamps of intervals from different
+// partitions need not be in order, they never overlap, but an index takes
+// up stamping after the greatest stamp of all.
+void VersionSet::Repartition() {
+    // Only this thread replaces map_ or takes intervals out of the index.
+    const PartitionMap* old_map = map_.load(std::memory_order_relaxed);
+    PartitionMap* map = new PartitionMap;
+    SweepSplits(old_map, Range(), PartitionsWanted(), &map->splits);
+    const size_t n = map->splits.size() + 1;
+
+    if (map->splits == old_map->splits) {
+        delete map;
+        map = nullptr;
+    } else {
+        // A partition keeps the index of the old one holding its first key
+        // unless taken, so fewer intervals move.
+        std::unordered_set<Index*> taken;
+        map->parts.assign(n, nullptr);
+        for (size_t j = 0; j < n; j++) {
+            Index* index = old_map->parts[(j == 0) ? 0 : PartitionOf(old_map, map->splits[j - 1])];
+            if (taken.insert(index).second) {
+                map->parts[j] = index;
+            }
+        }
+        size_t next = 0;
+        for (size_t j = 0; j < n; j++) {
+            while (map->parts[j] == nullptr) {
+                if (taken.insert(parts_[next]).second) {
+                    map->parts[j] = parts_[next];
+                }
+                next++;
+            }
+        }
+    }
+
+    struct Move {
+        interval* I;
+        Index* from;
+        Index* to;      // null if I is cut
+    };
+    std::vector<Move> moves;
+    std::vector<std::pair<interval*, Index*>> pieces;
+    std::unordered_set<interval*> planned;
+    // Plan the move of the intervals of old_map not planned yet, building
+    // the pieces of those cut before the index is locked.
+    auto plan = [&]() {
+        for (auto &from : old_map->parts) {
+            std::vector<interval*> intervals;
+            from->ReadLock();
+            from->collect(intervals);
+            from->ReadUnlock();
+            for (auto &I : intervals) {
+                if (!planned.insert(I).second) {
+                    continue;
+                }
+                const int first = PartitionOf(map, ExtractUserKey(GetLengthPrefixedSlice(I->inf())));
+                const int last = PartitionOf(map, ExtractUserKey(GetLengthPrefixedSlice(I->sup())));
+                if (first == last) {
+                    if (map->parts[first] != from) {
+                        moves.push_back(Move{I, from, map->parts[first]});
+                    }
+                    continue;
+                }
+                moves.push_back(Move{I, from, nullptr});
+                for (int j = first; j <= last; j++) {
+                    interval* piece = CutInterval(map->parts[j], I,
+                                                  (j > first) ? &map->splits[j - 1] : nullptr,
+                                                  (j < last) ? &map->splits[j] : nullptr);
+                    if (piece != nullptr) {
+                        pieces.push_back(std::make_pair(piece, map->parts[j]));
+                    }
+                }
+            }
+        }
+    };
+
+    // Flushes and ingests go on adding intervals, cut at the old splits,
+    // while the index is planned without split_mutex_.  The few added
+    // meanwhile are planned with it held.
+    if (map != nullptr) {
+        plan();
+    }
+    MutexLock l(&split_mutex_);
+    if (map != nullptr) {
+        plan();
+
+        // Readers check the map under the lock of the partition they are
+        // in, all of them are locked while it is replaced, in order.
+        uint64_t timestamp = 0;
+        for (auto &index : parts_) {
+            index->WriteLock();
+            timestamp = std::max(timestamp, index->NextTimestamp());
+        }
+        for (auto &move : moves) {
+            move.from->remove(move.I);
+            if (move.to != nullptr) {
+                move.to->insert(move.I);
+            }
+        }
+        for (auto &piece : pieces) {
+            piece.second->insert(piece.first);
+        }
+        for (auto &index : parts_) {
+            index->AdvanceTimestamp(timestamp);
+        }
+        {
+            MutexLock map_lock(&map_mutex_);
+            map_.store(map, std::memory_order_release);
+        }
+        for (auto &index : parts_) {
+            index->WriteUnlock();
+        }
+        for (auto &move : moves) {
+            if (move.to == nullptr) {
+                move.I->Unref();
+            }
+        }
+
+        // Take old_map back from the threads caching it, a thread reading
+        // with it drops it in ReturnMap().  It is destroyed once the
+        // iterators opened on it are gone too.
+        std::vector<void*> cached;
+        local_map_.Scrape(&cached, nullptr);
+        for (auto &cached_map : cached) {
+            if (cached_map != kMapInUse) {
+                UnrefMap(static_cast<const PartitionMap*>(cached_map));
+            }
+        }
+        UnrefMap(old_map);
+    }
+
+    part_entries_.assign(n, 0);
+    repartition_entries_ = 0;
+    const PartitionMap* current = map_.load(std::memory_order_relaxed);
+    for (size_t j = 0; j < n; j++) {
+        part_entries_[j] = current->parts[j]->CountKVs();
+        repartition_entries_ += part_entries_[j];
+    }
+}
+
+static const unsigned int kGuardSeed = 0x3c6ef372;
+
+// Yields the entries of *iter up to the next guard, a user key whose hash
+// ends in guard_bits zero bits, once min_count entries have been yielded,
+// and leaves *iter at the guard.  Versions of one user key are never
+// parted.
+class GuardIterator : public Iterator {
+public:
+    GuardIterator(Iterator* iter, int guard_bits, int min_count)
+            : iter_(iter), mask_((uint64_t(1) << guard_bits) - 1),
+              min_count_(min_count), count_(0), at_guard_(false) { }
+
+    virtual bool Valid() const { return !at_guard_ && iter_->Valid(); }
+    virtual void SeekToFirst() { assert(false); }
+    virtual void SeekToLast() { assert(false); }
+    virtual void Seek(const Slice&) { assert(false); }
+    virtual void Next() {
+        // The records stay put while they are merged, so is the last key.
+        const Slice last = ExtractUserKey(iter_->key());
+        iter_->Next();
+        if (++count_ >= min_count_ && iter_->Valid()) {
+            const Slice ukey = ExtractUserKey(iter_->key());
+            at_guard_ = IsGuard(ukey) && ukey != last;
+        }
+    }
+    virtual void Prev() { assert(false); }
+    virtual Slice key() const { return iter_->key(); }
+    virtual Slice value() const { return iter_->value(); }
+    virtual const char* Raw() const { return iter_->Raw(); }
+    virtual void Abandon() { iter_->Abandon(); }
+    virtual bool Movable() const { return iter_->Movable(); }
+    virtual Status status() const { return iter_->status(); }
+
+private:
+    bool IsGuard(const Slice& ukey) const {
+        return (CuckooHash::MurmurHash64A(ukey.data(), static_cast<int>(ukey.size()), kGuardSeed) & mask_) == 0;
+    }
+
+    Iterator* const iter_;
+    const uint64_t mask_;
+    const int min_count_;
+    int count_;
+    bool at_guard_;
+};
+
+Status VersionSet::BuildTable(Iterator *iter, const int count, Arena* arena) {
+
+    Status s = Status::OK();
+    if (!iter->Valid()) { return s; }
+
+    // The splits stay put until the table is indexed.
+    MutexLock split_lock(&split_mutex_);
+    const PartitionMap* map = map_.load(std::memory_order_relaxed);
+
+    // A table is cut at splits, count the entries of each piece
+    // unless all of them fall into one partition.
+    const int first = PartitionOf(map, ExtractUserKey(iter->key()));
+    int last = first;
+    std::vector<uint64_t> counts(map->parts.size(), 0);
+    if (map->parts.size() > 1) {
+        iter->SeekToLast();
+        last = PartitionOf(map, ExtractUserKey(iter->key()));
+        iter->SeekToFirst();
+    }
+    if (first == last) {
+        counts[first] = count;
     } else {
-        MaybeScheduleCompaction(rRaw, rCount);
+        const Comparator* ucmp = icmp_.user_comparator();
+        int p = first;
+        for (; iter->Valid(); iter->Next()) {
+            const Slice ukey = ExtractUserKey(iter->key());
+            while (p < last && ucmp->Compare(ukey, Slice(map->splits[p])) >= 0) {
+                p++;
+            }
+            counts[p]++;
+        }
+        iter->SeekToFirst();
+    }
+
+    build_tables_ ++;
+    const char* HotKey = nullptr;
+    int overlaps = 0;
+    for (int p = first; p <= last && s.ok(); p++) {
+        if (counts[p] == 0) {
+            continue;
+        }
+        Index* const index = map->parts[p];
+        BoundedIterator piece(icmp_.user_comparator(), iter, (p < last) ? &map->splits[p] : nullptr);
+        interval* new_interval = BuildInterval(index, &piece, static_cast<int>(counts[p]), &s, 0, arena);
+
+        if (new_interval == nullptr) { continue; }
+
+        const char* lRaw = new_interval->inf();
+        const char* rRaw = new_interval->sup();
+
+        // Get table indexed in nvm.
+        // Sequential inserts put each table after all the others,
+        // which is appended without looking for the overlaps it can't have.
+        index->WriteLock();
+        const bool appended = index->append(new_interval);   // log(n)
+        if (!appended) {
+            index->insert(new_interval);   // log^2(n)
+        }
+        index->WriteUnlock();
+        if (appended) {
+            continue;
+        }
+
+        // convert imm to nvm imm might trigger a compaction
+        // by stabbing the intervals overlap its end points.
+        //ShowIndex();
+        index->ReadLock();
+        int lCount = index->stab(lRaw);
+        int rCount = index->stab(rRaw);
+        index->ReadUnlock();
+        //std::cout<<"lCount: "<<lCount<<" rCount: "<<rCount<<std::endl;
+        if (lCount > overlaps) {
+            HotKey = lRaw;
+            overlaps = lCount;
+        }
+        if (rCount > overlaps) {
+            HotKey = rRaw;
+            overlaps = rCount;
+        }
+    }
+    AddPartitionEntries(counts);
+    if (HotKey != nullptr) {
+        MaybeScheduleCompaction(HotKey, overlaps);
     }
     //ShowIndex();
 
@@ -132,7 +689,8 @@ std::uint64_t NowNanos() {
 // iter is constructed from imm_ or some nvm_imm_.
 // If modify versions_, use mutex_ in to protect versions_.
 // REQUIRES: iter->Valid().
-VersionSet::interval* VersionSet::BuildInterval(Iterator *iter, int count, Status *s, uint64_t timestamp) {
+VersionSet::interval* VersionSet::BuildInterval(Index* index, Iterator *iter, int count, Status *s,
+                                                uint64_t timestamp, Arena* arena) {
 
     *s = Status::OK();
     assert(iter->Valid());
@@ -142,21 +700,27 @@ VersionSet::interval* VersionSet::BuildInterval(Iterator *iter, int count, Statu
     if (timestamp != 0) {
         start = NowNanos();
     }
-    NvmMemTable *table = new NvmMemTable(icmp_, count, options_->use_cuckoo);
-    table->Transport(iter, timestamp != 0);
+    NvmMemTable *table = new NvmMemTable(icmp_, count, *options_);
+    const Status copied = table->Transport(iter, timestamp != 0, arena);
     if (timestamp != 0) {
         uint64_t period = NowNanos() - start;
         merges_ += table->GetCount();
         merge_latency_ += period;
+        merged_.fetch_add(table->GetCount(), std::memory_order_relaxed);
     } else {
         writes_ += table->GetCount();
-        build_tables_ ++;
     }
 
     // Check for input iterator errors
     if (!iter->status().ok()) {
         *s = iter->status();
     }
+    // Only copies fail, drop those made.
+    if (!copied.ok()) {
+        *s = copied;
+        table->Destroy(true);
+        return nullptr;
+    }
     // an empty table, just delete it.
     if (table->GetCount() == 0) {
         table->Destroy(false);
@@ -195,39 +759,33 @@ VersionSet::interval* VersionSet::BuildInterval(Iterator *iter, int count, Statu
     delete table_iter;
     assert(index_cmp_(lRaw, rRaw) <= 0);
 
-    return index_.generate(lRaw, rRaw, table, timestamp);
+    return index->generate(lRaw, rRaw, table, timestamp);
 }
 
 
 void VersionSet::Get(const LookupKey &key, std::string *value, Status *s) {
     Slice memkey = key.memtable_key();
-    std::vector<interval*> intervals;
+    Index::Stab intervals;
     const char* HotKey = nullptr;
-    int overlaps = 0;
 
-    index_.ReadLock();
+    // Probe under the read lock, which keeps every stabbed interval in the
+    // index, so none of them needs a reference.  The newest interval
+    // holding the key answers, the older ones are never touched.
+    Index* const index = LockPartition(key.user_key());
     // we are interested in user key.
-    index_.search(memkey.data(), intervals, overlaps);
-    for (auto &interval : intervals) {
-        //interval->print(std::cout);
-        // interval will exist before we release it.
-        interval->Ref();
-    }
-    index_.ReadUnlock();
-
+    index->search(memkey.data(), &intervals);
     bool found = false;
-    //std::cout<<"Want: ";
-    //Decode(key.memtable_key().data(), std::cout);
-    //std::cout<<std::endl;
-    for (auto &interval : intervals) {
-        if (!found) {
-            found = interval->get_table()->Get(key, value, s, HotKey);
-        }
-        interval->Unref();
+    int probes = 0;
+    while (probes < intervals.size() && !found) {
+        found = intervals[probes++]->get_table()->Get(key, value, s, HotKey);
     }
+    const int overlaps = intervals.overlaps();
+    index->ReadUnlock();
     if (!found) {
         *s = Status::NotFound(Slice());
     }
+    gets_.fetch_add(1, std::memory_order_relaxed);
+    probes_.fetch_add(probes, std::memory_order_relaxed);
 
     // memkey is stored in LookupKey, highly possible be freed under multi threads.
     if (HotKey != nullptr) {
@@ -240,6 +798,14 @@ void VersionSet::Get(const LookupKey &key, std::string *value, Status *s) {
 
 }
 
+void VersionSet::GetMergeStats(MergeStats* stats) const {
+    stats->flushed = writes_.load(std::memory_order_relaxed);
+    stats->merged = merged_.load(std::memory_order_relaxed);
+    stats->merges = merge_runs_.load(std::memory_order_relaxed);
+    stats->gets = gets_.load(std::memory_order_relaxed);
+    stats->probes = probes_.load(std::memory_order_relaxed);
+}
+
 void VersionSet::MaybeScheduleCompaction(const char* HotKey, const int overlaps) {
     assert(HotKey != nullptr);
     if (nvm_compaction_scheduled_ || overlaps < options_->max_overlap) return;
@@ -253,13 +819,37 @@ void VersionSet::MaybeScheduleCompaction(const char* HotKey, const int overlaps)
         // Already got an error; no more changes
     } else if (overlaps < options_->max_overlap) {
         // No work to be done
+    } else if (options_->merge_policy == nullptr &&
+               (writes_ - merge_writes_) * config::kMergeRewriteRatio < merge_entries_ &&
+               overlaps < config::kMergeDeferredOverlaps * static_cast<int>(options_->max_overlap)) {
+        // Too little was flushed since the last merge started to rewrite
+        // all of it again
+    } else if (overlaps <= rejected_overlaps_ &&
+               ExtractUserKey(GetLengthPrefixedSlice(HotKey)) == Slice(rejected_key_)) {
+        // Options::merge_policy left these intervals alone
     } else {
         //std::cout<<"compact start"<<std::endl;
         nvm_compaction_scheduled_ = true;
+        hot_overlaps_ = overlaps;
         env_->NvmSchedule(&VersionSet::BGWork, this, (void*)HotKey);
     }
 }
 
+void VersionSet::MaybeScheduleRepartition() {
+    mutex_.AssertHeld();
+    repartition_pending_.store(true, std::memory_order_release);
+    if (nvm_compaction_scheduled_) {
+        // The merge scheduled repartitions once it is done
+    } else if (shutting_down_.Acquire_Load()) {
+        // DB is being deleted, no more background work
+    } else if (!bg_error_.ok()) {
+        // Already got an error; no more changes
+    } else {
+        nvm_compaction_scheduled_ = true;
+        env_->NvmSchedule(&VersionSet::BGWork, this, nullptr);
+    }
+}
+
 void VersionSet::BGWork(void* vs, void* hk) {
     reinterpret_cast<VersionSet*>(vs)->BackgroundCall(static_cast<const char*>(hk));
 }
@@ -275,13 +865,23 @@ void VersionSet::BackgroundCall(const char* HotKey) {
         BackgroundCompaction(HotKey);
     }
     nvm_compaction_scheduled_ = false;
+    // A repartition asked for after BackgroundCompaction() looked.
+    if (repartition_pending_.load(std::memory_order_acquire)) {
+        MaybeScheduleRepartition();
+    }
     nvm_signal.Signal();    // Only delete DB operation will wait at this signal
 }
 
 void VersionSet::BackgroundCompaction(const char* HotKey) {
     mutex_.AssertHeld();
     mutex_.Unlock();
-    DoCompactionWork(HotKey);
+    // HotKey is null if only a repartition is scheduled.
+    if (HotKey != nullptr) {
+        DoCompactionWork(HotKey);
+    }
+    if (repartition_pending_.exchange(false, std::memory_order_acq_rel)) {
+        Repartition();
+    }
     mutex_.Lock();
     // lock and modify, prevent divide zero error.
     peak_height_ = 0;
@@ -290,7 +890,49 @@ void VersionSet::BackgroundCompaction(const char* HotKey) {
 }
 
 
+// Carry iterators over a border of intervals instead of opening them all again.
+// iterators[i] belongs to olds[i], on return iterators[i] belongs to news[i]:
+// iterators of intervals in both are kept where they stand, those of intervals
+// only in olds are deleted, intervals only in news get new iterators
+// positioned as if the merge moved to k forward (or backward if reverse).
+template <typename Interval>
+static void ShiftIterators(const std::vector<Interval*>& olds,
+                           const std::vector<Interval*>& news,
+                           std::vector<Iterator*>& iterators,
+                           const Slice& k, const bool reverse) {
+    assert(olds.size() == iterators.size());
+    std::vector<Iterator*> shifted;
+    shifted.reserve(news.size());
+    std::vector<bool> kept(olds.size(), false);
+    for (auto &interval : news) {
+        const size_t i = std::find(olds.begin(), olds.end(), interval) - olds.begin();
+        if (i != olds.size()) {
+            kept[i] = true;
+            shifted.push_back(iterators[i]);
+            continue;
+        }
+        Iterator* iter = interval->get_table()->NewIterator();
+        iter->Seek(k);
+        if (reverse) {
+            if (!iter->Valid()) {
+                iter->SeekToLast();
+            } else if (iter->key() != k) {
+                iter->Prev();
+            }
+        }
+        shifted.push_back(iter);
+    }
+    for (size_t i = 0; i < olds.size(); i++) {
+        if (!kept[i]) {
+            delete iterators[i];
+        }
+    }
+    iterators.swap(shifted);
+}
+
 // Only used in nvm data compaction, neither l or r is nullptr.
+// A part of a split merge runs from the node from up to, not including,
+// the node until, both starting intervals of the merge.
 class CompactIterator : public Iterator {
 public:
 
@@ -300,14 +942,21 @@ public:
             VersionSet::Index* index,
             const char* l,
             const char* r,
+            const uint64_t t0,
             const uint64_t t1,
             const uint64_t s,
-            std::vector<interval*>& inters)
+            std::vector<interval*>& inters,
+            const char* from = nullptr,
+            const char* until = nullptr)
             : iter_icmp(cmp),
               helper_(index),
               left_border(l),
               right_border(r),
+              from_(from != nullptr ? from : l),
+              until_(until),
+              at_until_(false),
               right(nullptr),
+              time_low(t0),
               time_up(t1),
               smallest_snapshot(s),
               drops(0),
@@ -338,18 +987,18 @@ public:
 
     ~CompactIterator() {
         // only need to clear iterator.
-        delete merge_iter;
+        ClearState();
     }
 
     virtual bool Valid() const {
-        return merge_iter->Valid();
+        return !at_until_ && merge_iter->Valid();
     }
 
-    virtual void Seek(const Slice& k) { }
+    virtual void Seek(const Slice&) { }
 
-    // Start compact(iterate) from left_border.
+    // Start compact(iterate) from left_border, or from_ of a part.
     virtual void SeekToFirst() {
-        HelpSeek(left_border);
+        HelpSeek(from_);
         assert(Valid());
         while (Valid() && SkipObsoleteKeys()) {
             HelpNext();
@@ -392,7 +1041,23 @@ public:
         return merge_iter->status();
     }
 
-    virtual void Abandon() { }
+    // The record is moved into the new interval.
+    virtual void Abandon() {
+        assert(Valid());
+        merge_iter->Abandon();
+    }
+
+    // End points of intervals are keys of the index too.
+    virtual bool Movable() const {
+        assert(Valid());
+        const char* raw = merge_iter->Raw();
+        for (auto &interval : intervals) {
+            if (raw == interval->inf() || raw == interval->sup()) {
+                return false;
+            }
+        }
+        return true;
+    }
 
     inline uint64_t DropCount() { return drops; }
 
@@ -467,9 +1132,15 @@ private:
         }
 #endif
 
-        // reach the border and trigger a seek, right set to 0 terminates it.
+        // the next part goes on from until_.
+        if (merge_iter->Valid() && merge_iter->Raw() == until_) {
+            at_until_ = true;
+            return;
+        }
+
+        // reach the border and shift intervals, right set to 0 terminates it.
         if (merge_iter->Valid() && merge_iter->Raw() == right) {
-            HelpSeek(right);
+            HelpShift(right);
         }
     }
 
@@ -497,7 +1168,7 @@ private:
 */
 
         helper_.ReadLock();
-        helper_.Seek(k, intervals, right, right_border, time_up);
+        helper_.Seek(k, intervals, right, right_border, time_low, time_up);
         helper_.ReadUnlock();
         InitIterator();
 
@@ -526,16 +1197,40 @@ private:
 
     }
 
+    // merge_iter stands on k, the first key of the interval starting at right.
+    // Only the interval starting at k is new to merge_iter, the others still
+    // overlapping k go on from where they stand.
+    void HelpShift(const char* k) {
+        assert(k != nullptr && merge_iter->Raw() == k);
+        std::vector<interval*> olds;
+        olds.swap(intervals);
+
+        helper_.ReadLock();
+        helper_.Seek(k, intervals, right, right_border, time_low, time_up);
+        helper_.ReadUnlock();
+        PickIntervals();
+
+        delete merge_iter;
+        ShiftIterators(olds, intervals, iterators, GetLengthPrefixedSlice(k), false);
+        merge_iter = NewResumedMergingIterator(&iter_icmp, iterators.data(), iterators.size(), false);
+        assert(merge_iter->Valid() && merge_iter->Raw() == k);
+    }
+
     void ClearState() {
         delete merge_iter;
         merge_iter = nullptr;
+        for (auto &iter : iterators) {
+            delete iter;
+        }
         iterators.clear();
         intervals.clear();
     }
 
-    void InitIterator() {
+    // Keep the intervals stamped in [time_low, time_up] only.
+    void PickIntervals() {
+        size_t picked = 0;
         for (auto &interval : intervals) {
-            if (interval->stamp() <= time_up) {
+            if (interval->stamp() >= time_low && interval->stamp() <= time_up) {
                 // no need to ref intervals here as only this thread unref intervals with write lock protected.
                 if (filter.find(interval) == filter.end()) {
                     assert(iter_icmp.Compare(GetLengthPrefixedSlice(left_border), GetLengthPrefixedSlice(interval->inf())) <= 0
@@ -543,12 +1238,20 @@ private:
                     filter.insert(interval);
                     old_intervals.push_back(interval);
                 }
-                //interval->print(std::cout);
-                iterators.push_back(interval->get_table()->NewIterator());
+                intervals[picked++] = interval;
             }
         }
+        intervals.resize(picked);
+    }
+
+    void InitIterator() {
+        PickIntervals();
+        for (auto &interval : intervals) {
+            //interval->print(std::cout);
+            iterators.push_back(interval->get_table()->NewIterator());
+        }
         //std::cout<<std::endl;
-        merge_iter = NewMergingIterator(&iter_icmp, &iterators[0], iterators.size());
+        merge_iter = NewResumedMergingIterator(&iter_icmp, iterators.data(), iterators.size(), false);
     }
 
 
@@ -558,15 +1261,19 @@ private:
 
     const char* const left_border;
     const char* const right_border;
+    const char* const from_;
+    const char* const until_;
+    bool at_until_;
     const char* right;
 
+    const uint64_t time_low;
     const uint64_t time_up;
     const uint64_t smallest_snapshot;
     uint64_t drops;
     std::unordered_set<interval*> filter;
     std::vector<interval*>& old_intervals;
-    std::vector<interval*> intervals;
-    std::vector<Iterator*> iterators;
+    std::vector<interval*> intervals;   // picked intervals, one iterator each
+    std::vector<Iterator*> iterators;   // owned here, not by merge_iter
     Iterator* merge_iter;
 
     ParsedInternalKey ikey;
@@ -580,10 +1287,204 @@ private:
 };
 
 
+struct VersionSet::SubCompaction {
+    VersionSet* vs;
+    Index* index;
+    const char* left;           // of the whole merge
+    const char* right;
+    const char* from;           // of this part, nullptr from left
+    const char* until;          // nullptr up to right
+    uint64_t time_low;
+    uint64_t time_up;
+    uint64_t smallest_snapshot;
+    uint64_t avg_count;
+    std::vector<interval*> olds;
+    std::vector<interval*> news;
+    uint64_t drops;
+    Status status;
+};
+
+void VersionSet::SubCompactionWork(void* vs) {
+    reinterpret_cast<VersionSet*>(vs)->SubCompactionLoop();
+}
+
+struct VersionSet::PoolTask {
+    void (*function)(void*);
+    void* arg;
+    int* pending;   // of its RunInPool() call, protected by sub_mutex_
+};
+
+void VersionSet::SubCompactionLoop() {
+    MutexLock l(&sub_mutex_);
+    while (true) {
+        while (sub_queue_.empty() && !sub_shutdown_) {
+            sub_cv_.Wait();
+        }
+        if (sub_queue_.empty()) {
+            break;
+        }
+        RunPoolTask();
+    }
+    sub_workers_--;
+    sub_cv_.SignalAll();
+}
+
+void VersionSet::RunPoolTask() {
+    sub_mutex_.AssertHeld();
+    PoolTask* task = sub_queue_.front();
+    sub_queue_.pop_front();
+    sub_mutex_.Unlock();
+    (*task->function)(task->arg);
+    sub_mutex_.Lock();
+    if (--*task->pending == 0) {
+        sub_cv_.SignalAll();
+    }
+}
+
+void VersionSet::RunInPool(void (*function)(void*), const std::vector<void*>& args) {
+    const size_t n = args.size();
+    if (n == 0) {
+        return;
+    }
+    int pending = static_cast<int>(n) - 1;
+    std::vector<PoolTask> tasks(n);
+    if (n > 1) {
+        MutexLock l(&sub_mutex_);
+        for (size_t i = 1; i < n; i++) {
+            tasks[i].function = function;
+            tasks[i].arg = args[i];
+            tasks[i].pending = &pending;
+            sub_queue_.push_back(&tasks[i]);
+        }
+        sub_cv_.SignalAll();
+    }
+    (*function)(args[0]);
+    if (n > 1) {
+        MutexLock l(&sub_mutex_);
+        while (pending > 0) {
+            if (!sub_queue_.empty()) {
+                RunPoolTask();
+            } else {
+                sub_cv_.Wait();
+            }
+        }
+    }
+}
+
+void VersionSet::SubCompactionTask(void* arg) {
+    SubCompaction* sub = reinterpret_cast<SubCompaction*>(arg);
+    sub->vs->RunSubCompaction(sub);
+}
+
+void VersionSet::RunSubCompaction(SubCompaction* sub) {
+    Index* const index = sub->index;
+    const uint64_t avg_count = sub->avg_count;
+    const uint64_t time_up = sub->time_up;
+    Status& s = sub->status;
+    std::vector<interval*>& new_intervals = sub->news;
+    CompactIterator* iter = new CompactIterator(icmp_, index, sub->left, sub->right, sub->time_low, time_up,
+                                                sub->smallest_snapshot, sub->olds, sub->from, sub->until);
+    //ShowIndex();
+    iter->SeekToFirst();
+    assert(iter->Valid());
+    if (options_->merge_guards) {
+        // Cut at the first guard past half a flush, with guards spaced
+        // half to one flush apart, so most tables come out near flush size.
+        // As flushes grow the guards thin out to a subset of the old ones.
+        int guard_bits = 0;
+        while ((uint64_t(2) << guard_bits) <= avg_count) {
+            guard_bits++;
+        }
+        while (iter->Valid()) {
+            GuardIterator piece(iter, guard_bits, static_cast<int>(avg_count / 2));
+            new_intervals.push_back(BuildInterval(index, &piece, 2 * avg_count, &s, time_up));
+            assert(s.ok());
+        }
+    } else {
+        while (iter->Valid()) {
+            new_intervals.push_back(BuildInterval(index, iter, avg_count, &s, time_up));
+            assert(s.ok());
+        }
+    }
+    sub->drops = iter->DropCount();
+    delete iter;
+}
+
+// Pick up to subcompactions_-1 starts of intervals in (left, right) that
+// cut the merge into parts of about the same number of entries, no smaller
+// than avg_count. Versions of a user key are not parted: a start is taken
+// only if no record of its user key merged here comes before it.
+void VersionSet::SplitCompaction(Index* index, const char* left, const char* right,
+                                 uint64_t time_low, uint64_t time_up, uint64_t avg_count,
+                                 std::vector<const char*>* untils) {
+    const Comparator* ucmp = icmp_.user_comparator();
+    Index::IteratorHelper helper(index);
+    std::vector<interval*> intervals;
+    std::vector<std::pair<const char*, uint64_t>> starts;    // entries before each
+    uint64_t total = 0;
+
+    index->ReadLock();
+    for (const char* k = left; k != nullptr; ) {
+        intervals.clear();
+        const char* next = nullptr;
+        helper.Seek(k, intervals, next, right, time_low, time_up);
+        starts.emplace_back(k, total);
+        for (auto &interval : intervals) {
+            if (interval->inf() == k) {
+                total += interval->get_table()->GetCount();
+            }
+        }
+        k = next;
+    }
+
+    const uint64_t n = std::min<uint64_t>(subcompactions_, total / avg_count);
+    size_t i = 1;
+    for (uint64_t part = 1; part < n && i < starts.size(); part++) {
+        while (i < starts.size() && starts[i].second < total * part / n) {
+            i++;
+        }
+        for (; i < starts.size(); i++) {
+            const char* b = starts[i].first;
+            const Slice ukey = ExtractUserKey(GetLengthPrefixedSlice(b));
+            // No interval starts or ends among earlier versions of ukey,
+            // those of intervals running across b are checked one by one.
+            const char* prev = index->before(b);
+            if (prev != nullptr && ucmp->Compare(ExtractUserKey(GetLengthPrefixedSlice(prev)), ukey) == 0) {
+                continue;
+            }
+            intervals.clear();
+            index->search(b, intervals);
+            const InternalKey first(ukey, kMaxSequenceNumber, kValueTypeForSeek);
+            bool parted = false;
+            for (auto &interval : intervals) {
+                if (parted || interval->inf() == b ||
+                    interval->stamp() < time_low || interval->stamp() > time_up) {
+                    continue;
+                }
+                Iterator* iter = interval->get_table()->NewIterator();
+                iter->Seek(first.Encode());
+                parted = iter->Valid() && iter->Raw() != b &&
+                         icmp_.Compare(iter->key(), GetLengthPrefixedSlice(b)) < 0;
+                delete iter;
+            }
+            if (!parted) {
+                untils->push_back(b);
+                i++;
+                break;
+            }
+        }
+    }
+    index->ReadUnlock();
+}
+
 // Only one nvm data compaction thread
 void VersionSet::DoCompactionWork(const char *HotKey) {
     assert(HotKey != nullptr);
-    //const uint64_t avg_count = last_sequence_/index_.size();
+    // No interval runs across partitions, neither does a merge.  Only
+    // this thread repartitions the index.
+    const PartitionMap* map = map_.load(std::memory_order_acquire);
+    Index* const index = map->parts[PartitionOf(map, ExtractUserKey(GetLengthPrefixedSlice(HotKey)))];
+    //const uint64_t avg_count = last_sequence_/index->size();
     assert(writes_ > 0 && build_tables_ > 0);
     const uint64_t avg_count = writes_/build_tables_;
     assert(avg_count > 0);
@@ -591,22 +1492,43 @@ void VersionSet::DoCompactionWork(const char *HotKey) {
     std::vector<interval*> new_intervals;
     const char* left = HotKey;
     const char* right = HotKey;
+    uint64_t time_low = 0;
     uint64_t time_up = 0;
     Status s = Status::OK();
     bool break_it = false;
 
-    index_.ReadLock();
-    index_.search(HotKey, old_intervals, true);
-    index_.ReadUnlock();
+    index->ReadLock();
+    index->search(HotKey, old_intervals, true);
+    index->ReadUnlock();
     // Although hardly, it might happen.
     if (old_intervals.size() <= 1) return;
     assert(old_intervals.size() > 1);
     peak_height_ = old_intervals.size();
     time_up = old_intervals[0]->stamp();
     assert(time_up > old_intervals[1]->stamp());
-    for (auto &interval : old_intervals) {
-        if (index_cmp_(interval->inf(), left) < 0) {
-            left = interval->inf();
+    // The policy keeps the newest intervals, whatever overlaps them
+    // is merged along if stamped no older than the oldest kept.
+    if (options_->merge_policy != nullptr) {
+        std::vector<uint64_t> sizes;
+        sizes.reserve(old_intervals.size());
+        for (auto &interval : old_intervals) {
+            sizes.push_back(interval->get_table()->GetCount());
+        }
+        const int picked = std::min(options_->merge_policy->Pick(sizes.data(), static_cast<int>(sizes.size())),
+                                    static_cast<int>(old_intervals.size()));
+        if (picked <= 1) {
+            MutexLock l(&mutex_);
+            const Slice ukey = ExtractUserKey(GetLengthPrefixedSlice(HotKey));
+            rejected_key_.assign(ukey.data(), ukey.size());
+            rejected_overlaps_ = hot_overlaps_;
+            return;
+        }
+        old_intervals.resize(picked);
+        time_low = old_intervals.back()->stamp();
+    }
+    for (auto &interval : old_intervals) {
+        if (index_cmp_(interval->inf(), left) < 0) {
+            left = interval->inf();
         }
         if (index_cmp_(interval->sup(), right) > 0) {
             right = interval->sup();
@@ -617,79 +1539,128 @@ void VersionSet::DoCompactionWork(const char *HotKey) {
     while (!break_it) {
         break_it = true;
         old_intervals.clear();
-        index_.ReadLock();
-        index_.search(left, old_intervals);
-        index_.ReadUnlock();
+        index->ReadLock();
+        index->search(left, old_intervals);
+        index->ReadUnlock();
         //Decode(left, std::cout);
         //std::cout<<std::endl;
         for (auto &interval : old_intervals) {
-            if (interval->stamp() <= time_up && index_cmp_(interval->inf(), left) < 0) {
+            if (interval->stamp() >= time_low && interval->stamp() <= time_up &&
+                index_cmp_(interval->inf(), left) < 0) {
                 left = interval->inf();
                 break_it = false;
             }
         }
     }
-    assert(old_intervals[0]->inf() == left);
+    // intervals newer than time_up, say ingested ones, or older than time_low
+    // may run across left.
+    assert(std::any_of(old_intervals.begin(), old_intervals.end(), [&](interval* i) {
+        return i->stamp() >= time_low && i->stamp() <= time_up && i->inf() == left;
+    }));
 
     break_it = false;
     // expand interval set to rightmost overlapped interval
     while (!break_it) {
         break_it = true;
         old_intervals.clear();
-        index_.ReadLock();
-        index_.search(right, old_intervals);
-        index_.ReadUnlock();
+        index->ReadLock();
+        index->search(right, old_intervals);
+        index->ReadUnlock();
         //Decode(right, std::cout);
         //std::cout<<std::endl;
         for (auto &interval: old_intervals) {
-            if (interval->stamp() <= time_up && index_cmp_(interval->sup(), right) > 0) {
+            if (interval->stamp() >= time_low && interval->stamp() <= time_up &&
+                index_cmp_(interval->sup(), right) > 0) {
                 right = interval->sup();
                 break_it = false;
             }
         }
     }
 
-    assert(old_intervals[0]->sup() == right);
+    assert(std::any_of(old_intervals.begin(), old_intervals.end(), [&](interval* i) {
+        return i->stamp() >= time_low && i->stamp() <= time_up && i->sup() == right;
+    }));
     assert(index_cmp_(left, right) < 0);
 
     old_intervals.clear();
 
     // internal key ranged in [left, right]
-    // with timestamp <= merge_line - 1 will be compacted,
+    // with timestamp in [time_low, time_up] will be compacted,
     // produced intervals with merge_line and no overlap.
-    uint64_t smallest_snapshot = last_sequence_;
-    if (!snapshots_.empty()) {
-        smallest_snapshot = snapshots_.oldest()->sequence_number();
+    uint64_t smallest_snapshot;
+    {
+        MutexLock l(&snapshots_mutex_);
+        smallest_snapshot = LastSequence();
+        if (!snapshots_.empty()) {
+            smallest_snapshot = snapshots_.oldest()->sequence_number();
+        }
     }
-    Iterator* iter = new CompactIterator(icmp_, &index_, left, right, time_up, smallest_snapshot, old_intervals);
-    //ShowIndex();
-    iter->SeekToFirst();
-    assert(iter->Valid());
-    while (iter->Valid()) {
-        new_intervals.push_back(BuildInterval(iter, avg_count, &s, time_up));
-        assert(s.ok());
+    // A big merge is split into key ranges merged by threads of their own.
+    std::vector<const char*> untils;
+    if (subcompactions_ > 1) {
+        SplitCompaction(index, left, right, time_low, time_up, avg_count, &untils);
     }
-    drops_ += dynamic_cast<CompactIterator*>(iter)->DropCount();
-    delete iter;
+    const int n = static_cast<int>(untils.size()) + 1;
+    std::vector<SubCompaction> subs(n);
+    std::vector<void*> args(n);
+    for (int i = 0; i < n; i++) {
+        subs[i].vs = this;
+        subs[i].index = index;
+        subs[i].left = left;
+        subs[i].right = right;
+        subs[i].from = (i > 0) ? untils[i - 1] : nullptr;
+        subs[i].until = (i < n - 1) ? untils[i] : nullptr;
+        subs[i].time_low = time_low;
+        subs[i].time_up = time_up;
+        subs[i].smallest_snapshot = smallest_snapshot;
+        subs[i].avg_count = avg_count;
+        subs[i].drops = 0;
+        args[i] = &subs[i];
+    }
+    const uint64_t writes_at_start = writes_;
+    const uint64_t merged_at_start = merged_;
+    RunInPool(&VersionSet::SubCompactionTask, args);
+    {
+        MutexLock l(&mutex_);
+        merge_writes_ = writes_at_start;
+        merge_entries_ = merged_ - merged_at_start;
+    }
+
+    // An interval running across a split was merged by both sides.
+    std::unordered_set<interval*> merged;
+    for (auto &sub : subs) {
+        for (auto &interval : sub.olds) {
+            if (merged.insert(interval).second) {
+                old_intervals.push_back(interval);
+            }
+        }
+        new_intervals.insert(new_intervals.end(), sub.news.begin(), sub.news.end());
+        drops_ += sub.drops;
+        if (s.ok()) s = sub.status;
+    }
+    assert(s.ok());
+    merge_runs_.fetch_add(1, std::memory_order_relaxed);
 
     // Data consistency accross failure.
     //ShowIndex();
     //std::cout<<"Insert new intervals: ";
+    // Swap the merged intervals in under one write lock, readers see
+    // either the old ones or the new ones, and the index changes in bulk.
+    index->WriteLock();
     for (auto &interval : new_intervals) {
         //interval->print(std::cout);
-        index_.WriteLock();
-        index_.insert(interval);
-        index_.WriteUnlock();
+        index->insert(interval);
     }
     //ShowIndex();
     //std::cout<<"Removed old intervals: ";
     for (auto &interval: old_intervals) {
         //interval->print(std::cout);
-        index_.WriteLock();
         // From the moment we remove it from nvm index, no more thread will access it.
         // Ref() is protected by read lock.
-        index_.remove(interval);
-        index_.WriteUnlock();
+        index->remove(interval);
+    }
+    index->WriteUnlock();
+    for (auto &interval: old_intervals) {
         interval->Unref();  // delete interval.
 #if defined(compact_debug)
         total_count += interval->get_table()->GetCount();
@@ -709,16 +1680,41 @@ void VersionSet::DoCompactionWork(const char *HotKey) {
 
 class NvmIterator: public Iterator {
 public:
+    // Where a stale iterator stood, see Stale().
+    enum ResumeMode {
+        kResumeFirst,       // at the first entry
+        kResumeLast,        // at the last entry
+        kResumeAtOrAfter,   // at the first entry >= resume_key()
+        kResumeAfter,       // at the first entry > resume_key()
+        kResumeAtOrBefore,  // at the last entry <= resume_key()
+        kResumeBefore       // at the last entry < resume_key()
+    };
+
+    // With a non-null map, index is a partition of it.
     explicit NvmIterator(const InternalKeyComparator& cmp,
                          VersionSet::Index* const index,
-                         VersionSet* const vs)
+                         VersionSet* const vs,
+                         const VersionSet::PartitionMap* map,
+                         const SliceTransform* prefix_extractor,
+                         const Slice* upper_bound,
+                         const Slice* lower_bound)
                         : iter_icmp(cmp),
                           helper_(index),
                           left(nullptr),
                           right(nullptr),
+                          unpinned_(0),
                           merge_iter(nullptr),
                           versions_(vs),
-                          overlaps(0) {
+                          map_(map),
+                          stale_(false),
+                          resume_mode_(kResumeFirst),
+                          overlaps(0),
+                          prefix_extractor_(prefix_extractor),
+                          prefix_seek_(false),
+                          upper_bound_(upper_bound),
+                          range_pruned_(false),
+                          lower_bound_(lower_bound),
+                          lower_pruned_(false) {
     }
 
     ~NvmIterator() {
@@ -738,25 +1734,70 @@ public:
 
     // k is internal key
     virtual void Seek(const Slice& k) {
-        if (merge_iter != nullptr &&
-        (left == nullptr || iter_icmp.Compare(k, GetLengthPrefixedSlice(left)) >= 0) &&
+        // intervals kept by last prefix seek may miss keys of another prefix.
+        if (prefix_extractor_ != nullptr && !SetPrefix(ExtractUserKey(k))) {
+            HelpSeek(EncodeKey(&tmp_, k), IterSeek);
+        } else if (merge_iter != nullptr && !range_pruned_ && !lower_pruned_ &&
+        // landing on left itself, Prev() would step out of the intervals
+        // unnoticed, as it shifts only when it reaches left.
+        (left == nullptr || iter_icmp.Compare(k, GetLengthPrefixedSlice(left)) > 0) &&
         (right == nullptr || iter_icmp.Compare(k, GetLengthPrefixedSlice(right)) <= 0)) {
             merge_iter->Seek(k);
         } else {
             HelpSeek(EncodeKey(&tmp_, k), IterSeek);
         }
+        // Seek may stop right at the border, Next() would cross it unnoticed.
+        if (Valid() && merge_iter->Raw() == right) {
+            HelpShift(right, IterNext);
+        }
+        // k may point into the intervals passed, release them only now.
+        ReleaseRetired();
     }
 
+    // Seek(k), filtering intervals by prefix only if prefix_seek, for
+    // PartitionIterator resuming where a stale iterator stood.
+    void ResumeSeek(const Slice& k, bool prefix_seek) {
+        if (prefix_seek) {
+            Seek(k);
+            return;
+        }
+        prefix_seek_ = false;
+        HelpSeek(EncodeKey(&tmp_, k), IterSeek);
+        if (Valid() && merge_iter->Raw() == right) {
+            HelpShift(right, IterNext);
+        }
+        ReleaseRetired();
+    }
+
+    // Whether the index was repartitioned under this iterator, which is
+    // left invalid where it would have moved across intervals.  It stood
+    // as resume_mode() tells, filtering by prefix if resume_prefix().
+    bool Stale() const { return stale_; }
+    ResumeMode resume_mode() const { return resume_mode_; }
+    const std::string& resume_key() const { return resume_key_; }
+    bool resume_prefix() const { return prefix_seek_; }
+
     virtual void SeekToFirst() {
+        prefix_seek_ = false;
         HelpSeekToFirst();
+        ReleaseRetired();
     }
 
     virtual void SeekToLast() {
+        prefix_seek_ = false;
         HelpSeekToLast();
+        ReleaseRetired();
     }
 
     virtual void Next() {
         assert(Valid());
+        if (lower_pruned_) {
+            ReopenAhead();
+            if (stale_) {
+                resume_mode_ = kResumeAfter;
+                return;
+            }
+        }
 
         //const char* before = merge_iter->Raw();
 
@@ -767,19 +1808,40 @@ public:
                                      GetLengthPrefixedSlice(merge_iter->Raw())) < 0);
         }*/
 
-        // reach the border and trigger a seek
+        // reach the border and shift intervals
         if (merge_iter->Valid() && merge_iter->Raw() == right) {
-            HelpSeek(right, IterNext);
+            HelpShift(right, IterNext);
         }
     }
 
+    virtual int NextBatch(Slice* keys, Slice* values, int n) {
+        return Fill(keys, values, n, nullptr, false);
+    }
+
+    virtual int NextBatchUntil(Slice* keys, Slice* values, int n,
+                               const Comparator* cmp, const Slice& limit,
+                               bool inclusive) {
+        // cmp orders keys as iter_icmp does.
+        (void)cmp;
+        return Fill(keys, values, n, &limit, inclusive);
+    }
+
     virtual void Prev() {
         assert(Valid());
+        if (range_pruned_) {
+            // intervals dropped by upper bound may hold keys before current one.
+            HelpSeek(EncodeKey(&tmp_, merge_iter->key()), IterPrev);
+            if (stale_) {
+                resume_mode_ = kResumeBefore;
+                return;
+            }
+            assert(merge_iter->Valid());
+        }
         merge_iter->Prev();
 
-        // reach the border and trigger a seek
+        // reach the border and shift intervals
         if (merge_iter->Valid() && merge_iter->Raw() == left) {
-            HelpSeek(left, IterPrev);
+            HelpShift(left, IterPrev);
         }
     }
 
@@ -799,17 +1861,82 @@ public:
     }
 
     virtual Status status() const {
-        return merge_iter->status();
+        return (merge_iter == nullptr) ? Status::OK() : merge_iter->status();
     }
 
     virtual void Abandon() {}
 
+    virtual void Unpin() {
+        for (size_t i = 0; i < unpinned_; i++) {
+            retired_[i]->Unref();
+        }
+        retired_.erase(retired_.begin(), retired_.begin() + unpinned_);
+        unpinned_ = retired_.size();
+    }
+
+    // Release every interval passed, as a seek does.
+    void ReleaseRetired() {
+        for (auto &interval : retired_) {
+            interval->Unref();
+        }
+        retired_.clear();
+        unpinned_ = 0;
+    }
+
 private:
 
+    // Take the read lock of the index, unless the index was repartitioned
+    // since this iterator was made.  Then retire everything, go stale
+    // standing at k as mode tells, and return false.
+    bool LockIndex(const Slice& k, const ResumeMode mode) {
+        helper_.ReadLock();
+        if (map_ == nullptr || versions_->map_.load(std::memory_order_acquire) == map_) {
+            return true;
+        }
+        helper_.ReadUnlock();
+        resume_key_.assign(k.data(), k.size());
+        resume_mode_ = mode;
+        stale_ = true;
+        Retire();
+        return false;
+    }
+
+    // Fill a batch from merge_iter, up to limit if not nullptr. A batch
+    // never runs past the next border, where merge_iter lacks the
+    // intervals starting there; it stops before it and shifts.
+    int Fill(Slice* keys, Slice* values, int n, const Slice* limit, bool inclusive) {
+        if (lower_pruned_ && Valid()) {
+            ReopenAhead();
+        }
+        int i = 0;
+        while (i < n && Valid()) {
+            if (right == nullptr) {
+                // no border ahead, or none before upper_bound_,
+                // merge_iter holds every key left.
+                if (limit == nullptr) {
+                    return i + merge_iter->NextBatch(keys + i, values + i, n - i);
+                }
+                return i + merge_iter->NextBatchUntil(keys + i, values + i, n - i,
+                                                      &iter_icmp, *limit, inclusive);
+            }
+            const Slice border = GetLengthPrefixedSlice(right);
+            if (limit != nullptr && iter_icmp.Compare(*limit, border) < 0) {
+                return i + merge_iter->NextBatchUntil(keys + i, values + i, n - i,
+                                                      &iter_icmp, *limit, inclusive);
+            }
+            i += merge_iter->NextBatchUntil(keys + i, values + i, n - i,
+                                            &iter_icmp, border, false);
+            if (merge_iter->Valid() && merge_iter->Raw() == right) {
+                HelpShift(right, IterNext);
+            }
+        }
+        return i;
+    }
+
     // target is internal key
     void HelpSeek(const char* k, const int iter_move) {
         assert(k != nullptr);
-        ReleaseAndClear();
+        Retire();
 /*
         std::cout<<"target: ";
         Decode(k, std::cout);
@@ -834,12 +1961,18 @@ private:
             std::cout<<std::endl;
         }
 */
-        helper_.ReadLock();
+        if (!LockIndex(GetLengthPrefixedSlice(k),
+                       (iter_move == IterPrev) ? kResumeAtOrBefore : kResumeAtOrAfter)) {
+            return;
+        }
         helper_.Seek(k, intervals, left, right, overlaps, iter_move);
         for (auto &interval : intervals) {
             interval->Ref();
         }
         helper_.ReadUnlock();
+        if (prefix_seek_ || Bounded(iter_move)) {
+            DropMismatch(ExtractUserKey(GetLengthPrefixedSlice(k)), iter_move);
+        }
         InitIterator();
 
         merge_iter->Seek(GetLengthPrefixedSlice(k));
@@ -848,9 +1981,56 @@ private:
         }
     }
 
+    // merge_iter stands on border k moving in iter_move. Instead of opening
+    // every interval again, keep the iterators of intervals still overlapping,
+    // release the ones left behind and open the ones just reached.
+    void HelpShift(const char* k, const int iter_move) {
+        assert(k != nullptr && merge_iter->Raw() == k);
+        if (!LockIndex(GetLengthPrefixedSlice(k),
+                       (iter_move == IterPrev) ? kResumeAtOrBefore : kResumeAtOrAfter)) {
+            return;
+        }
+        std::vector<interval*> olds;
+        olds.swap(intervals);
+        left = nullptr;
+        right = nullptr;
+        range_pruned_ = false;
+        lower_pruned_ = false;
+
+        helper_.Seek(k, intervals, left, right, overlaps, iter_move);
+        for (auto &interval : intervals) {
+            interval->Ref();
+        }
+        helper_.ReadUnlock();
+        const Slice key = GetLengthPrefixedSlice(k);
+        if (prefix_seek_ || Bounded(iter_move)) {
+            DropMismatch(ExtractUserKey(key), iter_move);
+        }
+
+        delete merge_iter;
+        ShiftIterators(olds, intervals, iterators, key, iter_move == IterPrev);
+        merge_iter = NewResumedMergingIterator(&iter_icmp, iterators.data(), iterators.size(),
+                                               iter_move == IterPrev);
+        // k and the keys before it live in olds. A batch read by NextBatch()
+        // or read ahead above may still point into them, hold them until
+        // the next seek or the second Unpin().
+        for (auto &interval : olds) {
+            if (std::find(intervals.begin(), intervals.end(), interval) != intervals.end()) {
+                interval->Unref();
+            } else {
+                retired_.push_back(interval);
+            }
+        }
+        if (merge_iter->Valid()) {
+            versions_->MaybeScheduleCompaction(merge_iter->Raw(), overlaps);
+        }
+    }
+
     void HelpSeekToFirst() {
-        ReleaseAndClear();
-        helper_.ReadLock();
+        Retire();
+        if (!LockIndex(Slice(), kResumeFirst)) {
+            return;
+        }
         helper_.SeekToFirst(intervals, left, right);
         for (auto &interval : intervals) {
             interval->Ref();
@@ -862,8 +2042,10 @@ private:
     }
 
     void HelpSeekToLast() {
-        ReleaseAndClear();
-        helper_.ReadLock();
+        Retire();
+        if (!LockIndex(Slice(), kResumeLast)) {
+            return;
+        }
         helper_.SeekToLast(intervals, left, right);
         for (auto &interval : intervals) {
             interval->Ref();
@@ -874,17 +2056,116 @@ private:
         //no reason to schedule compaction here.
     }
 
-    void ReleaseAndClear() {
+    // Close the intervals of the last search, keeping them in retired_
+    // for the entries already read from them.
+    void Retire() {
         delete merge_iter;
         merge_iter = nullptr;
         left = nullptr;
         right = nullptr;
+        range_pruned_ = false;
+        lower_pruned_ = false;
+        for (auto &iter : iterators) {
+            delete iter;
+        }
         iterators.clear();
-        // release the intervals in last search
+        retired_.insert(retired_.end(), intervals.begin(), intervals.end());
+        intervals.clear();
+    }
+
+    void ReleaseAndClear() {
+        Retire();
+        ReleaseRetired();
+    }
+
+    // Set prefix_ by user key of Seek target, return true iff prefix_seek_
+    // is unchanged, so the intervals kept can be reused.
+    bool SetPrefix(const Slice& ukey) {
+        assert(prefix_extractor_ != nullptr);
+        const bool was_prefix_seek = prefix_seek_;
+        if (!prefix_extractor_->InDomain(ukey)) {
+            prefix_seek_ = false;
+            return !was_prefix_seek;
+        }
+        Slice prefix = prefix_extractor_->Transform(ukey);
+        if (was_prefix_seek && prefix == Slice(prefix_)) {
+            return true;
+        }
+        prefix_.assign(prefix.data(), prefix.size());
+        prefix_seek_ = true;
+        return false;
+    }
+
+    // Intervals dropped by lower bound may hold keys after current one,
+    // open them again before moving forward.
+    void ReopenAhead() {
+        HelpSeek(EncodeKey(&tmp_, merge_iter->key()), IterSeek);
+        if (stale_) {
+            return;
+        }
+        assert(merge_iter->Valid());
+        if (merge_iter->Raw() == right) {
+            HelpShift(right, IterNext);
+        }
+    }
+
+    // Whether moving in iter_move is limited by a bound.
+    bool Bounded(const int iter_move) const {
+        return iter_move == IterPrev ? lower_bound_ != nullptr : upper_bound_ != nullptr;
+    }
+
+    inline Slice UserKey(const char* record) const {
+        return ExtractUserKey(GetLengthPrefixedSlice(record));
+    }
+
+    // Release the intervals that have nothing to offer: holding no key
+    // with prefix_, moving forward and holding no key in [ukey, upper_bound_),
+    // or moving backward and holding no key in [lower_bound_, ukey].
+    // Intervals owning left or right are kept, merge_iter must reach the
+    // borders to trigger the next HelpShift, unless the border lies past
+    // the bound, then no interval starting beyond the bound is opened.
+    void DropMismatch(const Slice& ukey, const int iter_move) {
+        const Comparator* ucmp = iter_icmp.user_comparator();
+        const bool upper_check = upper_bound_ != nullptr && iter_move != IterPrev;
+        const bool lower_check = lower_bound_ != nullptr && iter_move == IterPrev;
+        if (upper_check && right != nullptr &&
+            ucmp->Compare(UserKey(right), *upper_bound_) >= 0) {
+            right = nullptr;
+            range_pruned_ = true;
+        }
+        if (lower_check && left != nullptr &&
+            ucmp->Compare(UserKey(left), *lower_bound_) < 0) {
+            left = nullptr;
+            lower_pruned_ = true;
+        }
+        std::string limit;  // moving backward, the range ends at ukey inclusive.
+        if (lower_check) {
+            limit.assign(ukey.data(), ukey.size());
+            limit.push_back('\0');
+        }
+        const Slice limit_slice(limit);
+        size_t kept = 0;
         for (auto &interval : intervals) {
-            interval->Unref();
+            NvmMemTable* table = interval->get_table();
+            if (interval->inf() == right || interval->sup() == left) {
+                intervals[kept++] = interval;
+            } else if (prefix_seek_ && !table->PrefixMayMatch(prefix_)) {
+                interval->Unref();
+            } else if (upper_check &&
+                       (ucmp->Compare(UserKey(interval->inf()), *upper_bound_) >= 0 ||
+                        !table->RangeMayMatch(ukey, upper_bound_))) {
+                range_pruned_ = true;
+                interval->Unref();
+            } else if (lower_check &&
+                       (ucmp->Compare(UserKey(interval->sup()), *lower_bound_) < 0 ||
+                        !table->RangeMayMatch(*lower_bound_, &limit_slice))) {
+                lower_pruned_ = true;
+                interval->Unref();
+            } else {
+                intervals[kept++] = interval;
+            }
         }
-        intervals.clear();
+        intervals.resize(kept);
     }
 
     void InitIterator() {
@@ -895,7 +2176,7 @@ private:
         //std::cout<<std::endl;
 
         // no interval in index will make an EmptyIterator, Valid() returns false forever.
-        merge_iter = NewMergingIterator(&iter_icmp, &iterators[0], iterators.size());
+        merge_iter = NewResumedMergingIterator(&iter_icmp, iterators.data(), iterators.size(), false);
     }
 
     typedef VersionSet::Index::Interval interval;
@@ -907,16 +2188,33 @@ private:
     // updated by nvmSkipList's IterateHelper
     const char* left;   // nullptr indicates head_
     const char* right;  // nullptr indicates tail_
-    std::vector<interval*> intervals;
-    std::vector<Iterator*> iterators;
+    std::vector<interval*> intervals;   // referenced, one iterator each
+    std::vector<Iterator*> iterators;   // owned here, not by merge_iter
+    std::vector<interval*> retired_;    // referenced, passed since the last but one Unpin()
+    size_t unpinned_;                   // of retired_, passed before the last Unpin()
     Iterator* merge_iter;
 
     VersionSet* const versions_;
 
+    const VersionSet::PartitionMap* const map_;   // null if not partitioned
+    bool stale_;
+    ResumeMode resume_mode_;
+    std::string resume_key_;
+
     int overlaps;   // once fetch intervals, check if too much overlaps
 
     std::string tmp_;       // For passing to EncodeKey
 
+    // non-null iff ReadOptions::prefix_same_as_start
+    const SliceTransform* const prefix_extractor_;
+    bool prefix_seek_;      // whether intervals are filtered by prefix_
+    std::string prefix_;
+
+    const Slice* const upper_bound_;    // ReadOptions::iterate_upper_bound
+    bool range_pruned_;     // whether intervals are dropped by upper_bound_
+    const Slice* const lower_bound_;    // ReadOptions::iterate_lower_bound
+    bool lower_pruned_;     // whether intervals are dropped by lower_bound_
+
 
     // No copying allowed
     NvmIterator(const NvmIterator&);
@@ -924,8 +2222,599 @@ private:
 };
 
 
-Iterator* VersionSet::NewIterator() {
-    return new NvmIterator(icmp_, &index_, this);
+void VersionSet::PartitionRange(const Range& range, int n, std::vector<std::string>* splits) {
+    const PartitionMap* map = GetMap();
+    SweepSplits(map, range, n, splits);
+    ReturnMap(map);
+}
+
+void VersionSet::SweepSplits(const PartitionMap* map, const Range& range, int n,
+                             std::vector<std::string>* splits) {
+    splits->clear();
+    if (n <= 1) {
+        return;
+    }
+    const Comparator* ucmp = icmp_.user_comparator();
+    const bool bounded = !range.limit.empty();
+
+    // places to split, one per user key strictly inside range.
+    struct Border {
+        std::string ukey;
+        uint64_t kvs;   // KVs before ukey
+        int height;     // intervals cut by splitting at ukey
+    };
+    std::vector<Border> borders;
+    bool reach_start = false;
+    bool reach_limit = false;
+    uint64_t lower = 0;     // KVs before range.start
+    uint64_t upper = 0;     // KVs before range.limit
+    uint64_t total = 0;     // KVs of the partitions swept
+    for (auto &index : map->parts) {
+        total += index->Sweep([&](const char* key, uint64_t kvs, int height) {
+            if (reach_limit) {
+                return;
+            }
+            kvs += total;
+            const Slice ukey = ExtractUserKey(GetLengthPrefixedSlice(key));
+            if (ucmp->Compare(ukey, range.start) < 0) {
+                return;
+            }
+            if (!reach_start) {
+                reach_start = true;
+                lower = kvs;
+            }
+            if (bounded && ucmp->Compare(ukey, range.limit) >= 0) {
+                reach_limit = true;
+                upper = kvs;
+            } else if (ucmp->Compare(ukey, range.start) > 0 && kvs > lower &&
+                       (borders.empty() || ucmp->Compare(ukey, Slice(borders.back().ukey)) != 0)) {
+                borders.push_back(Border{ukey.ToString(), kvs, height});
+            }
+        });
+    }
+    if (!reach_limit) {
+        upper = total;
+    }
+    if (borders.empty() || upper <= lower) {
+        return;
+    }
+
+    // Around every i/n of KVs in range, split at the border cutting
+    // fewest intervals, as each cut interval is opened by both partitions.
+    const uint64_t width = (upper - lower) / n;
+    const uint64_t slack = width / 4;
+    auto distance = [](uint64_t a, uint64_t b) { return a > b ? a - b : b - a; };
+    size_t next = 0;
+    for (int i = 1; i < n; i++) {
+        const uint64_t target = lower + width * i;
+        while (next < borders.size() && borders[next].kvs + slack < target) {
+            next++;
+        }
+        if (next == borders.size()) {
+            break;
+        }
+        size_t best = next;
+        for (size_t j = next + 1; j < borders.size() && borders[j].kvs <= target + slack; j++) {
+            if (borders[j].height < borders[best].height ||
+                (borders[j].height == borders[best].height &&
+                 distance(borders[j].kvs, target) < distance(borders[best].kvs, target))) {
+                best = j;
+            }
+        }
+        splits->push_back(borders[best].ukey);
+        next = best + 1;
+    }
+}
+
+// Chains the iterators of the partitions of the index, which hold
+// ascending ranges of user keys.  Once the index is repartitioned, the
+// partition iterators go stale as they move on, then the partitions are
+// opened anew and the move resumed.
+class PartitionIterator : public Iterator {
+public:
+    PartitionIterator(VersionSet* vs, const SliceTransform* prefix_extractor,
+                      const Slice* upper_bound, const Slice* lower_bound)
+            : vs_(vs),
+              icmp_(vs->icmp_),
+              prefix_extractor_(prefix_extractor),
+              upper_bound_(upper_bound),
+              lower_bound_(lower_bound),
+              map_(nullptr),
+              unpinned_stale_(0),
+              current_(0) {
+        Open();
+    }
+
+    ~PartitionIterator() {
+        for (auto &child : children_) {
+            delete child;
+        }
+        ReleaseStale();
+        vs_->UnrefMap(map_);
+    }
+
+    virtual bool Valid() const {
+        return children_[current_]->Valid();
+    }
+
+    virtual void SeekToFirst() {
+        First();
+        ReleasePinned();
+    }
+
+    virtual void SeekToLast() {
+        Last();
+        ReleasePinned();
+    }
+
+    virtual void Seek(const Slice& target) {
+        SeekAt(target, true);
+        ReleasePinned();
+    }
+
+    virtual void Next() {
+        assert(Valid());
+        children_[current_]->Next();
+        if (!Resumed()) {
+            SkipForward();
+        }
+    }
+
+    virtual void Prev() {
+        assert(Valid());
+        children_[current_]->Prev();
+        if (!Resumed()) {
+            SkipBackward();
+        }
+    }
+
+    virtual Slice key() const { return children_[current_]->key(); }
+    virtual Slice value() const { return children_[current_]->value(); }
+    virtual const char* Raw() const { return children_[current_]->Raw(); }
+    virtual void Abandon() { children_[current_]->Abandon(); }
+
+    virtual void Unpin() {
+        for (auto &child : children_) {
+            child->Unpin();
+        }
+        for (size_t i = 0; i < unpinned_stale_; i++) {
+            delete stale_[i];
+        }
+        stale_.erase(stale_.begin(), stale_.begin() + unpinned_stale_);
+        unpinned_stale_ = stale_.size();
+    }
+
+    virtual Status status() const {
+        for (auto &child : children_) {
+            if (!child->status().ok()) {
+                return child->status();
+            }
+        }
+        return Status::OK();
+    }
+
+private:
+    typedef NvmIterator::ResumeMode ResumeMode;
+
+    // Open an iterator on each partition of the current map.  Stale
+    // iterators only compared their map with the current one, it need not
+    // outlive them.
+    void Open() {
+        if (map_ != nullptr) {
+            vs_->UnrefMap(map_);
+        }
+        map_ = vs_->RefMap();
+        for (auto &index : map_->parts) {
+            children_.push_back(new NvmIterator(icmp_, index, vs_, map_, prefix_extractor_,
+                                                upper_bound_, lower_bound_));
+        }
+        current_ = 0;
+    }
+
+    // The entries read from stale iterators are kept until the next seek
+    // or the second Unpin(), as NvmIterator keeps the intervals it shifted
+    // past.
+    void ReleaseStale() {
+        for (auto &child : stale_) {
+            delete child;
+        }
+        stale_.clear();
+        unpinned_stale_ = 0;
+    }
+
+    // After a seek only the current child holds entries still read, and
+    // it released the intervals it passed when seeking.
+    void ReleasePinned() {
+        for (auto &child : children_) {
+            if (child != children_[current_]) {
+                child->ReleaseRetired();
+            }
+        }
+        ReleaseStale();
+    }
+
+    void First() {
+        current_ = 0;
+        children_[current_]->SeekToFirst();
+        if (!Resumed()) {
+            SkipForward();
+        }
+    }
+
+    void Last() {
+        current_ = static_cast<int>(children_.size()) - 1;
+        children_[current_]->SeekToLast();
+        if (!Resumed()) {
+            SkipBackward();
+        }
+    }
+
+    void SeekAt(const Slice& target, bool prefix_seek) {
+        current_ = vs_->PartitionOf(map_, ExtractUserKey(target));
+        children_[current_]->ResumeSeek(target, prefix_seek);
+        if (!Resumed()) {
+            SkipForward();
+        }
+    }
+
+    // If the current partition iterator went stale, open the partitions
+    // of the new map and stand where it stood.  Return true iff so.
+    bool Resumed() {
+        NvmIterator* child = children_[current_];
+        if (!child->Stale()) {
+            return false;
+        }
+        ResumeMode mode = child->resume_mode();
+        std::string target = child->resume_key();
+        const bool prefix_seek = child->resume_prefix();
+        // The ends of a partition lie at its splits.
+        if (mode == NvmIterator::kResumeFirst && current_ > 0) {
+            target = InternalKey(map_->splits[current_ - 1], kMaxSequenceNumber,
+                                 kValueTypeForSeek).Encode().ToString();
+            mode = NvmIterator::kResumeAtOrAfter;
+        } else if (mode == NvmIterator::kResumeLast && current_ + 1 < static_cast<int>(children_.size())) {
+            target = InternalKey(map_->splits[current_], kMaxSequenceNumber,
+                                 kValueTypeForSeek).Encode().ToString();
+            mode = NvmIterator::kResumeBefore;
+        }
+        stale_.insert(stale_.end(), children_.begin(), children_.end());
+        children_.clear();
+        Open();
+
+        switch (mode) {
+            case NvmIterator::kResumeFirst:
+                First();
+                break;
+            case NvmIterator::kResumeLast:
+                Last();
+                break;
+            case NvmIterator::kResumeAtOrAfter:
+                SeekAt(target, prefix_seek);
+                break;
+            case NvmIterator::kResumeAfter:
+                SeekAt(target, prefix_seek);
+                if (Valid() && icmp_.Compare(key(), target) == 0) {
+                    Next();
+                }
+                break;
+            case NvmIterator::kResumeAtOrBefore:
+            case NvmIterator::kResumeBefore:
+                SeekAt(target, prefix_seek);
+                if (!Valid()) {
+                    Last();
+                } else if (mode == NvmIterator::kResumeBefore || icmp_.Compare(key(), target) > 0) {
+                    Prev();
+                }
+                break;
+        }
+        return true;
+    }
+
+    // Move on to the next partitions until one is valid, but not to those
+    // beyond the upper bound.
+    void SkipForward() {
+        while (!children_[current_]->Valid() && current_ + 1 < static_cast<int>(children_.size()) &&
+               (upper_bound_ == nullptr ||
+                icmp_.user_comparator()->Compare(Slice(map_->splits[current_]), *upper_bound_) < 0)) {
+            current_++;
+            children_[current_]->SeekToFirst();
+            if (Resumed()) {
+                return;
+            }
+        }
+    }
+
+    void SkipBackward() {
+        while (!children_[current_]->Valid() && current_ > 0 &&
+               (lower_bound_ == nullptr ||
+                icmp_.user_comparator()->Compare(Slice(map_->splits[current_ - 1]), *lower_bound_) > 0)) {
+            current_--;
+            children_[current_]->SeekToLast();
+            if (Resumed()) {
+                return;
+            }
+        }
+    }
+
+    VersionSet* const vs_;
+    const InternalKeyComparator icmp_;
+    const SliceTransform* const prefix_extractor_;
+    const Slice* const upper_bound_;
+    const Slice* const lower_bound_;
+    const VersionSet::PartitionMap* map_;   // children_ are opened on, referenced
+    std::vector<NvmIterator*> children_;
+    std::vector<NvmIterator*> stale_;
+    size_t unpinned_stale_;                 // of stale_, since before the last Unpin()
+    int current_;
+
+    // No copying allowed
+    PartitionIterator(const PartitionIterator&);
+    void operator=(const PartitionIterator&);
+};
+
+Iterator* VersionSet::NewIterator(const ReadOptions& options) {
+    const SliceTransform* prefix_extractor =
+            options.prefix_same_as_start ? options_->prefix_extractor : nullptr;
+    if (parts_.size() == 1) {
+        return new NvmIterator(icmp_, parts_[0], this, nullptr, prefix_extractor,
+                               options.iterate_upper_bound,
+                               options.iterate_lower_bound);
+    }
+    return new PartitionIterator(this, prefix_extractor,
+                                 options.iterate_upper_bound,
+                                 options.iterate_lower_bound);
+}
+
+
+// Yields the records a run is cut into, only what Transport() asks for.
+class RecordIterator : public Iterator {
+public:
+    explicit RecordIterator(const std::vector<char*>& records)
+            : records_(records), pos_(0) { }
+
+    virtual bool Valid() const { return pos_ < records_.size(); }
+    virtual void Seek(const Slice&) { }
+    virtual void SeekToFirst() { pos_ = 0; }
+    virtual void SeekToLast() { }
+    virtual void Next() { assert(Valid()); pos_++; }
+    virtual void Prev() { }
+    virtual Slice key() const { return GetLengthPrefixedSlice(records_[pos_]); }
+    virtual Slice value() const {
+        Slice key_slice = GetLengthPrefixedSlice(records_[pos_]);
+        return GetLengthPrefixedSlice(key_slice.data() + key_slice.size());
+    }
+    virtual const char* Raw() const { return records_[pos_]; }
+    virtual Status status() const { return Status::OK(); }
+    virtual void Abandon() { }
+
+private:
+    const std::vector<char*>& records_;
+    size_t pos_;
+
+    // No copying allowed
+    RecordIterator(const RecordIterator&);
+    void operator=(const RecordIterator&);
+};
+
+struct VersionSet::IngestRun {
+    VersionSet* vs;
+    Iterator* input;
+    SequenceNumber seq;
+    const std::vector<std::string>* splits;   // of the index, cut tables at
+    std::vector<NvmMemTable*> tables;   // in key order
+    Status status;
+};
+
+void VersionSet::IngestWork(void* arg) {
+    IngestRun* run = reinterpret_cast<IngestRun*>(arg);
+    run->vs->BuildRun(run);
+}
+
+void VersionSet::BuildRun(IngestRun* run) {
+    const Comparator* ucmp = icmp_.user_comparator();
+    Iterator* input = run->input;
+    std::vector<char*> records;
+    size_t bytes = 0;
+    Slice last_key;     // in records.back() or the last table
+    size_t split = 0;   // next split of the index
+
+    // Records in dram come from slabs, see NvmMemTable::Transport().
+    Arena* arena = options_->run_in_dram ? new Arena(true) : nullptr;
+
+    // Records are written once here and handed over to the table,
+    // Transport() does not copy them again.
+    auto cut = [&]() {
+        NvmMemTable* table = new NvmMemTable(icmp_, static_cast<int>(records.size()), *options_);
+        RecordIterator iter(records);
+        table->Transport(&iter, arena == nullptr, arena);
+        run->tables.push_back(table);
+        records.clear();
+        bytes = 0;
+    };
+
+    for (input->SeekToFirst(); input->Valid(); input->Next()) {
+        const Slice key = input->key();
+        const Slice value = input->value();
+        if ((!records.empty() || !run->tables.empty()) && ucmp->Compare(key, last_key) <= 0) {
+            run->status = Status::InvalidArgument("keys of a run are not ascending", key);
+            break;
+        }
+        // No table runs across a split.
+        while (split < run->splits->size() && ucmp->Compare(key, Slice((*run->splits)[split])) >= 0) {
+            if (!records.empty()) {
+                cut();
+            }
+            split++;
+        }
+        // Same format as MemTable::Add().
+        const size_t internal_key_size = key.size() + 8;
+        const size_t encoded_len =
+                VarintLength(internal_key_size) + internal_key_size +
+                VarintLength(value.size()) + value.size();
+        char* buf = (arena != nullptr) ? arena->Allocate(encoded_len) : new char[encoded_len];
+        if (buf == nullptr) {
+            run->status = Status::IOError("out of memory for ingested records");
+            break;
+        }
+        char* p = EncodeVarint32(buf, internal_key_size);
+        memcpy(p, key.data(), key.size());
+        last_key = Slice(p, key.size());
+        p += key.size();
+        EncodeFixed64(p, (run->seq << 8) | kTypeValue);
+        p += 8;
+        p = EncodeVarint32(p, value.size());
+        memcpy(p, value.data(), value.size());
+        assert(p + value.size() == buf + encoded_len);
+        records.push_back(buf);
+        bytes += encoded_len;
+        if (bytes >= options_->write_buffer_size) {
+            cut();
+        }
+    }
+    if (run->status.ok()) {
+        run->status = input->status();
+    }
+    if (run->status.ok() && !records.empty()) {
+        cut();
+    }
+    if (arena != nullptr) {
+        arena->Unref();     // frees the records left if no table took any
+    } else {
+        for (auto &record : records) {
+            delete[] record;
+        }
+    }
+}
+
+Status VersionSet::IngestRuns(Iterator** runs, int n, SequenceNumber seq) {
+    // Tables are cut at the splits of the index, which stay put until
+    // they are indexed.
+    MutexLock split_lock(&split_mutex_);
+    const PartitionMap* map = map_.load(std::memory_order_relaxed);
+
+    std::vector<IngestRun> states(n);
+    std::vector<void*> args(n);
+    for (int i = 0; i < n; i++) {
+        states[i].vs = this;
+        states[i].input = runs[i];
+        states[i].seq = seq;
+        states[i].splits = &map->splits;
+        args[i] = &states[i];
+    }
+    RunInPool(&VersionSet::IngestWork, args);
+
+    // Runs must not overlap each other, or the same user key would be
+    // ingested twice with the same sequence number.
+    Status s;
+    std::vector<IngestRun*> sorted;
+    for (auto &run : states) {
+        if (!run.status.ok()) {
+            if (s.ok()) s = run.status;
+        } else if (!run.tables.empty()) {
+            sorted.push_back(&run);
+        }
+    }
+    std::vector<std::pair<const char*, const char*>> bounds;   // first and last record
+    for (auto &run : sorted) {
+        for (auto &table : run->tables) {
+            Iterator* table_iter = table->NewIterator();
+            table_iter->SeekToFirst();  // O(1)
+            const char* lRaw = table_iter->Raw();
+            table_iter->SeekToLast();   // O(1)
+            const char* rRaw = table_iter->Raw();
+            delete table_iter;
+            bounds.push_back(std::make_pair(lRaw, rRaw));
+        }
+    }
+    if (s.ok()) {
+        std::vector<std::pair<const char*, const char*>> ranges;
+        size_t b = 0;
+        for (auto &run : sorted) {
+            ranges.push_back(std::make_pair(bounds[b].first, bounds[b + run->tables.size() - 1].second));
+            b += run->tables.size();
+        }
+        std::sort(ranges.begin(), ranges.end(),
+                  [this](const std::pair<const char*, const char*>& x,
+                         const std::pair<const char*, const char*>& y) {
+                      return index_cmp_(x.first, y.first) < 0;
+                  });
+        for (size_t i = 1; i < ranges.size(); i++) {
+            if (index_cmp_(ranges[i - 1].second, ranges[i].first, true) >= 0) {
+                s = Status::InvalidArgument("sorted runs overlap");
+                break;
+            }
+        }
+    }
+    if (!s.ok()) {
+        for (auto &run : states) {
+            for (auto &table : run.tables) {
+                table->Destroy(true);
+            }
+        }
+        return s;
+    }
+    if (bounds.empty()) {
+        return s;
+    }
+
+    std::vector<interval*> new_intervals;
+    std::vector<int> parts;     // of new_intervals
+    std::vector<uint64_t> entries(map->parts.size(), 0);
+    size_t b = 0;
+    for (auto &run : sorted) {
+        for (auto &table : run->tables) {
+            const int p = PartitionOf(map, ExtractUserKey(GetLengthPrefixedSlice(bounds[b].first)));
+            new_intervals.push_back(map->parts[p]->generate(bounds[b].first, bounds[b].second, table, 0));
+            parts.push_back(p);
+            entries[p] += table->GetCount();
+            writes_ += table->GetCount();
+            build_tables_ ++;
+            b++;
+        }
+    }
+
+    // Readers see either none or all of the runs.
+    // Partitions are locked in order, nobody else holds two at once.
+    for (size_t p = 0; p < map->parts.size(); p++) {
+        if (entries[p] != 0) {
+            map->parts[p]->WriteLock();
+        }
+    }
+    for (size_t i = 0; i < new_intervals.size(); i++) {
+        if (!map->parts[parts[i]]->append(new_intervals[i])) {
+            map->parts[parts[i]]->insert(new_intervals[i]);
+        }
+    }
+    for (size_t p = 0; p < map->parts.size(); p++) {
+        if (entries[p] != 0) {
+            map->parts[p]->WriteUnlock();
+        }
+    }
+
+    // Runs may pile up on intervals already in nvm, as in BuildTable().
+    const char* HotKey = nullptr;
+    int overlaps = 0;
+    for (size_t i = 0; i < new_intervals.size(); i++) {
+        Index* const index = map->parts[parts[i]];
+        index->ReadLock();
+        int lCount = index->stab(new_intervals[i]->inf());
+        int rCount = index->stab(new_intervals[i]->sup());
+        index->ReadUnlock();
+        if (lCount > overlaps) {
+            HotKey = new_intervals[i]->inf();
+            overlaps = lCount;
+        }
+        if (rCount > overlaps) {
+            HotKey = new_intervals[i]->sup();
+            overlaps = rCount;
+        }
+    }
+    AddPartitionEntries(entries);
+    if (HotKey != nullptr) {
+        MaybeScheduleCompaction(HotKey, overlaps);
+    }
+
+    return s;
 }
 
 
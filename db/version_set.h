@@ -6,12 +6,16 @@
 #define SOFTDB_VERSION_SET_H
 
 
+#include <atomic>
+#include <deque>
 #include "port/port.h"
+#include "softdb/db.h"
 #include "softdb/env.h"
 #include "dbformat.h"
 #include "softdb/iterator.h"
 #include "nvm_index.h"
 #include "snapshot.h"
+#include "util/thread_local.h"
 
 namespace softdb {
 
@@ -43,6 +47,7 @@ public:
                port::Mutex& mu,
                port::AtomicPointer& shutdown,
                SnapshotList& snapshots,
+               port::Mutex& snapshots_mu,
                Status& bg_error,
                bool& nvm_compaction_scheduled,
                port::CondVar& nvm_signal);
@@ -62,13 +67,16 @@ public:
         }
     }
 
-    // Return the last sequence number.
-    uint64_t LastSequence() const { return last_sequence_; }
+    // Return the last sequence number.  Safe to call without mutex_,
+    // the writes up to it are visible then.
+    uint64_t LastSequence() const {
+        return last_sequence_.load(std::memory_order_acquire);
+    }
 
     // Set the last sequence number to s.
     void SetLastSequence(uint64_t s) {
-        assert(s >= last_sequence_);
-        last_sequence_ = s;
+        assert(s >= LastSequence());
+        last_sequence_.store(s, std::memory_order_release);
     }
 
     // Mark the specified file number as used.
@@ -86,13 +94,15 @@ public:
     void SetPreLogNumber(uint64_t num) { prev_log_number_ = num; }
 
     // Return the last timestamp number.
-    uint64_t NextTimestamp() const { return index_.NextTimestamp(); }
+    uint64_t NextTimestamp() const;
 
 
     // Build an Nvm Table from the contents of *iter. The generated table
     // will be marked according to timestamp_.
     // If no data is present in *iter, no Table will be produced.
-    Status BuildTable(Iterator* iter, int count);
+    // If arena is non-null, the records of *iter are allocated from it
+    // and the table takes them over instead of copying them.
+    Status BuildTable(Iterator* iter, int count, Arena* arena = nullptr);
 
     void Get(const LookupKey &key, std::string *value, Status *s);
 
@@ -114,11 +124,42 @@ public:
     // The data iterator is travelling is protected by a snapshot created alongside iterator.
     // In other words, the data seen by iterator is a snapshot.
     //
-    Iterator* NewIterator();
+    // With options.prefix_same_as_start, Seek only merges the intervals
+    // which may hold the target's prefix. With options.iterate_upper_bound,
+    // moving forward only merges the intervals which may hold a key below
+    // the bound, likewise options.iterate_lower_bound moving backward.
+    Iterator* NewIterator(const ReadOptions& options);
+
+    // Split user keys in [range.start, range.limit) into at most n partitions
+    // holding about the same number of KVs of nvm_imm_s at interval borders,
+    // see DB::PartitionRange().
+    void PartitionRange(const Range& range, int n, std::vector<std::string>* splits);
+
+    // Build intervals straight from runs[0..n-1], which yield user keys,
+    // giving every entry sequence number seq, then put them all into the
+    // index under one write lock, see DB::IngestSortedRuns().
+    // Each run is built by a thread of its own.
+    // REQUIRES: no imm_ is being built into an interval meanwhile.
+    Status IngestRuns(Iterator** runs, int n, SequenceNumber seq);
+
+    // Counts of the nvm data written and read, from which the write and
+    // read amplification of Options::merge_policy follow.
+    struct MergeStats {
+        uint64_t flushed;       // entries built into nvm by flushes and ingests
+        uint64_t merged;        // entries written by merges
+        uint64_t merges;        // number of merges
+        uint64_t gets;          // number of point queries
+        uint64_t probes;        // intervals probed by the point queries
+    };
+
+    // Safe to call without mutex_, the counts may lag behind a little.
+    void GetMergeStats(MergeStats* stats) const;
 
     void ShowIndex() const {
-        index_.print(std::cout);
-        index_.printOrdered(std::cout);
+        for (auto &index : parts_) {
+            index->print(std::cout);
+            index->printOrdered(std::cout);
+        }
     };
 
 private:
@@ -131,29 +172,99 @@ private:
 
     void BackgroundCompaction(const char* HotKey);
 
+    // Have the merge thread repartition the index once it is free.
+    // REQUIRES: mutex_ held.
+    void MaybeScheduleRepartition();
+
     void DoCompactionWork(const char* HotKey);
 
+    // With Options::max_subcompactions a big merge is split into key
+    // ranges, see SplitCompaction().  The merge thread merges one of them
+    // and hands the others to subcompactions_-1 threads started with
+    // the VersionSet, which wait in SubCompactionLoop() in between.
+    // Sorted runs are ingested by the same threads.
+    struct SubCompaction;
+    struct PoolTask;
+
+    static void SubCompactionWork(void* vs);
+    void SubCompactionLoop();
+
+    // Call function(args[i]) for every i, the first on this thread and the
+    // others on the pool, and wait until all are done.  The thread takes
+    // queued tasks itself while it waits, so it works with no pool too.
+    void RunInPool(void (*function)(void*), const std::vector<void*>& args);
+
+    // REQUIRES: sub_mutex_ held and sub_queue_ not empty.
+    void RunPoolTask();
+
+    static void SubCompactionTask(void* sub);
+    void RunSubCompaction(SubCompaction* sub);
+
+    struct IngestRun;
+
+    static void IngestWork(void* run);
+
+    // Intervals retired from index_ are destroyed by a reclaimer thread,
+    // so a reader dropping the last reference of a merged interval does
+    // not pay for freeing its table, nor for a partition map it held the
+    // last reference of.  With Options::flat_index the same thread
+    // rebuilds the flat copy of index_ after flushes and merges.
+    static void WakeReclaimer(void* vs);
+    static void ReclaimWork(void* vs);
+    void ReclaimLoop();
+
+    // Cut run->input into tables of about write_buffer_size bytes,
+    // and at the splits of the index.
+    void BuildRun(IngestRun* run);
+
     Env* const env_;
     port::Mutex& mutex_;
     port::AtomicPointer& shutting_down_;
-    SnapshotList& snapshots_;
+    SnapshotList& snapshots_;       // protected by snapshots_mutex_
+    port::Mutex& snapshots_mutex_;
     Status& bg_error_;
     const std::string dbname_;
     const Options* const options_;
     const InternalKeyComparator icmp_;
     uint64_t next_file_number_;
-    uint64_t last_sequence_;
-    uint64_t writes_;
-    uint64_t build_tables_;
+    std::atomic<uint64_t> last_sequence_;
+    std::atomic<uint64_t> writes_;          // read by GetMergeStats() from any thread
+    std::atomic<uint64_t> build_tables_;
     uint64_t drops_;
     uint64_t peak_height_;
-    uint64_t merges_;
-    uint64_t merge_latency_;
+    std::atomic<uint64_t> merges_;          // added to by every subcompaction
+    std::atomic<uint64_t> merge_latency_;
+    std::atomic<uint64_t> merged_;
+    std::atomic<uint64_t> merge_runs_;
+    std::atomic<uint64_t> gets_;
+    std::atomic<uint64_t> probes_;
     uint64_t log_number_;
     uint64_t prev_log_number_;  // 0 or backing store for memtable being compacted
     bool& nvm_compaction_scheduled_; // protected by mutex_
+    // Options::merge_policy left the intervals stacked on this user key
+    // alone when readers saw them this many high, so readers seeing no
+    // more do not wake the merge thread for nothing again.
+    int hot_overlaps_;              // protected by mutex_, of the merge scheduled
+    std::string rejected_key_;      // protected by mutex_
+    int rejected_overlaps_;         // protected by mutex_
+    // writes_ when the last merge started, and the entries it rewrote.
+    uint64_t merge_writes_;         // protected by mutex_
+    uint64_t merge_entries_;        // protected by mutex_
     port::CondVar& nvm_signal;
 
+    port::Mutex reclaim_mutex_;
+    port::CondVar reclaim_cv_;
+    bool reclaim_pending_;          // protected by reclaim_mutex_
+    bool reclaim_shutdown_;         // protected by reclaim_mutex_
+    bool reclaimer_running_;        // protected by reclaim_mutex_
+
+    const int subcompactions_;      // most key ranges a merge is split into
+    port::Mutex sub_mutex_;
+    port::CondVar sub_cv_;
+    std::deque<PoolTask*> sub_queue_;       // protected by sub_mutex_
+    int sub_workers_;               // protected by sub_mutex_
+    bool sub_shutdown_;             // protected by sub_mutex_
+
     struct KeyComparator {
         const InternalKeyComparator comparator;
         explicit KeyComparator(const InternalKeyComparator& c) : comparator(c) { }
@@ -162,13 +273,84 @@ private:
 
     friend class NvmIterator;
     friend class CompactIterator;
+    friend class PartitionIterator;
 
     typedef IntervalSkipList<const char*, KeyComparator> Index;
     typedef Index::Interval interval;
     KeyComparator index_cmp_;
-    Index index_;   // synchronize rw threads by read-write lock
 
-    interval* BuildInterval(Iterator* iter, int count, Status *s, uint64_t timestamp = 0);
+    // The nvm index is split by user key into at most
+    // Options::index_partitions partitions, each synchronizing rw threads by
+    // a read-write lock of its own.  No interval runs across a split, so a
+    // flush or merge in one partition never blocks readers of another.
+    // The index starts as one partition and is repartitioned by the merge
+    // thread as data grows, see Repartition().
+    struct PartitionMap {
+        PartitionMap() : refs(1) { }
+        std::vector<std::string> splits;    // ascending user keys
+        std::vector<Index*> parts;          // parts[i] holds [splits[i-1], splits[i])
+        mutable std::atomic<int> refs;      // map_ holds one until replaced
+    };
+    std::vector<Index*> parts_;             // every index, in a partition or not
+    std::atomic<const PartitionMap*> map_;
+    port::Mutex map_mutex_;                 // held while map_ is referenced or replaced
+    // map_ as referenced by each thread reading, so a read takes no lock,
+    // taken back by Repartition() when it replaces map_.
+    ThreadLocalPtr local_map_;
+    std::vector<const PartitionMap*> retired_maps_; // protected by reclaim_mutex_
+    port::Mutex split_mutex_;               // held while tables are cut at the splits
+    std::vector<uint64_t> part_entries_;    // protected by split_mutex_, of map_ partitions
+    uint64_t repartition_entries_;          // protected by split_mutex_
+    std::atomic<bool> repartition_pending_;
+
+    // Return the partition of map holding user_key.
+    int PartitionOf(const PartitionMap* map, const Slice& user_key) const;
+
+    // Drops the map cached by an exiting thread in local_map_.
+    static void ReleaseCachedMap(void* ptr);
+
+    // Return map_ referenced, taking no lock unless it was replaced since
+    // the calling thread last read it.  Hand it back by ReturnMap().
+    const PartitionMap* GetMap();
+    void ReturnMap(const PartitionMap* map);
+
+    // Return map_ referenced, to be held for long, as iterators do.
+    const PartitionMap* RefMap();
+
+    // Drop a reference of map.  A map no longer referenced is destroyed
+    // by the reclaimer, as it is no longer map_ either.
+    void UnrefMap(const PartitionMap* map);
+
+    // Return the index holding user_key, read locked.
+    Index* LockPartition(const Slice& user_key);
+
+    // Sweep the partitions of map for n partitions of about the same
+    // number of KVs within range, see PartitionRange().
+    void SweepSplits(const PartitionMap* map, const Range& range, int n,
+                     std::vector<std::string>* splits);
+
+    // Count the entries a flush or ingest put into the partitions of map_,
+    // and have the index repartitioned if they grew out of balance.
+    // REQUIRES: split_mutex_ held.
+    void AddPartitionEntries(const std::vector<uint64_t>& entries);
+
+    // Return the number of partitions the index is best split into.
+    int PartitionsWanted() const;
+
+    // Split the index again at about equal numbers of entries.
+    // Only the merge thread calls it.
+    // REQUIRES: split_mutex_ not held.
+    void Repartition();
+
+    interval* CutInterval(Index* index, interval* I,
+                          const std::string* lower, const std::string* upper);
+
+    interval* BuildInterval(Index* index, Iterator* iter, int count, Status *s,
+                            uint64_t timestamp = 0, Arena* arena = nullptr);
+
+    void SplitCompaction(Index* index, const char* left, const char* right,
+                         uint64_t time_low, uint64_t time_up, uint64_t avg_count,
+                         std::vector<const char*>* untils);
 
     // No copying allowed
     VersionSet(const VersionSet&);
@@ -125,13 +125,18 @@ namespace softdb {
         public:
             SequenceNumber sequence_;
             MemTable* mem_;
+            bool full_;     // the memtable arena ran out of memory
 
             virtual void Put(const Slice& key, const Slice& value) {
-                mem_->Add(sequence_, kTypeValue, key, value);
+                if (!mem_->Add(sequence_, kTypeValue, key, value)) {
+                    full_ = true;
+                }
                 sequence_++;
             }
             virtual void Delete(const Slice& key) {
-                mem_->Add(sequence_, kTypeDeletion, key, Slice());
+                if (!mem_->Add(sequence_, kTypeDeletion, key, Slice())) {
+                    full_ = true;
+                }
                 sequence_++;
             }
             void Count(int insert) {
@@ -145,7 +150,36 @@ namespace softdb {
         MemTableInserter inserter;
         inserter.sequence_ = WriteBatchInternal::Sequence(b);
         inserter.mem_ = memtable;
-        return b->Iterate(&inserter);
+        inserter.full_ = false;
+        Status s = b->Iterate(&inserter);
+        if (s.ok() && inserter.full_) {
+            s = Status::IOError("out of memory for memtable records");
+        }
+        return s;
+    }
+
+    namespace {
+        class KeyCollector : public WriteBatch::Handler {
+        public:
+            WriteBatch* dst_;
+
+            virtual void Put(const Slice& key, const Slice&) {
+                dst_->Delete(key);
+            }
+            virtual void Delete(const Slice& key) {
+                dst_->Delete(key);
+            }
+            void Count(int) { }
+        };
+    }  // namespace
+
+    void WriteBatchInternal::KeysAsDeletions(const WriteBatch* b,
+                                             WriteBatch* dst) {
+        KeyCollector collector;
+        collector.dst_ = dst;
+        dst->Clear();
+        b->Iterate(&collector);
+        SetSequence(dst, Sequence(b));
     }
 
     void WriteBatchInternal::SetContents(WriteBatch* b, const Slice& contents) {
@@ -43,6 +43,10 @@ namespace softdb {
         static Status InsertInto(const WriteBatch* batch, MemTable* memtable);
 
         static void Append(WriteBatch* dst, const WriteBatch* src);
+
+        // Set "dst" to a deletion of every key "batch" writes, under the
+        // same sequence numbers.
+        static void KeysAsDeletions(const WriteBatch* batch, WriteBatch* dst);
     };
 
 }  // namespace softdb
@@ -7,6 +7,8 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string>
+#include <vector>
 #include "export.h"
 #include "options.h"
 #include "iterator.h"
@@ -106,6 +108,48 @@ namespace softdb {
             // use "snapshot" after this call.
             virtual void ReleaseSnapshot(const Snapshot* snapshot) = 0;
 
+            // Split the keys in [range.start, range.limit) into at most n
+            // partitions holding about the same number of entries, so that
+            // n threads can scan them concurrently.  An empty range.limit
+            // means no upper limit.
+            //
+            // Stores the split keys in ascending order in *splits, partition i
+            // covers [splits[i-1], splits[i]), taking range.start as splits[-1]
+            // and range.limit as splits[splits->size()].  Fewer than n-1 keys
+            // are stored if there are not so many places to split.
+            //
+            // Splits are picked at borders of the data intervals in nvm, and
+            // borders few intervals run across are preferred.  Entries still
+            // in memtables are not taken into account.
+            //
+            // Each thread scans its partition with its own iterator: share one
+            // snapshot from GetSnapshot() in ReadOptions::snapshot, set
+            // ReadOptions::iterate_upper_bound to the limit of the partition,
+            // and Seek() to its start.
+            virtual void PartitionRange(const Range& range, int n,
+                                        std::vector<std::string>* splits) = 0;
+
+            // Load n sorted runs of entries straight into nvm, bypassing the
+            // log and the memtable, to fill a DB much faster than Put() does.
+            //
+            // runs[i] must yield its keys in strictly ascending order and the
+            // key ranges of different runs must not overlap, otherwise an
+            // InvalidArgument status is returned and nothing is loaded.  All
+            // entries share one new sequence number, so they overwrite older
+            // values of their keys.  The memtable is flushed first if it is
+            // not empty.  Writes wait until the runs are loaded, and readers
+            // see the runs only once all of them are loaded.
+            //
+            // Runs are built by the calling thread together with the threads
+            // of Options::max_subcompactions, so split a big input into
+            // several runs.  The caller keeps ownership of runs[i].
+            virtual Status IngestSortedRuns(Iterator** runs, int n) = 0;
+
+            // Write the memtable into nvm and wait until it is done, so
+            // writes made with WriteOptions::disable_wal before the call
+            // survive a crash.  Does nothing if the memtable is empty.
+            virtual Status FlushMemTable() = 0;
+
             // DB implementations can export properties about their state
             // via this method.  If "property" is a valid property understood by this
             // DB implementation, fills "*value" with its current value and returns
@@ -114,19 +158,11 @@ namespace softdb {
             //
             // Valid property names include:
             //
-            //  "softdb.num-files-at-level<N>" - return the number of files at level <N>,
-            //     where <N> is an ASCII representation of a level number (e.g. "0").
             //  "softdb.stats" - returns a multi-line string that describes statistics
-            //     about the internal operation of the DB.
-            //  "softdb.sstables" - returns a multi-line string that describes all
-            //     of the sstables that make up the db contents.
-            //  "softdb.approximate-memory-usage" - returns the approximate number of
-            //     bytes of memory in use by the DB.
-            /**
-             *
-             *
-             * */
-            //virtual bool GetProperty(const Slice& property, std::string* value) = 0;
+            //     about the internal operation of the DB: memtable usage, and the
+            //     footprint and fragmentation of the slabs records are kept in with
+            //     Options::run_in_dram.
+            virtual bool GetProperty(const Slice& property, std::string* value) = 0;
 
             // For each i in [0,n-1], store in "sizes[i]", the approximate
             // file system space used by keys in "[range[i].start .. range[i].limit)".
@@ -83,6 +83,39 @@ namespace softdb {
             virtual Status NewAppendableFile(const std::string& fname,
             WritableFile** result);
 
+            // Create an object that writes to the file with the specified name
+            // through a mapping of its first "size" bytes into memory, so that
+            // Append() is a copy without any syscall and grows the file if it
+            // runs past them.  Where the file can be mapped with MAP_SYNC
+            // (persistent memory with DAX), Sync() writes the appended data
+            // back from the CPU caches with a fence instead of calling
+            // fdatasync(); elsewhere it calls msync() on the appended pages.
+            // The bytes not appended read as zeros.
+            //
+            // An existing file with the same name is not deleted, its pages
+            // are zeroed and reused in place, to recycle a preallocated file.
+            //
+            // The returned file will only be accessed by one thread at a time.
+            //
+            // May return an IsNotSupportedError error if this Env does
+            // not support mapped files.
+            virtual Status NewMappedWritableFile(const std::string& fname, size_t size,
+            WritableFile** result);
+
+            // Create an object that reads the file with the specified name
+            // through a mapping of all of it into memory.  Read() returns
+            // slices into the mapping, which stay valid as long as the object,
+            // and never touches scratch, so a caller may pass nullptr.  Unlike
+            // NewRandomAccessFile(), this never falls back to reading into
+            // scratch.
+            //
+            // The returned file may be concurrently accessed by multiple threads.
+            //
+            // May return an IsNotSupportedError error if this Env does
+            // not support mapped files.
+            virtual Status NewMappedReadableFile(const std::string& fname,
+            RandomAccessFile** result);
+
             // Returns true iff the named file exists.
             virtual bool FileExists(const std::string& fname) = 0;
 
@@ -303,6 +336,12 @@ return target_->NewWritableFile(f, r);
 Status NewAppendableFile(const std::string& f, WritableFile** r) override {
 return target_->NewAppendableFile(f, r);
 }
+Status NewMappedWritableFile(const std::string& f, size_t n, WritableFile** r) override {
+return target_->NewMappedWritableFile(f, n, r);
+}
+Status NewMappedReadableFile(const std::string& f, RandomAccessFile** r) override {
+return target_->NewMappedReadableFile(f, r);
+}
 bool FileExists(const std::string& f) override {
 return target_->FileExists(f);
 }
@@ -11,6 +11,8 @@
 
 namespace softdb {
 
+class Comparator;
+
 class SOFTDB_EXPORT Iterator {
         public:
         Iterator();
@@ -47,6 +49,30 @@ class SOFTDB_EXPORT Iterator {
         // REQUIRES: Valid()
         virtual void Prev() = 0;
 
+        // Fill keys[0,n) and values[0,n) with the current entry and the
+        // entries after it, leaving the iterator past the last one filled.
+        // Return the number of entries filled, less than n iff the iterator
+        // is no longer Valid().  The underlying storage for the returned
+        // slices stays valid until the next seek or the second Unpin()
+        // after the call, so a caller may gather several batches.
+        //
+        // Equivalent to calling key(), value() and Next() up to n times,
+        // but a scan pays one virtual call per batch instead of three per
+        // entry.
+        virtual int NextBatch(Slice* keys, Slice* values, int n);
+
+        // Same as NextBatch(), but stop at the first entry whose key comes
+        // after limit by cmp, or at limit itself unless inclusive.  Lets a
+        // merge copy a run of one child up to the key of the next child
+        // without comparing them again per entry.
+        virtual int NextBatchUntil(Slice* keys, Slice* values, int n,
+                                   const Comparator* cmp, const Slice& limit,
+                                   bool inclusive);
+
+        // Let the iterator free the storage of the entries it returned
+        // before the previous Unpin(), see NextBatch().
+        virtual void Unpin() { }
+
         // Return the key for the current entry.  The underlying storage for
         // the returned slice is valid only until the next modification of
         // the iterator.
@@ -65,6 +91,10 @@ class SOFTDB_EXPORT Iterator {
         // Set key's status obsolete.
         virtual void Abandon() = 0;
 
+        // Return true if the raw data may be copied elsewhere and the
+        // original abandoned, false if it is referred to by address.
+        virtual bool Movable() const { return false; }
+
         // If an error has occurred, return it.  Else return an ok status.
         virtual Status status() const = 0;
 
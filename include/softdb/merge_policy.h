@@ -0,0 +1,49 @@
+//
+// Created by lingo on 19-6-3.
+//
+
+#ifndef SOFTDB_MERGE_POLICY_H
+#define SOFTDB_MERGE_POLICY_H
+
+
+#include <stdint.h>
+#include "export.h"
+
+namespace softdb {
+
+// A MergePolicy decides how much of the nvm data piled up at a hot key
+// a merge rewrites. softdb asks it once the intervals holding the key
+// reach Options::max_overlap, and merges the newest ones it picks along
+// with every interval of the same age overlapping them. A MergePolicy
+// implementation must be thread-safe since softdb may invoke its methods
+// concurrently from multiple threads.
+    class SOFTDB_EXPORT MergePolicy {
+    public:
+        virtual ~MergePolicy();
+
+        // The name of the policy.
+        virtual const char* Name() const = 0;
+
+        // sizes[0..n-1] are the numbers of entries of the intervals
+        // holding the hot key, newest first. Return how many of the
+        // newest to merge, fewer than 2 leaves them all alone.
+        virtual int Pick(const uint64_t* sizes, int n) const = 0;
+    };
+
+// Return a size-tiered MergePolicy: starting from the newest interval,
+// it takes in the next older one as long as that is at most size_ratio
+// times the entries taken so far, so a small fresh interval never drags
+// a big merged one along.
+// The caller should delete the result when it is no longer needed.
+    SOFTDB_EXPORT const MergePolicy* NewTieredMergePolicy(double size_ratio);
+
+// Return a leveled MergePolicy: the oldest interval at the key is merged
+// with the newer ones only when they hold at least 1/size_ratio of its
+// entries, till then the newer ones are merged among themselves.
+// The caller should delete the result when it is no longer needed.
+    SOFTDB_EXPORT const MergePolicy* NewLeveledMergePolicy(double size_ratio);
+
+}  // namespace softdb
+
+
+#endif //SOFTDB_MERGE_POLICY_H
@@ -22,6 +22,12 @@ namespace softdb {
 
     class Logger;
 
+    class MergePolicy;
+
+    class Slice;
+
+    class SliceTransform;
+
     class Snapshot;
 
 // DB contents are stored in a set of blocks, each of which holds a
@@ -35,6 +41,15 @@ namespace softdb {
         kSnappyCompression = 0x1
     };
 
+// Filter built by each nvm_imm_ to skip it on Get when use_cuckoo is false.
+    enum NvmFilterType {
+        // Dynamic cuckoo filter, ~1.05 * filter_bits bits per key.
+        kCuckooFilter = 0x0,
+        // Static xor filter, ~1.23 * filter_bits bits per key,
+        // built once all keys of nvm_imm_ are known.
+        kXorFilter = 0x1
+    };
+
 // Options to control the behavior of a database (passed to DB::Open)
     struct SOFTDB_EXPORT Options {
         // -------------------
@@ -167,6 +182,29 @@ namespace softdb {
         // Default: currently false, but may become true later.
         bool reuse_logs;
 
+        // If true, log records are written into preallocated log files mapped
+        // into memory, so a write does no syscall, and a write with
+        // WriteOptions::sync writes back the CPU cache lines of its records
+        // instead of calling fdatasync() if the db lives on persistent memory
+        // mapped with DAX, elsewhere it calls msync().  Log files are recycled
+        // instead of deleted once their memtables are written into nvm.
+        // If the Env does not support mapped files, logs are written as usual.
+        //
+        // Default: false
+        bool use_mmap_log;
+
+        // If true, the leader of a write group hands the log over to the next
+        // group as soon as its records are appended, and inserts them into
+        // the memtable while the next group is being logged.  Groups are
+        // still inserted, and made visible to readers, in the order they
+        // are logged.  A group is synced once if any of its writers sets
+        // WriteOptions::sync, so sync and non-sync writes share fdatasync().
+        // Ignored, with a note in info_log, if std::thread::hardware_concurrency()
+        // reports a single CPU: the groups would only take turns on it.
+        //
+        // Default: false
+        bool pipelined_write;
+
         // If non-null, use the specified filter policy to reduce disk reads.
         // Many applications will benefit from passing the result of
         // NewBloomFilterPolicy() here.
@@ -183,17 +221,106 @@ namespace softdb {
         // Default: true
         bool use_cuckoo;
 
+        // Filter of nvm_imm_ when use_cuckoo is false.
+        //
+        // Default: kCuckooFilter
+        NvmFilterType filter_type;
+
+        // Fingerprint width in bits of filter_type, rounded up to a width
+        // supported by the filter (cuckoo: 8/12/16/32, xor: 8/16/32).
+        // False positive rate is about 2^-filter_bits, fewer bits
+        // save memory at the cost of more useless probes.
+        //
+        // Default: 32
+        int filter_bits;
+
+        // If non-null, each nvm_imm_ records the prefixes of its user keys
+        // with a prefix filter, a seek with ReadOptions::prefix_same_as_start
+        // skips the nvm_imm_s holding no key of the target's prefix.
+        //
+        // Default: nullptr
+        const SliceTransform* prefix_extractor;
+
+        // If true, each nvm_imm_ builds a range filter over its user keys,
+        // an iterator with ReadOptions::iterate_upper_bound skips the
+        // nvm_imm_s holding no key in [seek target, upper bound), and one
+        // with ReadOptions::iterate_lower_bound moving backward skips those
+        // holding no key in [lower bound, current key].
+        // It costs up to 8 bytes per user key.
+        // Ignored unless comparator is BytewiseComparator().
+        //
+        // Default: false
+        bool use_range_filter;
+
         // Max number of overlapped data intervals.
         // REQUIRES: >1
         //
         // Default: 3
         size_t max_overlap;
 
+        // If true, point queries stab a flat, sorted copy of the nvm index
+        // instead of walking the marker lists of its skip list, so their cost
+        // stays flat with many intervals.  The copy is rebuilt in bulk after
+        // each flush or merge, off the write lock, and readers use the skip
+        // list until it is installed.
+        //
+        // Default: false
+        bool flat_index;
+
+        // Most key ranges the nvm index is split into, each indexed and
+        // locked on its own, so flushes and merges in one range do not
+        // block readers of another.  Tables are cut at the borders.  The
+        // index starts as one range, and is split again as data grows or
+        // one range takes too much of it, into no more ranges than keep a
+        // flush cut into tables of some thousands of entries.
+        // REQUIRES: 1..64
+        //
+        // Default: 1
+        int index_partitions;
+
+        // If true, merges cut their output at guard keys rather than after
+        // a fixed number of entries.  Guards are picked by a hash of the
+        // user key, thinned out as flushes grow, so the borders of merged
+        // intervals recur from merge to merge and later merges pull in
+        // fewer neighbours.
+        //
+        // Default: false
+        bool merge_guards;
+
+        // If non-null, picks how many of the intervals piled up at a hot
+        // key a merge rewrites, see NewTieredMergePolicy() and
+        // NewLeveledMergePolicy().  If null, a merge takes in all of them
+        // along with every older interval overlapping them.
+        //
+        // Default: nullptr
+        const MergePolicy* merge_policy;
+
+        // Maximum number of threads a merge is split across.  A merge of
+        // more than a few flushes of data is cut into key ranges at the
+        // borders of its intervals, each merged by a thread of its own,
+        // and the results are put into the index together.  The threads
+        // are started with the DB, no more of them than there are CPUs,
+        // and also build the runs of DB::IngestSortedRuns().
+        // REQUIRES: 1..64
+        //
+        // Default: 1
+        int max_subcompactions;
+
         // release DRAM after delete db.
+        // If true, records in nvm are kept in slabs freed as a whole
+        // once all their records are dropped.
         // If run in non-volatile memory, set it false.
         // Default: true
         bool run_in_dram;
 
+        // If true, a flushed memtable hands its arena over to the nvm table
+        // built from it instead of copying every record out, and the arena is
+        // freed once all the tables holding its records are gone.  Saves a
+        // copy per record on flush at the cost of keeping a whole arena alive
+        // while any of its records is.  Ignored unless run_in_dram.
+        // Default: false
+        bool zero_copy_flush;
+
         // trigger threshold for write delay
         int peak;
 
@@ -220,10 +347,34 @@ namespace softdb {
         // Default: nullptr
         const Snapshot *snapshot;
 
+        // If true and Options::prefix_extractor is set, the iterator only
+        // yields keys with the same prefix as the target of Seek(), it
+        // becomes invalid when it moves out of the prefix.
+        // SeekToFirst() and SeekToLast() are not affected.
+        // Default: false
+        bool prefix_same_as_start;
+
+        // If non-null, the iterator becomes invalid once it moves forward
+        // to a user key >= *iterate_upper_bound, so the data beyond it
+        // can be skipped. SeekToLast() stops at the last key before it.
+        // The slice must stay valid while the iterator is alive.
+        // Default: nullptr
+        const Slice *iterate_upper_bound;
+
+        // If non-null, the iterator becomes invalid once it moves backward
+        // to a user key < *iterate_lower_bound, so the data before it
+        // can be skipped. SeekToFirst() and Seek() start no earlier than it.
+        // The slice must stay valid while the iterator is alive.
+        // Default: nullptr
+        const Slice *iterate_lower_bound;
+
         ReadOptions()
                 : verify_checksums(false),
                   fill_cache(true),
-                  snapshot(nullptr) {
+                  snapshot(nullptr),
+                  prefix_same_as_start(false),
+                  iterate_upper_bound(nullptr),
+                  iterate_lower_bound(nullptr) {
         }
     };
 
@@ -247,8 +398,19 @@ namespace softdb {
         // Default: false
         bool sync;
 
+        // If true, only the keys of the write are recorded in the log, so
+        // the write is lost if the process crashes before the memtable
+        // holding it is written into nvm.  Its keys then read as deleted
+        // rather than bringing back older values.  Meant for loads that can
+        // be replayed from their source after a crash, call
+        // DB::FlushMemTable() to make what is loaded so far durable.
+        //
+        // Default: false
+        bool disable_wal;
+
         WriteOptions()
-                : sync(false) {
+                : sync(false),
+                  disable_wal(false) {
         }
     };
 }// namespace softdb
@@ -0,0 +1,46 @@
+//
+// Created by lingo on 19-5-22.
+//
+
+#ifndef SOFTDB_SLICE_TRANSFORM_H
+#define SOFTDB_SLICE_TRANSFORM_H
+
+
+#include <string>
+#include "export.h"
+
+namespace softdb {
+
+    class Slice;
+
+// A SliceTransform maps a user key to its prefix, nvm_imm_ builds a
+// prefix filter with it so that a prefix seek can skip the intervals
+// holding no key with the prefix. A SliceTransform implementation
+// must be thread-safe since softdb may invoke its methods concurrently
+// from multiple threads.
+//
+// REQUIRES: keys sharing a prefix are adjacent in the comparator order.
+    class SOFTDB_EXPORT SliceTransform {
+    public:
+        virtual ~SliceTransform();
+
+        // The name of the transformation.
+        virtual const char* Name() const = 0;
+
+        // Extract the prefix of key.
+        // REQUIRES: InDomain(key) returns true.
+        virtual Slice Transform(const Slice& key) const = 0;
+
+        // Whether key has a prefix, keys out of domain are never filtered.
+        virtual bool InDomain(const Slice& key) const = 0;
+    };
+
+// Return a SliceTransform taking the first prefix_len bytes as prefix,
+// keys shorter than prefix_len are out of domain.
+// The caller should delete the result when it is no longer needed.
+    SOFTDB_EXPORT const SliceTransform* NewFixedPrefixTransform(size_t prefix_len);
+
+}  // namespace softdb
+
+
+#endif //SOFTDB_SLICE_TRANSFORM_H
@@ -21,6 +21,10 @@
 #define HAVE_SNAPPY 0
 #endif  // !defined(HAVE_SNAPPY)
 
+#if !defined(HAVE_SSE42)
+#define HAVE_SSE42 0
+#endif  // !defined(HAVE_SSE42)
+
 // Define to 1 if your processor stores words with the most significant byte
 // first (like Motorola and SPARC, unlike Intel and VAX).
 #if !defined(SOFTDB_IS_BIG_ENDIAN)
@@ -0,0 +1,140 @@
+//
+// Created by lingo on 19-3-20.
+//
+
+// A portable implementation of crc32c, optimized to handle
+// four bytes at a time, is in util/crc32c.cpp.
+//
+// This file computes crc32c by the crc32 instructions of SSE4.2, three
+// streams at a time for long buffers with their crcs combined by
+// pclmulqdq. It is compiled with -msse4.2 -mpclmul only, so
+// AcceleratedCRC32C() checks the CPU before running any of them.
+
+#include "port/port.h"
+
+#if HAVE_SSE42
+
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <string.h>
+#include <wmmintrin.h>
+
+namespace softdb {
+namespace port {
+
+namespace {
+
+// The crc32c polynomial, bit reversed like the crc32 instruction uses.
+const uint32_t kPolynomial = 0x82f63b78;
+
+// Bytes of each of the three streams, long blocks for long buffers.
+const size_t kLongBlock = 2048;
+const size_t kShortBlock = 256;
+
+bool CanUseSSE42() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_SSE4_2) != 0 && (ecx & bit_PCLMUL) != 0;
+}
+
+// Return x^n mod P, bit reversed.
+uint32_t PowerOfX(size_t n) {
+    uint32_t v = 0x80000000;    // x^0
+    while (n-- > 0) {
+        v = (v & 1) ? (v >> 1) ^ kPolynomial : v >> 1;
+    }
+    return v;
+}
+
+// Multiplier making Shift() append "bytes" zero bytes to a crc.
+// A 32 x 32 bits carry-less product is the polynomial product times x,
+// and _mm_crc32_u64(0, v) is v times x^32 mod P, hence the 33.
+uint32_t ShiftMultiplier(size_t bytes) {
+    return PowerOfX(bytes * 8 - 33);
+}
+
+// Return the crc after feeding "bytes" zero bytes to crc,
+// where k is ShiftMultiplier(bytes).
+inline uint32_t Shift(uint32_t crc, uint32_t k) {
+    const __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                                 _mm_cvtsi32_si128(k), 0x00);
+    return static_cast<uint32_t>(_mm_crc32_u64(0, _mm_cvtsi128_si64(product)));
+}
+
+inline uint64_t LoadUint64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Feed n blocks of 3 * block bytes from *p to crc, the crc32 instruction
+// has a latency of 3 cycles but can start every cycle, so three
+// independent streams keep it busy.
+template <size_t block>
+inline uint32_t ThreeWay(uint32_t crc, const uint8_t** p, size_t n, uint32_t k) {
+    const uint8_t* q = *p;
+    uint64_t crc0 = crc;
+    while (n-- > 0) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        for (size_t i = 0; i < block; i += 8) {
+            crc0 = _mm_crc32_u64(crc0, LoadUint64(q + i));
+            crc1 = _mm_crc32_u64(crc1, LoadUint64(q + block + i));
+            crc2 = _mm_crc32_u64(crc2, LoadUint64(q + 2 * block + i));
+        }
+        crc0 = Shift(static_cast<uint32_t>(crc0), k) ^ crc1;
+        crc0 = Shift(static_cast<uint32_t>(crc0), k) ^ crc2;
+        q += 3 * block;
+    }
+    *p = q;
+    return static_cast<uint32_t>(crc0);
+}
+
+uint32_t ExtendSSE42(uint32_t crc, const char* buf, size_t size) {
+    static const uint32_t kLongShift = ShiftMultiplier(kLongBlock);
+    static const uint32_t kShortShift = ShiftMultiplier(kShortBlock);
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+    const uint8_t* e = p + size;
+    uint32_t l = crc ^ 0xffffffffu;
+
+    // Align to 8 bytes.
+    while (p != e && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+        l = _mm_crc32_u8(l, *p++);
+    }
+    size_t n = static_cast<size_t>(e - p);
+    if (n >= 3 * kLongBlock) {
+        l = ThreeWay<kLongBlock>(l, &p, n / (3 * kLongBlock), kLongShift);
+        n = static_cast<size_t>(e - p);
+    }
+    if (n >= 3 * kShortBlock) {
+        l = ThreeWay<kShortBlock>(l, &p, n / (3 * kShortBlock), kShortShift);
+    }
+    uint64_t l64 = l;
+    while (e - p >= 8) {
+        l64 = _mm_crc32_u64(l64, LoadUint64(p));
+        p += 8;
+    }
+    l = static_cast<uint32_t>(l64);
+    while (p != e) {
+        l = _mm_crc32_u8(l, *p++);
+    }
+    return l ^ 0xffffffffu;
+}
+
+}  // namespace
+
+uint32_t SSE42CRC32C(uint32_t crc, const char* buf, size_t size) {
+    static const bool kCanUse = CanUseSSE42();
+    if (!kCanUse) {
+        return 0;
+    }
+    return ExtendSSE42(crc, buf, size);
+}
+
+}  // namespace port
+}  // namespace softdb
+
+#endif  // HAVE_SSE42
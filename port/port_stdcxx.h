@@ -119,14 +119,31 @@ namespace softdb {
             return false;
         }
 
+#if HAVE_SSE42
+        // Defined in port_sse.cpp, returns 0 if the CPU lacks SSE4.2 or PCLMUL.
+        uint32_t SSE42CRC32C(uint32_t crc, const char* buf, size_t size);
+#endif  // HAVE_SSE42
+
         inline uint32_t AcceleratedCRC32C(uint32_t crc, const char* buf, size_t size) {
 #if HAVE_CRC32C
             return ::crc32c::Extend(crc, reinterpret_cast<const uint8_t*>(buf), size);
+#elif HAVE_SSE42
+            return SSE42CRC32C(crc, buf, size);
 #else
             return 0;
 #endif  // HAVE_CRC32C
         }
 
+        // Hint the cache line holding p to be read soon, a no-op if the
+        // compiler offers no such hint.
+        inline void Prefetch(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(p, 0, 3);
+#else
+            (void)p;
+#endif
+        }
+
     }  // namespace port
 }  // namespace softdb
 
@@ -4,6 +4,8 @@
 
 #include "softdb/iterator.h"
 
+#include "softdb/comparator.h"
+
 namespace softdb {
 
 Iterator::Iterator() {
@@ -38,6 +40,32 @@ void Iterator::RegisterCleanup(CleanupFunction func, void* arg1, void* arg2) {
     node->arg2 = arg2;
 }
 
+int Iterator::NextBatch(Slice* keys, Slice* values, int n) {
+    int i = 0;
+    for (; i < n && Valid(); i++) {
+        keys[i] = key();
+        values[i] = value();
+        Next();
+    }
+    return i;
+}
+
+int Iterator::NextBatchUntil(Slice* keys, Slice* values, int n,
+                             const Comparator* cmp, const Slice& limit,
+                             bool inclusive) {
+    int i = 0;
+    for (; i < n && Valid(); i++) {
+        const int r = cmp->Compare(key(), limit);
+        if (r > 0 || (r == 0 && !inclusive)) {
+            break;
+        }
+        keys[i] = key();
+        values[i] = value();
+        Next();
+    }
+    return i;
+}
+
 namespace {
 
     class EmptyIterator : public Iterator {
@@ -46,7 +74,7 @@ namespace {
         ~EmptyIterator() override = default;
 
         bool Valid() const override { return false; }
-        void Seek(const Slice& target) override { }
+        void Seek(const Slice&) override { }
         void SeekToFirst() override { }
         void SeekToLast() override { }
         void Next() override { assert(false); }
@@ -37,6 +37,13 @@ public:
         }
     }
 
+    // Give up the ownership of iter() without deleting it.
+    Iterator* Release() {
+        Iterator* iter = iter_;
+        iter_ = nullptr;
+        valid_ = false;
+        return iter;
+    }
 
     // Iterator interface methods
     bool Valid() const        { return valid_; }
@@ -47,10 +54,24 @@ public:
     Status status() const     { assert(iter_); return iter_->status(); }
     void Next()               { assert(iter_); iter_->Next();        Update(); }
     void Prev()               { assert(iter_); iter_->Prev();        Update(); }
+    int NextBatch(Slice* keys, Slice* values, int n) {
+        assert(iter_);
+        int filled = iter_->NextBatch(keys, values, n);
+        Update();
+        return filled;
+    }
+    int NextBatchUntil(Slice* keys, Slice* values, int n,
+                       const Comparator* cmp, const Slice& limit, bool inclusive) {
+        assert(iter_);
+        int filled = iter_->NextBatchUntil(keys, values, n, cmp, limit, inclusive);
+        Update();
+        return filled;
+    }
     void Seek(const Slice& k) { assert(iter_); iter_->Seek(k);       Update(); }
     void SeekToFirst()        { assert(iter_); iter_->SeekToFirst(); Update(); }
     void SeekToLast()         { assert(iter_); iter_->SeekToLast();  Update(); }
     void Abandon()            { assert(iter_); iter_->Abandon(); }
+    void Unpin()              { assert(iter_); iter_->Unpin(); }
 
 private:
     void Update() {
@@ -5,6 +5,8 @@
 
 #include "merger.h"
 
+#include <algorithm>
+
 #include "softdb/comparator.h"
 #include "softdb/iterator.h"
 #include "iterator_wrapper.h"
@@ -12,13 +14,31 @@
 namespace softdb {
 
 namespace {
+
+// Merge children with a loser tree (tournament tree).
+//
+// Leaves n_..2n_-1 stand for children 0..n_-1, internal node k in [1, n_)
+// keeps the loser of the match between the winners of its two subtrees,
+// tree_[0] keeps the overall winner, which is current_.
+// After current_ moves in the same direction only the matches on its path
+// to the root are replayed, O(log n) compares instead of O(n).
+//
+// The best loser on the path of the winner is the runner-up, as long as
+// current_ still beats it after a move, every match on the path keeps its
+// result and the tree is left untouched, one compare per step for runs
+// of keys coming from the same child.
 class MergingIterator : public Iterator {
 public:
-    MergingIterator(const Comparator* comparator, Iterator** children, int n)
+    MergingIterator(const Comparator* comparator, Iterator** children, int n,
+                    bool owned = true)
             : comparator_(comparator),
               children_(new IteratorWrapper[n]),
               n_(n),
+              tree_(new int[n]),
+              winners_(new int[2 * n]),
+              runner_up_(-1),
               current_(nullptr),
+              owned_(owned),
               direction_(kForward) {
         for (int i = 0; i < n; i++) {
             children_[i].Set(children[i]);
@@ -26,7 +46,14 @@ public:
     }
 
     virtual ~MergingIterator() {
+        if (!owned_) {
+            for (int i = 0; i < n_; i++) {
+                children_[i].Release();
+            }
+        }
         delete[] children_;
+        delete[] tree_;
+        delete[] winners_;
     }
 
     virtual bool Valid() const {
@@ -37,24 +64,30 @@ public:
         for (int i = 0; i < n_; i++) {
             children_[i].SeekToFirst();
         }
-        FindSmallest();
         direction_ = kForward;
+        Rebuild();
     }
 
     virtual void SeekToLast() {
         for (int i = 0; i < n_; i++) {
             children_[i].SeekToLast();
         }
-        FindLargest();
         direction_ = kReverse;
+        Rebuild();
     }
 
     virtual void Seek(const Slice& target) {
         for (int i = 0; i < n_; i++) {
             children_[i].Seek(target);
         }
-        FindSmallest();
         direction_ = kForward;
+        Rebuild();
+    }
+
+    // Merge from where the children stand.
+    void Resume(bool reverse) {
+        direction_ = reverse ? kReverse : kForward;
+        Rebuild();
     }
 
     virtual void Next() {
@@ -77,10 +110,25 @@ public:
                 }
             }
             direction_ = kForward;
+            current_->Next();
+            Rebuild();
+            return;
         }
 
         current_->Next();
-        FindSmallest();
+        Adjust();
+    }
+
+    virtual int NextBatch(Slice* keys, Slice* values, int n) {
+        return Fill(keys, values, n, nullptr, false);
+    }
+
+    virtual int NextBatchUntil(Slice* keys, Slice* values, int n,
+                               const Comparator* cmp, const Slice& limit,
+                               bool inclusive) {
+        // cmp orders keys as comparator_ does.
+        (void)cmp;
+        return Fill(keys, values, n, &limit, inclusive);
     }
 
     virtual void Prev() {
@@ -106,10 +154,13 @@ public:
                 }
             }
             direction_ = kReverse;
+            current_->Prev();
+            Rebuild();
+            return;
         }
 
         current_->Prev();
-        FindLargest();
+        Adjust();
     }
 
     virtual Slice key() const {
@@ -143,20 +194,54 @@ public:
         current_->Abandon();
     }
 
+    virtual void Unpin() {
+        for (int i = 0; i < n_; i++) {
+            children_[i].Unpin();
+        }
+    }
+
 
 private:
-    void FindSmallest();
-    void FindLargest();
-
-    // We might want to use a heap in case there are lots of children.
-    // For now we use a simple array since we expect a very small number
-    // of children in softdb.
-    // For instance, in level-3 there is a file overlaps more than 100 files in level-4,
-    // Will it be a disaster to finish the compact? Solution: See ShouldStopBefore.
+    // Return true iff child a goes before child b in direction_.
+    // Invalid children lose every match, ties go to the child
+    // with smaller index moving forward and larger index moving backward.
+    inline bool Beats(int a, int b) const {
+        const IteratorWrapper& x = children_[a];
+        const IteratorWrapper& y = children_[b];
+        if (!x.Valid()) {
+            return false;
+        }
+        if (!y.Valid()) {
+            return true;
+        }
+        int r = comparator_->Compare(x.key(), y.key());
+        if (direction_ == kForward) {
+            return r < 0 || (r == 0 && a < b);
+        } else {
+            return r > 0 || (r == 0 && a > b);
+        }
+    }
+
+    // Fill a batch moving forward, up to limit if not nullptr.
+    int Fill(Slice* keys, Slice* values, int n, const Slice* limit, bool inclusive);
+
+    // Play every match again, after children are repositioned.
+    void Rebuild();
+
+    // Replay the matches of winner after it moved in direction_.
+    void Adjust();
+
+    // Set current_ by tree_[0], and find runner-up on its path if asked.
+    void SetWinner(bool find_runner_up);
+
     const Comparator* comparator_;
     IteratorWrapper* children_;
     int n_;
+    int* tree_;         // tree_[0]: winner, tree_[1, n_): losers
+    int* winners_;      // scratch space of Rebuild
+    int runner_up_;     // best loser on the path of winner, -1 if unknown
     IteratorWrapper* current_;
+    const bool owned_;  // delete children along with this
 
     // Which direction is the iterator moving?
     enum Direction {
@@ -166,35 +251,116 @@ private:
     Direction direction_;
 };
 
-void MergingIterator::FindSmallest() {
-    IteratorWrapper* smallest = nullptr;
-    for (int i = 0; i < n_; i++) {
-        IteratorWrapper* child = &children_[i];
-        if (child->Valid()) {
-            if (smallest == nullptr) {
-                smallest = child;
-            } else if (comparator_->Compare(child->key(), smallest->key()) < 0) {
-                smallest = child;
+// The winner hands over its whole run at once: it is bounded by the key of
+// the runner-up, which it goes on beating up to that key, or through it if
+// the winner has the smaller index. Only one Adjust() is paid per run.
+int MergingIterator::Fill(Slice* keys, Slice* values, int n,
+                          const Slice* limit, bool inclusive) {
+    int i = 0;
+    if (i < n && Valid() && direction_ != kForward) {
+        if (limit != nullptr) {
+            const int r = comparator_->Compare(key(), *limit);
+            if (r > 0 || (r == 0 && !inclusive)) {
+                return 0;
             }
         }
+        keys[i] = key();
+        values[i] = value();
+        i++;
+        Next();
     }
-    current_ = smallest;
+    while (i < n && current_ != nullptr) {
+        const int winner = tree_[0];
+        if (runner_up_ < 0) {
+            SetWinner(true);
+        }
+        if (runner_up_ < 0 || !children_[runner_up_].Valid()) {
+            // The runner-up is the best of the others, so current_ is
+            // the only child left, let it fill the rest by itself.
+            if (limit == nullptr) {
+                i += current_->NextBatch(keys + i, values + i, n - i);
+            } else {
+                i += current_->NextBatchUntil(keys + i, values + i, n - i,
+                                              comparator_, *limit, inclusive);
+            }
+            Adjust();
+            break;
+        }
+        const Slice next = children_[runner_up_].key();
+        bool through = winner < runner_up_;
+        bool at_limit = false;
+        if (limit != nullptr) {
+            const int r = comparator_->Compare(*limit, next);
+            if (r < 0 || (r == 0 && !inclusive)) {
+                at_limit = true;
+                through = inclusive;
+            }
+        }
+        i += current_->NextBatchUntil(keys + i, values + i, n - i, comparator_,
+                                      at_limit ? *limit : next, through);
+        Adjust();
+        if (at_limit) {
+            break;
+        }
+    }
+    return i;
+}
+
+void MergingIterator::Rebuild() {
+    for (int i = 0; i < n_; i++) {
+        winners_[n_ + i] = i;
+    }
+    for (int k = n_ - 1; k >= 1; k--) {
+        const int l = winners_[2 * k];
+        const int r = winners_[2 * k + 1];
+        if (Beats(r, l)) {
+            winners_[k] = r;
+            tree_[k] = l;
+        } else {
+            winners_[k] = l;
+            tree_[k] = r;
+        }
+    }
+    tree_[0] = winners_[1];
+    SetWinner(true);
 }
 
-void MergingIterator::FindLargest() {
-    IteratorWrapper* largest = nullptr;
-    for (int i = n_-1; i >= 0; i--) {
-        IteratorWrapper* child = &children_[i];
-        if (child->Valid()) {
-            if (largest == nullptr) {
-                largest = child;
-            } else if (comparator_->Compare(child->key(), largest->key()) > 0) {
-                largest = child;
+void MergingIterator::Adjust() {
+    const int winner = tree_[0];
+    // fast path: winner still beats the best of those it ever met.
+    if (runner_up_ >= 0 && Beats(winner, runner_up_)) {
+        return;
+    }
+    int w = winner;
+    for (int k = (w + n_) / 2; k >= 1; k /= 2) {
+        if (Beats(tree_[k], w)) {
+            std::swap(tree_[k], w);
+        }
+    }
+    tree_[0] = w;
+    // Only a child winning twice in a row is likely to start a run,
+    // otherwise finding runner-up costs more than it saves.
+    SetWinner(w == winner);
+}
+
+void MergingIterator::SetWinner(bool find_runner_up) {
+    const int winner = tree_[0];
+    runner_up_ = -1;
+    if (!children_[winner].Valid()) {
+        // all children exhausted
+        current_ = nullptr;
+        return;
+    }
+    current_ = &children_[winner];
+    if (find_runner_up) {
+        for (int k = (winner + n_) / 2; k >= 1; k /= 2) {
+            if (runner_up_ < 0 || Beats(tree_[k], runner_up_)) {
+                runner_up_ = tree_[k];
             }
         }
     }
-    current_ = largest;
 }
+
 }  // namespace
 
 Iterator* NewMergingIterator(const Comparator* cmp, Iterator** list, int n) {
@@ -208,4 +374,15 @@ Iterator* NewMergingIterator(const Comparator* cmp, Iterator** list, int n) {
     }
 }
 
+Iterator* NewResumedMergingIterator(const Comparator* cmp, Iterator** list, int n,
+                                    bool reverse) {
+    assert(n >= 0);
+    if (n == 0) {
+        return NewEmptyIterator();
+    }
+    MergingIterator* iter = new MergingIterator(cmp, list, n, false);
+    iter->Resume(reverse);
+    return iter;
+}
+
 }  // namespace softdb
\ No newline at end of file
@@ -23,6 +23,21 @@ class Iterator;
 Iterator* NewMergingIterator(
         const Comparator* comparator, Iterator** children, int n);
 
+// Return an iterator that provided the union of the data in
+// children[0,n-1], positioned at once at the smallest (reverse == false)
+// or the largest (reverse == true) entry the children currently stand on,
+// then moving in that direction.  Children are not sought again.
+//
+// Unlike NewMergingIterator(), the children are still owned by the caller,
+// who deletes them after the result iterator is deleted.  So the caller
+// can replace some of the children and go on without seeking the others.
+//
+// REQUIRES: n >= 0
+// REQUIRES: every child is either exhausted or at its first entry
+// >= (reverse: last entry <= ) the entry the result is positioned at.
+Iterator* NewResumedMergingIterator(
+        const Comparator* comparator, Iterator** children, int n, bool reverse);
+
 }  // namespace softdb
 
 #endif //SOFTDB_MERGER_H
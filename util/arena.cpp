@@ -4,23 +4,69 @@
 
 #include "arena.h"
 #include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 namespace softdb {
 
-    static const int kBlockSize = 4096;
+    namespace {
 
-    Arena::Arena() : memory_usage_(0) {
+        std::atomic<uint64_t> shared_arenas(0);
+        std::atomic<uint64_t> shared_bytes(0);
+        std::atomic<uint64_t> shared_records(0);
+        std::atomic<uint64_t> shared_live_records(0);
+
+    }  // namespace
+
+    void Arena::GetSharedStats(SharedStats* stats) {
+        stats->arenas = shared_arenas.load(std::memory_order_relaxed);
+        stats->bytes = shared_bytes.load(std::memory_order_relaxed);
+        stats->records = shared_records.load(std::memory_order_relaxed);
+        stats->live_records = shared_live_records.load(std::memory_order_relaxed);
+    }
+
+    void Arena::AddSharedRecords(int records, int live_records) {
+        shared_records.fetch_add(records, std::memory_order_relaxed);
+        shared_live_records.fetch_add(live_records, std::memory_order_relaxed);
+    }
+
+    Arena::Arena() : Arena(false) { }
+
+    Arena::Arena(bool shared)
+            : shared_(shared),
+              chunk_ptr_(nullptr), chunk_bytes_remaining_(0), next_chunk_size_(kMinChunkSize),
+              footprint_(0), freed_(0),
+              refs_(1), records_(0), live_records_(0), memory_usage_(0) {
         alloc_ptr_ = nullptr;  // First allocation will allocate a block
         alloc_bytes_remaining_ = 0;
+        if (shared_) {
+            shared_arenas.fetch_add(1, std::memory_order_relaxed);
+        }
     }
 
     Arena::~Arena() {
+        assert(live_records_ == 0);
+        if (shared_) {
+            shared_arenas.fetch_sub(1, std::memory_order_relaxed);
+            shared_bytes.fetch_sub(footprint_ - freed_, std::memory_order_relaxed);
+            shared_records.fetch_sub(records_, std::memory_order_relaxed);
+        }
         for (size_t i = 0; i < blocks_.size(); i++) {
-            delete[] blocks_[i];
+            if (shared_) {
+                munmap(blocks_[i], chunk_sizes_[i]);
+            } else {
+                delete[] blocks_[i];
+            }
+        }
+        for (size_t i = 0; i < heap_chunks_.size(); i++) {
+            free(heap_chunks_[i]);
         }
     }
 
     char* Arena::AllocateFallback(size_t bytes) {
+        if (shared_) {
+            return AllocateShared(bytes);
+        }
         if (bytes > kBlockSize / 4) {
             // Object is more than a quarter of our block size.  Allocate it separately
             // to avoid wasting too much space in leftover bytes.
@@ -65,5 +111,106 @@ namespace softdb {
         return result;
     }
 
-}  // namespace softdb
+    // Owner() reads the arena from the block a record starts in, so a record
+    // larger than a quarter block takes blocks of its own and ends with the
+    // last of them.  The first block keeps the room left in front of it for
+    // the records that follow.
+    char* Arena::AllocateShared(size_t bytes) {
+        const size_t header = sizeof(Block);
+        if (bytes <= kBlockSize / 4) {
+            // We waste the remaining space in the current block.
+            char* block = AllocateBlocks(1);
+            if (block == nullptr) {
+                return nullptr;
+            }
+            alloc_ptr_ = block + header + bytes;
+            alloc_bytes_remaining_ = kBlockSize - header - bytes;
+            return block + header;
+        }
+        const size_t n = (bytes + header + kBlockSize - 1) / kBlockSize;
+        char* block = AllocateBlocks(n);
+        if (block == nullptr) {
+            return nullptr;
+        }
+        // Aligned, and starting in the first block.
+        const size_t align = (sizeof(void*) > 8) ? sizeof(void*) : 8;
+        size_t offset = (n * kBlockSize - bytes) & ~(align - 1);
+        if (offset > kBlockSize - align) {
+            offset = kBlockSize - align;
+        }
+        char* result = block + offset;
+        const size_t front = result - block - header;
+        if (front > alloc_bytes_remaining_) {
+            alloc_ptr_ = block + header;
+            alloc_bytes_remaining_ = front;
+        }
+        return result;
+    }
+
+    // Return n blocks in a row under the header of the first one.
+    char* Arena::AllocateBlocks(size_t n) {
+        const size_t bytes = n * kBlockSize;
+        char* blocks;
+        if (bytes <= chunk_bytes_remaining_) {
+            blocks = chunk_ptr_;
+            chunk_ptr_ += bytes;
+            chunk_bytes_remaining_ -= bytes;
+        } else if (bytes >= kChunkSize) {
+            // Records no chunk holds get a chunk each, the current one stays.
+            blocks = NewChunk(bytes);
+        } else {
+            const size_t chunk_bytes = (bytes > next_chunk_size_) ? bytes : next_chunk_size_;
+            blocks = NewChunk(chunk_bytes);
+            if (blocks != nullptr) {
+                chunk_ptr_ = blocks + bytes;
+                chunk_bytes_remaining_ = chunk_bytes - bytes;
+                if (next_chunk_size_ < kChunkSize) {
+                    next_chunk_size_ *= 2;
+                }
+            }
+        }
+        if (blocks == nullptr) {
+            return nullptr;
+        }
+        Block* block = reinterpret_cast<Block*>(blocks);
+        block->arena = this;
+        block->records.store(0, std::memory_order_relaxed);
+        block->blocks = static_cast<int>(n);
+        memory_usage_.NoBarrier_Store(reinterpret_cast<void*>(MemoryUsage() + bytes));
+        return blocks;
+    }
+
+    char* Arena::NewChunk(size_t bytes) {
+        // mmap() aligns chunks to pages and gives them back as soon as they
+        // are freed, unlike aligned allocations from the heap, which are
+        // only the fallback.
+        void* chunk = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk != MAP_FAILED) {
+            blocks_.push_back(reinterpret_cast<char*>(chunk));
+            chunk_sizes_.push_back(bytes);
+        } else if (posix_memalign(&chunk, kBlockSize, bytes) == 0) {
+            heap_chunks_.push_back(chunk);
+        } else {
+            return nullptr;
+        }
+        footprint_ += bytes;
+        shared_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        return reinterpret_cast<char*>(chunk);
+    }
+
+    void Arena::FreeBlock(Block* block) {
+        // Only the records are left if no one else holds the arena, the
+        // creator may still read the rest of its blocks.
+        if (refs_.load(std::memory_order_acquire) !=
+            live_records_.load(std::memory_order_acquire)) {
+            return;
+        }
+        const size_t bytes = static_cast<size_t>(block->blocks) * kBlockSize;
+        if (madvise(block, bytes, MADV_DONTNEED) == 0) {
+            freed_.fetch_add(bytes, std::memory_order_relaxed);
+            shared_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        }
+    }
 
+}  // namespace softdb
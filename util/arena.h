@@ -6,6 +6,7 @@
 #define SOFTDB_ARENA_H
 
 
+#include <atomic>
 #include <vector>
 #include <assert.h>
 #include <stddef.h>
@@ -17,7 +18,76 @@ namespace softdb {
     class Arena {
     public:
         Arena();
-        ~Arena();
+
+        // A shared arena can outlive its creator: the records allocated from
+        // it may be handed to others, each taking a reference, and Owner()
+        // finds the arena of any of them.  Blocks are aligned to kBlockSize
+        // and start with a pointer to the arena.  Allocations from a shared
+        // arena return nullptr once the system has no memory left.
+        explicit Arena(bool shared);
+
+        // Arenas are reference counted, the initial count is one.
+        void Ref(int n = 1) { refs_.fetch_add(n, std::memory_order_relaxed); }
+
+        // Drop n references, delete the arena if no more references exist.
+        void Unref(int n = 1) {
+            const int old = refs_.fetch_sub(n, std::memory_order_acq_rel);
+            assert(old >= n);
+            if (old == n) {
+                delete this;
+            }
+        }
+
+        bool shared() const { return shared_; }
+
+        // Records handed over to others each hold a reference, and the
+        // arena counts how many of them are still live, see MostlyDead().
+        void TakeRecords(int n) {
+            records_.fetch_add(n, std::memory_order_relaxed);
+            live_records_.fetch_add(n, std::memory_order_relaxed);
+            AddSharedRecords(n, n);
+            Ref(n);
+        }
+        void ReleaseRecords(int n) {
+            live_records_.fetch_sub(n, std::memory_order_relaxed);
+            AddSharedRecords(0, -n);
+            Unref(n);
+        }
+
+        // Each record taken also holds the block it starts in, the memory of
+        // a block none holds is given back to the system, even though a few
+        // records that can't be moved keep the arena.
+        static void HoldBlock(const char* record) {
+            BlockOf(record)->records.fetch_add(1, std::memory_order_relaxed);
+        }
+        static void ReleaseBlock(const char* record) {
+            Block* block = BlockOf(record);
+            if (block->records.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                block->arena->FreeBlock(block);
+            }
+        }
+
+        // Return true if less than 1/ratio of the records taken are live,
+        // the live ones are worth moving to let the arena go.
+        bool MostlyDead(int ratio) const {
+            return static_cast<int64_t>(live_records_.load(std::memory_order_relaxed)) * ratio <
+                   records_.load(std::memory_order_relaxed);
+        }
+
+        // Usage of all the shared arenas of the process.
+        struct SharedStats {
+            uint64_t arenas;
+            uint64_t bytes;         // allocated from the system
+            uint64_t records;       // taken from the arenas
+            uint64_t live_records;  // of them, not released yet
+        };
+        static void GetSharedStats(SharedStats* stats);
+
+        // Return the arena p was allocated from.
+        // REQUIRES: p was allocated from a shared arena.
+        static Arena* Owner(const char* p) {
+            return BlockOf(p)->arena;
+        }
 
         // Return a pointer to a newly allocated memory block of "bytes" bytes.
         char* Allocate(size_t bytes);
@@ -32,15 +102,56 @@ namespace softdb {
         }
 
     private:
+        static const int kBlockSize = 4096;
+        // Shared blocks of kBlockSize are carved out of chunks, mapping every
+        // 4KB block on its own would cost a system call each.  The chunks of
+        // an arena double from kMinChunkSize up to kChunkSize, small tables
+        // keep small slabs.
+        static const int kMinChunkSize = 4 * kBlockSize;
+        static const int kChunkSize = 64 * kBlockSize;
+
+        // Header of a shared block, a record larger than a block runs over
+        // the ones after.  The size keeps the rest of the block aligned.
+        struct Block {
+            Arena* arena;
+            std::atomic<int> records;   // taken, not released yet
+            int blocks;                 // in a row, given back together
+        };
+
+        static Block* BlockOf(const char* p) {
+            return reinterpret_cast<Block*>(
+                    reinterpret_cast<uintptr_t>(p) & ~static_cast<uintptr_t>(kBlockSize - 1));
+        }
+
+        ~Arena();   // Private since only Unref() should be used to delete it
+
+        static void AddSharedRecords(int records, int live_records);
+
         char* AllocateFallback(size_t bytes);
         char* AllocateNewBlock(size_t block_bytes);
+        char* AllocateShared(size_t bytes);
+        char* AllocateBlocks(size_t n);
+        char* NewChunk(size_t bytes);
+        void FreeBlock(Block* block);
 
         // Allocation state
         char* alloc_ptr_;
         size_t alloc_bytes_remaining_;
 
-        // Array of new[] allocated memory blocks
+        // Array of new[] allocated memory blocks, mmap()ed chunks if shared_
         std::vector<char*> blocks_;
+        std::vector<size_t> chunk_sizes_;
+        std::vector<void*> heap_chunks_;    // shared chunks mmap() failed to get
+
+        const bool shared_;
+        char* chunk_ptr_;               // next block of the current chunk
+        size_t chunk_bytes_remaining_;
+        size_t next_chunk_size_;
+        size_t footprint_;              // bytes of the chunks
+        std::atomic<size_t> freed_;     // of them, given back by FreeBlock()
+        std::atomic<int> refs_;
+        std::atomic<int> records_;
+        std::atomic<int> live_records_;
 
         // Total memory usage of the arena.
         port::AtomicPointer memory_usage_;
@@ -13,6 +13,17 @@ namespace softdb {
         return Status::NotSupported("NewAppendableFile", fname);
     }
 
+    Status Env::NewMappedWritableFile(const std::string& fname, size_t,
+                                      WritableFile**) {
+        return Status::NotSupported("NewMappedWritableFile", fname);
+    }
+
+    Status Env::NewMappedReadableFile(const std::string& fname,
+                                      RandomAccessFile** result) {
+        *result = nullptr;
+        return Status::NotSupported("NewMappedReadableFile", fname);
+    }
+
     SequentialFile::~SequentialFile() {
     }
 
@@ -35,6 +35,10 @@
 #include "posix_logger.h"
 #include "env_posix_test_helper.h"
 
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif  // defined(__x86_64__)
+
 // HAVE_FDATASYNC is defined in the auto-generated port_config.h, which is
 // included by port_stdcxx.h.
 #if !HAVE_FDATASYNC
@@ -50,6 +54,8 @@ namespace {
 
     constexpr const size_t kWritableFileBufferSize = 65536;
 
+    constexpr const size_t kCacheLineSize = 64;
+
     static Status PosixError(const std::string& context, int err_number) {
         if (err_number == ENOENT) {
             return Status::NotFound(context, strerror(err_number));
@@ -183,6 +189,199 @@ namespace {
         }
     };
 
+// Write back the cache lines holding [data, data + n) and wait for them,
+// making them durable on persistent memory mapped with DAX.
+    static void PersistRange(const char* data, size_t n) {
+#if defined(__x86_64__)
+        const uintptr_t end = reinterpret_cast<uintptr_t>(data) + n;
+        for (uintptr_t p = reinterpret_cast<uintptr_t>(data) & ~uintptr_t(kCacheLineSize - 1);
+             p < end; p += kCacheLineSize) {
+            _mm_clflush(reinterpret_cast<const void*>(p));
+        }
+        _mm_sfence();
+#else
+        const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        const uintptr_t start = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+        ::msync(reinterpret_cast<void*>(start),
+                reinterpret_cast<uintptr_t>(data) + n - start, MS_SYNC);
+#endif  // defined(__x86_64__)
+    }
+
+// Zero [data, data + n) and make it durable like PersistRange(), the stores
+// bypass the CPU caches where possible, so nothing is left to write back.
+    static void ZeroRange(char* data, size_t n) {
+#if defined(__x86_64__)
+        char* p = data;
+        char* end = data + n;
+        while (p != end && (reinterpret_cast<uintptr_t>(p) & 15) != 0) {
+            *p++ = 0;
+        }
+        char* body = p;
+        const __m128i zero = _mm_setzero_si128();
+        for (; end - p >= 16; p += 16) {
+            _mm_stream_si128(reinterpret_cast<__m128i*>(p), zero);
+        }
+        char* tail = p;
+        while (p != end) {
+            *p++ = 0;
+        }
+        // The unaligned head and tail went through the caches.
+        PersistRange(data, body - data);
+        PersistRange(tail, end - tail);
+#else
+        memset(data, 0, n);
+        PersistRange(data, n);
+#endif  // defined(__x86_64__)
+    }
+
+// Write back the pages holding [data, data + n) to the file and wait for
+// them, like fdatasync() does for the range.
+    static int MsyncRange(const char* data, size_t n) {
+        const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        const uintptr_t start = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+        return ::msync(reinterpret_cast<void*>(start),
+                       reinterpret_cast<uintptr_t>(data) + n - start, MS_SYNC);
+    }
+
+// Map the first length bytes of fd shared.  Where the file system supports
+// MAP_SYNC, i.e. on DAX, *dax is set and writing back the CPU cache lines
+// of a store makes it durable; elsewhere the pages need msync().
+    static void* MapShared(int fd, size_t length, bool populate, bool* dax) {
+        int flags = 0;
+#if defined(MAP_POPULATE)
+        if (populate) {
+            flags |= MAP_POPULATE;
+        }
+#endif  // defined(MAP_POPULATE)
+        (void)populate;
+#if defined(MAP_SHARED_VALIDATE) && defined(MAP_SYNC)
+        void* base = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                            MAP_SHARED_VALIDATE | MAP_SYNC | flags, fd, 0);
+        if (base != MAP_FAILED) {
+            *dax = true;
+            return base;
+        }
+#endif  // defined(MAP_SHARED_VALIDATE) && defined(MAP_SYNC)
+        *dax = false;
+        return ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | flags, fd, 0);
+    }
+
+// mmap() based writing to a preallocated file, see Env::NewMappedWritableFile().
+    class PosixMappedWritableFile final : public WritableFile {
+    public:
+        // base[0,length-1] contains the mmapped contents of the file, mapped
+        // with MAP_SYNC iff dax.
+        PosixMappedWritableFile(std::string filename, int fd, char* base, size_t length, bool dax)
+                : filename_(std::move(filename)), fd_(fd), base_(base),
+                  length_(length), pos_(0), synced_(0), dax_(dax) {}
+
+        ~PosixMappedWritableFile() override {
+            if (fd_ >= 0) {
+                // Ignoring any potential errors
+                Close();
+            }
+        }
+
+        // Allocate the first "length" bytes of fd, which holds "size" bytes.
+        static Status Allocate(const std::string& filename, int fd,
+                               size_t size, size_t length) {
+            if (length <= size) {
+                return Status::OK();
+            }
+            if (::posix_fallocate(fd, size, length - size) == 0) {
+                return Status::OK();
+            }
+            // Not supported by the file system, leave a hole.
+            if (::ftruncate(fd, length) != 0) {
+                return PosixError(filename, errno);
+            }
+            return Status::OK();
+        }
+
+        Status Append(const Slice& data) override {
+            if (data.size() > length_ - pos_) {
+                Status status = Grow(pos_ + data.size());
+                if (!status.ok()) {
+                    return status;
+                }
+            }
+            std::memcpy(base_ + pos_, data.data(), data.size());
+            pos_ += data.size();
+            return Status::OK();
+        }
+
+        Status Close() override {
+            Status status;
+            if (::munmap(base_, length_) != 0) {
+                status = PosixError(filename_, errno);
+            }
+            // The file keeps its length, the tail reads as zeros.
+            if (::close(fd_) < 0 && status.ok()) {
+                status = PosixError(filename_, errno);
+            }
+            fd_ = -1;
+            base_ = nullptr;
+            return status;
+        }
+
+        Status Flush() override {
+            // Nothing is buffered.
+            return Status::OK();
+        }
+
+        Status Sync() override {
+            Status status = SyncRange(base_ + synced_, pos_ - synced_);
+            if (status.ok()) {
+                synced_ = pos_;
+            }
+            return status;
+        }
+
+    private:
+        // Map at least "length" bytes of the file.
+        Status Grow(size_t length) {
+            length = std::max(length, length_ * 2);
+            Status status = Allocate(filename_, fd_, length_, length);
+            if (!status.ok()) {
+                return status;
+            }
+            bool dax;
+            void* base = MapShared(fd_, length, false, &dax);
+            if (base == MAP_FAILED) {
+                return PosixError(filename_, errno);
+            }
+            // Make what is appended before the remap durable.
+            status = SyncRange(base_ + synced_, pos_ - synced_);
+            if (!status.ok()) {
+                ::munmap(base, length);
+                return status;
+            }
+            synced_ = pos_;
+            ::munmap(base_, length_);
+            base_ = reinterpret_cast<char*>(base);
+            length_ = length;
+            dax_ = dax;
+            return Status::OK();
+        }
+
+        Status SyncRange(const char* data, size_t n) {
+            if (dax_) {
+                PersistRange(data, n);
+            } else if (n > 0 && MsyncRange(data, n) != 0) {
+                return PosixError(filename_, errno);
+            }
+            return Status::OK();
+        }
+
+        const std::string filename_;
+        int fd_;
+        char* base_;
+        size_t length_;
+        size_t pos_;        // base_[0, pos_ - 1] has been appended
+        size_t synced_;     // base_[0, synced_ - 1] has been synced
+        bool dax_;          // mapped with MAP_SYNC
+    };
+
 // mmap() based random-access
     class PosixMmapReadableFile: public RandomAccessFile {
     private:
@@ -193,6 +392,7 @@ namespace {
 
     public:
         // base[0,length-1] contains the mmapped contents of the file.
+        // limiter is nullptr if the mapping is not counted by one.
         PosixMmapReadableFile(const std::string& fname, void* base, size_t length,
                               Limiter* limiter)
                 : filename_(fname), mmapped_region_(base), length_(length),
@@ -201,7 +401,9 @@ namespace {
 
         virtual ~PosixMmapReadableFile() {
             munmap(mmapped_region_, length_);
-            limiter_->Release();
+            if (limiter_ != nullptr) {
+                limiter_->Release();
+            }
         }
 
         virtual Status Read(uint64_t offset, size_t n, Slice* result,
@@ -491,6 +693,69 @@ namespace {
             return s;
         }
 
+        virtual Status NewMappedWritableFile(const std::string& fname, size_t size,
+                                             WritableFile** result) {
+            *result = nullptr;
+            int fd = open(fname.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd < 0) {
+                return PosixError(fname, errno);
+            }
+            struct stat sbuf;
+            if (fstat(fd, &sbuf) != 0) {
+                Status s = PosixError(fname, errno);
+                close(fd);
+                return s;
+            }
+            const size_t old_size = static_cast<size_t>(sbuf.st_size);
+            const size_t length = std::max(std::max(size, old_size), size_t(1));
+            Status s = PosixMappedWritableFile::Allocate(fname, fd, old_size, length);
+            if (s.ok()) {
+                // Fault the pages in now rather than on the write path.
+                bool dax;
+                void* base = MapShared(fd, length, true, &dax);
+                if (base != MAP_FAILED) {
+                    // A recycled file must not yield its old contents.
+                    ZeroRange(reinterpret_cast<char*>(base), old_size);
+                    if (dax || old_size == 0 || MsyncRange(reinterpret_cast<char*>(base), old_size) == 0) {
+                        *result = new PosixMappedWritableFile(fname, fd, reinterpret_cast<char*>(base),
+                                                              length, dax);
+                        return s;
+                    }
+                    s = PosixError(fname, errno);
+                    munmap(base, length);
+                } else {
+                    s = PosixError(fname, errno);
+                }
+            }
+            close(fd);
+            return s;
+        }
+
+        virtual Status NewMappedReadableFile(const std::string& fname,
+                                             RandomAccessFile** result) {
+            *result = nullptr;
+            int fd = open(fname.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return PosixError(fname, errno);
+            }
+            uint64_t size;
+            Status s = GetFileSize(fname, &size);
+            if (s.ok()) {
+                if (size == 0) {
+                    s = Status::NotSupported("NewMappedReadableFile: empty file", fname);
+                } else {
+                    void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                    if (base != MAP_FAILED) {
+                        *result = new PosixMmapReadableFile(fname, base, size, nullptr);
+                    } else {
+                        s = PosixError(fname, errno);
+                    }
+                }
+            }
+            close(fd);
+            return s;
+        }
+
         virtual bool FileExists(const std::string& fname) {
             return access(fname.c_str(), F_OK) == 0;
         }
@@ -0,0 +1,77 @@
+//
+// Created by lingo on 19-6-3.
+//
+
+#include <string>
+
+#include "softdb/merge_policy.h"
+
+namespace softdb {
+
+    MergePolicy::~MergePolicy() { }
+
+    namespace {
+        class TieredMergePolicy : public MergePolicy {
+        public:
+            explicit TieredMergePolicy(double size_ratio)
+                    : size_ratio_(size_ratio),
+                      name_("softdb.TieredMerge." + std::to_string(size_ratio)) { }
+
+            virtual const char* Name() const {
+                return name_.c_str();
+            }
+
+            virtual int Pick(const uint64_t* sizes, int n) const {
+                if (n == 0) {
+                    return 0;
+                }
+                double taken = static_cast<double>(sizes[0]);
+                int k = 1;
+                while (k < n && sizes[k] <= size_ratio_ * taken) {
+                    taken += sizes[k];
+                    k++;
+                }
+                return k;
+            }
+
+        private:
+            const double size_ratio_;
+            const std::string name_;
+        };
+
+        class LeveledMergePolicy : public MergePolicy {
+        public:
+            explicit LeveledMergePolicy(double size_ratio)
+                    : size_ratio_(size_ratio),
+                      name_("softdb.LeveledMerge." + std::to_string(size_ratio)) { }
+
+            virtual const char* Name() const {
+                return name_.c_str();
+            }
+
+            virtual int Pick(const uint64_t* sizes, int n) const {
+                if (n < 2) {
+                    return 0;
+                }
+                double newer = 0;
+                for (int i = 0; i < n - 1; i++) {
+                    newer += sizes[i];
+                }
+                return (newer * size_ratio_ >= sizes[n - 1]) ? n : n - 1;
+            }
+
+        private:
+            const double size_ratio_;
+            const std::string name_;
+        };
+    }  // namespace
+
+    const MergePolicy* NewTieredMergePolicy(double size_ratio) {
+        return new TieredMergePolicy(size_ratio);
+    }
+
+    const MergePolicy* NewLeveledMergePolicy(double size_ratio) {
+        return new LeveledMergePolicy(size_ratio);
+    }
+
+}  // namespace softdb
@@ -24,10 +24,22 @@ Options::Options()
           //max_file_size(2<<20),
           //compression(kSnappyCompression),
           reuse_logs(false),
+          use_mmap_log(false),
+          pipelined_write(false),
           //filter_policy(nullptr)
           use_cuckoo(true),
+          filter_type(kCuckooFilter),
+          filter_bits(32),
+          prefix_extractor(nullptr),
+          use_range_filter(false),
           max_overlap(2),
+          flat_index(false),
+          index_partitions(1),
+          merge_guards(false),
+          merge_policy(nullptr),
+          max_subcompactions(1),
           run_in_dram(true),
+          zero_copy_flush(false),
           peak(100)
           {
 }
@@ -0,0 +1,43 @@
+//
+// Created by lingo on 19-5-22.
+//
+
+#include <string>
+
+#include "softdb/slice_transform.h"
+#include "softdb/slice.h"
+
+namespace softdb {
+
+    SliceTransform::~SliceTransform() { }
+
+    namespace {
+        class FixedPrefixTransform : public SliceTransform {
+        public:
+            explicit FixedPrefixTransform(size_t prefix_len)
+                    : prefix_len_(prefix_len),
+                      name_("softdb.FixedPrefix." + std::to_string(prefix_len)) { }
+
+            virtual const char* Name() const {
+                return name_.c_str();
+            }
+
+            virtual Slice Transform(const Slice& key) const {
+                return Slice(key.data(), prefix_len_);
+            }
+
+            virtual bool InDomain(const Slice& key) const {
+                return key.size() >= prefix_len_;
+            }
+
+        private:
+            const size_t prefix_len_;
+            const std::string name_;
+        };
+    }  // namespace
+
+    const SliceTransform* NewFixedPrefixTransform(size_t prefix_len) {
+        return new FixedPrefixTransform(prefix_len);
+    }
+
+}  // namespace softdb
@@ -0,0 +1,175 @@
+//
+// Created by lingo on 19-3-24.
+//
+
+#include "util/thread_local.h"
+
+#include <assert.h>
+#include <atomic>
+#include "port/port.h"
+#include "port/thread_annotations.h"
+#include "util/mutexlock.h"
+#include "util/no_destructor.h"
+
+namespace softdb {
+
+namespace {
+
+struct Entry {
+    std::atomic<void*> ptr;
+
+    Entry() : ptr(nullptr) { }
+    // Only copied while the entries of a thread grow, under the mutex of
+    // StaticMeta, so no Scrape() runs meanwhile.
+    Entry(const Entry& e) : ptr(e.ptr.load(std::memory_order_relaxed)) { }
+};
+
+// The values of a thread, entries[id] for the ThreadLocalPtr of id,
+// linked into the list of all threads.
+struct ThreadData {
+    std::vector<Entry> entries;
+    ThreadData* next;
+    ThreadData* prev;
+
+    ThreadData() : next(this), prev(this) { }
+};
+
+// Ids of the ThreadLocalPtrs, and the threads having values.
+class StaticMeta {
+public:
+    StaticMeta() : next_id_(0) { }
+
+    uint32_t NewId(ThreadLocalPtr::UnrefHandler handler) {
+        MutexLock l(&mutex_);
+        uint32_t id;
+        if (!free_ids_.empty()) {
+            id = free_ids_.back();
+            free_ids_.pop_back();
+        } else {
+            id = next_id_++;
+            handlers_.resize(next_id_);
+        }
+        handlers_[id] = handler;
+        return id;
+    }
+
+    // Clear the values of id left by threads, so that a ThreadLocalPtr
+    // reusing id starts with nullptr.
+    void ReleaseId(uint32_t id) {
+        MutexLock l(&mutex_);
+        for (ThreadData* t = head_.next; t != &head_; t = t->next) {
+            if (id < t->entries.size()) {
+                t->entries[id].ptr.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+        handlers_[id] = nullptr;
+        free_ids_.push_back(id);
+    }
+
+    // Return the entry of id of the calling thread.
+    Entry* GetEntry(uint32_t id);
+
+    void Scrape(uint32_t id, std::vector<void*>* ptrs, void* replacement) {
+        MutexLock l(&mutex_);
+        for (ThreadData* t = head_.next; t != &head_; t = t->next) {
+            if (id < t->entries.size()) {
+                void* ptr = t->entries[id].ptr.exchange(replacement, std::memory_order_acquire);
+                if (ptr != nullptr) {
+                    ptrs->push_back(ptr);
+                }
+            }
+        }
+    }
+
+    // The handlers run under mutex_, so a ThreadLocalPtr being destroyed
+    // waits for them.
+    void OnThreadExit(ThreadData* t) {
+        MutexLock l(&mutex_);
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        for (uint32_t id = 0; id < t->entries.size(); id++) {
+            void* ptr = t->entries[id].ptr.load(std::memory_order_relaxed);
+            if (ptr != nullptr && handlers_[id] != nullptr) {
+                handlers_[id](ptr);
+            }
+        }
+        delete t;
+    }
+
+private:
+    port::Mutex mutex_;
+    ThreadData head_ GUARDED_BY(mutex_);
+    uint32_t next_id_ GUARDED_BY(mutex_);
+    std::vector<uint32_t> free_ids_ GUARDED_BY(mutex_);
+    std::vector<ThreadLocalPtr::UnrefHandler> handlers_ GUARDED_BY(mutex_);
+};
+
+StaticMeta* Meta() {
+    static NoDestructor<StaticMeta> meta;
+    return meta.get();
+}
+
+// Hands the values of a thread to the handlers when the thread exits.
+struct ThreadDataHolder {
+    ThreadData* data;
+
+    ThreadDataHolder() : data(nullptr) { }
+    ~ThreadDataHolder() {
+        if (data != nullptr) {
+            Meta()->OnThreadExit(data);
+        }
+    }
+};
+
+thread_local ThreadDataHolder thread_data;
+
+Entry* StaticMeta::GetEntry(uint32_t id) {
+    ThreadData* t = thread_data.data;
+    if (t == nullptr || id >= t->entries.size()) {
+        MutexLock l(&mutex_);
+        if (t == nullptr) {
+            t = new ThreadData;
+            t->next = &head_;
+            t->prev = head_.prev;
+            t->prev->next = t;
+            t->next->prev = t;
+            thread_data.data = t;
+        }
+        if (id >= t->entries.size()) {
+            t->entries.resize(next_id_);
+        }
+    }
+    return &t->entries[id];
+}
+
+}  // namespace
+
+ThreadLocalPtr::ThreadLocalPtr(UnrefHandler handler)
+        : id_(Meta()->NewId(handler)) { }
+
+ThreadLocalPtr::~ThreadLocalPtr() {
+    Meta()->ReleaseId(id_);
+}
+
+void* ThreadLocalPtr::Get() const {
+    return Meta()->GetEntry(id_)->ptr.load(std::memory_order_acquire);
+}
+
+void ThreadLocalPtr::Reset(void* ptr) {
+    Meta()->GetEntry(id_)->ptr.store(ptr, std::memory_order_release);
+}
+
+void* ThreadLocalPtr::Swap(void* ptr) {
+    return Meta()->GetEntry(id_)->ptr.exchange(ptr, std::memory_order_acquire);
+}
+
+bool ThreadLocalPtr::CompareAndSwap(void* ptr, void*& expected) {
+    return Meta()->GetEntry(id_)->ptr.compare_exchange_strong(
+            expected, ptr, std::memory_order_release, std::memory_order_relaxed);
+}
+
+void ThreadLocalPtr::Scrape(std::vector<void*>* ptrs, void* replacement) {
+    Meta()->Scrape(id_, ptrs, replacement);
+}
+
+}  // namespace softdb
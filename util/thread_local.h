@@ -0,0 +1,61 @@
+//
+// Created by lingo on 19-3-24.
+//
+
+#ifndef SOFTDB_THREAD_LOCAL_H
+#define SOFTDB_THREAD_LOCAL_H
+
+
+#include <stdint.h>
+#include <vector>
+
+namespace softdb {
+
+// A pointer every thread has a value of its own for, and unlike a
+// thread_local variable, every ThreadLocalPtr has values of its own too,
+// so an object can keep per-thread state in a member.
+//
+// The values of all threads can be taken away at once by Scrape(), and
+// the value a thread leaves when it exits is handed to the UnrefHandler.
+// Get(), Reset(), Swap() and CompareAndSwap() on the value of the calling
+// thread take no lock.
+class ThreadLocalPtr {
+public:
+    // Called with the non-null value of a thread when the thread exits.
+    typedef void (*UnrefHandler)(void* ptr);
+
+    explicit ThreadLocalPtr(UnrefHandler handler = nullptr);
+
+    // Values still held by threads are dropped without being handed to
+    // the UnrefHandler, Scrape() them first if they need cleanup.
+    ~ThreadLocalPtr();
+
+    // Return the value of the calling thread, nullptr if it is not set.
+    void* Get() const;
+
+    // Set the value of the calling thread to ptr.
+    void Reset(void* ptr);
+
+    // Set the value of the calling thread to ptr and return the old one.
+    void* Swap(void* ptr);
+
+    // Set the value of the calling thread to ptr if it is expected and
+    // return true, otherwise store the value in expected and return false.
+    bool CompareAndSwap(void* ptr, void*& expected);
+
+    // Set the values of all threads to replacement and store the non-null
+    // old ones in *ptrs.
+    void Scrape(std::vector<void*>* ptrs, void* replacement);
+
+private:
+    const uint32_t id_;
+
+    // No copying allowed
+    ThreadLocalPtr(const ThreadLocalPtr&);
+    void operator=(const ThreadLocalPtr&);
+};
+
+}  // namespace softdb
+
+
+#endif //SOFTDB_THREAD_LOCAL_H
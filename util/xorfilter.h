@@ -0,0 +1,247 @@
+//
+// Created by lingo on 19-5-20.
+//
+
+#ifndef SOFTDB_XORFILTER_H
+#define SOFTDB_XORFILTER_H
+
+#include <cstring>
+#include <cstdint>
+#include <assert.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "hashutil.h"
+#include "softdb/slice.h"
+
+namespace CuckooHash {
+
+// Static xor filter (Graf & Lemire, "Xor Filters: Faster and Smaller
+// Than Bloom and Cuckoo Filters").
+//
+// Every key must be known before the filter can answer queries, which
+// suits nvm_imm_: all keys are handed over in NvmMemTable::Transport.
+// Keys are buffered by Add() and the fingerprint array is built by Build().
+// It costs about 1.23 * bits_per_fingerprint bits per key, false positive
+// rate is 2^-bits_per_fingerprint.
+template <typename FingerprintType>
+class XorFilter {
+private:
+
+    typedef typename softdb::Slice Slice;
+
+    static const uint32_t xorMurmurSeed = 816922183;
+
+    // give up remixing after so many failed constructions,
+    // fall back to removing duplicate hashes.
+    static const size_t kMaxRetriesBeforeDedup = 8;
+
+    // hashes of keys added but not built yet.
+    std::vector<uint64_t> keys_;
+
+    FingerprintType* fingerprints_;
+    size_t array_length_;
+    size_t block_length_;
+    uint64_t seed_;
+    size_t num_items_;
+
+    static inline uint64_t Mix(uint64_t h, uint64_t seed) {
+        h += seed;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static inline uint64_t Rotl64(uint64_t n, unsigned int c) {
+        return (n << (c & 63)) | (n >> ((-c) & 63));
+    }
+
+    // map a 32 bits value uniformly into [0, n)
+    static inline uint32_t Reduce(uint32_t hash, uint32_t n) {
+        return (uint32_t)(((uint64_t) hash * n) >> 32);
+    }
+
+    inline FingerprintType Fingerprint(uint64_t h) const {
+        return (FingerprintType)(h ^ (h >> 32));
+    }
+
+    inline size_t HashIndex(uint64_t h, int i) const {
+        return Reduce((uint32_t) Rotl64(h, i * 21), block_length_) + i * block_length_;
+    }
+
+    bool BuildImpl(uint8_t* count, uint64_t* xormask,
+                   size_t* queue, uint64_t* stack_hash, size_t* stack_index);
+
+    // No copying allowed
+    XorFilter(const XorFilter&);
+    void operator=(const XorFilter&);
+
+public:
+    explicit XorFilter(const int max_num_keys)
+            : fingerprints_(nullptr),
+              array_length_(0),
+              block_length_(0),
+              seed_(0),
+              num_items_(0) {
+        keys_.reserve(std::max(max_num_keys, 0));
+    }
+
+    ~XorFilter() { delete[] fingerprints_; }
+
+    // Add an item to the filter, duplicate items are allowed.
+    // REQUIRES: Build() not called yet.
+    bool Add(const Slice& item) {
+        assert(fingerprints_ == nullptr);
+        keys_.push_back(MurmurHash64A(item.data(), static_cast<int>(item.size()), xorMurmurSeed));
+        return true;
+    }
+
+    // Build the fingerprint array from the items added, once called, never again.
+    void Build();
+
+    // Report if the item is inserted, with false positive rate.
+    // REQUIRES: Build() has been called.
+    bool Contain(const Slice& key) const {
+        if (num_items_ == 0) {
+            return false;
+        }
+        const uint64_t hash = Mix(MurmurHash64A(key.data(), static_cast<int>(key.size()), xorMurmurSeed), seed_);
+        const FingerprintType f = Fingerprint(hash);
+        return f == (fingerprints_[HashIndex(hash, 0)] ^
+                     fingerprints_[HashIndex(hash, 1)] ^
+                     fingerprints_[HashIndex(hash, 2)]);
+    }
+
+    // number of current inserted items;
+    size_t Size() const { return num_items_; }
+
+    // size of the filter in bytes.
+    size_t SizeInBytes() const {
+        return array_length_ * sizeof(FingerprintType) + keys_.capacity() * sizeof(uint64_t);
+    }
+
+    std::string Info() const {
+        std::stringstream ss;
+        ss << "XorFilter Status:\n"
+           << "\t\tFingerprint size: " << sizeof(FingerprintType) * 8 << " bits\n"
+           << "\t\tKeys stored: " << Size() << "\n"
+           << "\t\tFilter size: " << (SizeInBytes() >> 10) << " KB\n";
+        if (Size() > 0) {
+            ss << "\t\tbit/key:   " << 8.0 * SizeInBytes() / Size() << "\n";
+        } else {
+            ss << "\t\tbit/key:   N/A\n";
+        }
+        return ss.str();
+    }
+};
+
+template <typename FingerprintType>
+void XorFilter<FingerprintType>::Build() {
+    assert(fingerprints_ == nullptr);
+    const size_t size = keys_.size();
+    array_length_ = 32 + (size_t)(1.23 * size);
+    block_length_ = array_length_ / 3;
+    array_length_ = block_length_ * 3;
+    fingerprints_ = new FingerprintType[array_length_];
+    memset(fingerprints_, 0, sizeof(FingerprintType) * array_length_);
+
+    uint8_t* count = new uint8_t[array_length_];
+    uint64_t* xormask = new uint64_t[array_length_];
+    size_t* queue = new size_t[array_length_];
+    uint64_t* stack_hash = new uint64_t[size + 1];
+    size_t* stack_index = new size_t[size + 1];
+
+    uint64_t rng = 0x726b2b9d438b9d4dULL;
+    for (size_t retries = 0; ; retries++) {
+        rng += 0x9E3779B97F4A7C15ULL;
+        seed_ = Mix(rng, 0);
+        if (BuildImpl(count, xormask, queue, stack_hash, stack_index)) {
+            break;
+        }
+        // Identical hashes never peel, a new seed won't help.
+        if (retries == kMaxRetriesBeforeDedup) {
+            std::sort(keys_.begin(), keys_.end());
+            keys_.erase(std::unique(keys_.begin(), keys_.end()), keys_.end());
+        }
+    }
+    num_items_ = keys_.size();
+
+    delete[] count;
+    delete[] xormask;
+    delete[] queue;
+    delete[] stack_hash;
+    delete[] stack_index;
+    // keys are useless once fingerprints are built.
+    std::vector<uint64_t>().swap(keys_);
+}
+
+// Peel the 3-hypergraph, assign fingerprints in reverse peeling order.
+// Return false if the hypergraph has a cycle.
+template <typename FingerprintType>
+bool XorFilter<FingerprintType>::BuildImpl(uint8_t* count, uint64_t* xormask,
+                                           size_t* queue, uint64_t* stack_hash,
+                                           size_t* stack_index) {
+    const size_t size = keys_.size();
+    memset(count, 0, array_length_);
+    memset(xormask, 0, sizeof(uint64_t) * array_length_);
+
+    for (size_t k = 0; k < size; k++) {
+        const uint64_t hash = Mix(keys_[k], seed_);
+        for (int i = 0; i < 3; i++) {
+            const size_t index = HashIndex(hash, i);
+            count[index]++;
+            xormask[index] ^= hash;
+        }
+    }
+
+    size_t qsize = 0;
+    for (size_t i = 0; i < array_length_; i++) {
+        if (count[i] == 1) {
+            queue[qsize++] = i;
+        }
+    }
+
+    size_t ssize = 0;
+    while (qsize > 0) {
+        const size_t index = queue[--qsize];
+        if (count[index] != 1) {
+            continue;
+        }
+        const uint64_t hash = xormask[index];
+        stack_hash[ssize] = hash;
+        stack_index[ssize] = index;
+        ssize++;
+        for (int i = 0; i < 3; i++) {
+            const size_t j = HashIndex(hash, i);
+            count[j]--;
+            xormask[j] ^= hash;
+            if (count[j] == 1) {
+                queue[qsize++] = j;
+            }
+        }
+    }
+
+    if (ssize != size) {
+        return false;
+    }
+
+    memset(fingerprints_, 0, sizeof(FingerprintType) * array_length_);
+    while (ssize > 0) {
+        ssize--;
+        const uint64_t hash = stack_hash[ssize];
+        const size_t index = stack_index[ssize];
+        fingerprints_[index] = Fingerprint(hash) ^
+                               fingerprints_[HashIndex(hash, 0)] ^
+                               fingerprints_[HashIndex(hash, 1)] ^
+                               fingerprints_[HashIndex(hash, 2)];
+    }
+    return true;
+}
+
+}   // namespace CuckooHash
+
+#endif //SOFTDB_XORFILTER_H